@@ -2,16 +2,26 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <string.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <assert.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
+#include <errno.h>
 
 #include <vector>
+#include <map>
 
 #include "harmonydb.h"
 #include "execution_engine.h"
+#include "hdb_census.h"
+#include "hdb_merkle.h"
+#include "hdb_node.h"
+#include "hdb_simulation.h"
+#include "hdb_server.h"
+#include "hdb_reactor.h"
 
 
 list<HarmonyItem *> current_path;
@@ -21,6 +31,8 @@ HarmonyObject *shell_context = NULL;
 HarmonyObject *shell_receiver;
 
 ExecutionEngine *engine;
+HdbNode *node;
+HdbSimulation *simulation;      // NULL unless --simulate
 
 
 vector<string> parse_command_line(const char *line)
@@ -102,7 +114,7 @@ void shell_cd(const vector<string> &fields)
     if (!current_path.empty())
         parent = current_path.back()->object;
     for (item = parent->first(); item; item = item->nextItem(parent)) {
-        if (item->label == fields[1] || item->object->getKey() == fields[1]) {
+        if (item->indexLabel() == fields[1] || item->object->getKey() == fields[1]) {
             // if (item->object->isEmpty() && item->object) {
             //     PF("Object is empty!");
             //     return;
@@ -167,7 +179,7 @@ void shell_send(const vector<string> &fields)
         parent = current_path.back()->object;
     for (item = parent->first(); item; item = item->nextItem(parent)) {
         if (item->label == fields[1] || item->object->getKey() == fields[1]) {
-            receiver = item->object;
+            receiver = item->object->getObject();
         }
         if (item->label == fields[2] || item->object->getKey() == fields[2]) {
             arg = item->object;
@@ -214,10 +226,304 @@ static void shell_dump(const vector<string> &fields)
     }
 }
 
-void shell(void)
+static void shell_stubs()
+{
+    printf("loaded: %u  pending: %lu\n", db->stubs_loaded, db->lazy_stubs.size());
+}
+
+// stats [reset]
+static void shell_stats(const vector<string> &fields)
+{
+    if (fields.size() > 1 && fields[1] == "reset")
+        hdb_stats.resetHistograms();
+    else
+        hdb_stats.print(stdout);
+}
+
+// profile start [period] | stop | report [top] [collapsed stacks file]
+static void shell_profile(const vector<string> &fields)
+{
+    if (fields.size() < 2)
+        return;
+    if (fields[1] == "start") {
+        engine->profiler.start(fields.size() > 2 ? strtoul(fields[2].c_str(), NULL, 10): 1);
+    } else if (fields[1] == "stop") {
+        engine->profiler.stop();
+    } else if (fields[1] == "report") {
+        engine->profiler.report(fields.size() > 2 ? strtoul(fields[2].c_str(), NULL, 10): 20);
+        if (fields.size() > 3 && !engine->profiler.writeStacks(fields[3]))
+            PF("Couldn't write %s!", fields[3].c_str());
+    }
+}
+
+// trace start | stop <file>
+static void shell_trace(const vector<string> &fields)
+{
+    if (fields.size() < 2)
+        return;
+    if (fields[1] == "start") {
+        engine->tracer.start();
+    } else if (fields[1] == "stop") {
+        engine->tracer.stop();
+        if (fields.size() > 2 && !engine->tracer.save(fields[2]))
+            PF("Couldn't write %s!", fields[2].c_str());
+    }
+}
+
+// mem | mem quota <bytes> [abort|park] | mem resume
+static void shell_mem(const vector<string> &fields)
+{
+    if (fields.size() == 1) {
+        hdb_memory.countStrings(db->getRoot());
+        hdb_memory.print(stdout);
+        printf("parked: %lu\n", engine->parked.size());
+    } else if (fields[1] == "quota" && fields.size() > 2) {
+        hdb_memory.quota = strtoll(fields[2].c_str(), NULL, 10);
+        if (fields.size() > 3)
+            hdb_memory.policy = fields[3] == "park" ? HdbMemory::PARK: HdbMemory::ABORT;
+        for (auto a: hdb_memory.accounts)
+            a->quota = hdb_memory.quota;
+    } else if (fields[1] == "resume") {
+        for (auto ctx: engine->parked)
+            engine->run_queue.push(ctx);
+        engine->parked.clear();
+        engine->run();
+    }
+}
+
+static void shell_census()
+{
+    HdbCensus census;
+
+    census.walk(db);
+    census.print(stdout);
+}
+
+// diff <base> compares the current object with the one at its path in the
+// base (e.g. a dump of this one) by their Merkle hashes
+static void shell_diff(const vector<string> &fields)
+{
+    struct stat sb;
+
+    if (fields.size() < 2 || stat(fields[1].c_str(), &sb)) {
+        PF("diff <base>");
+        return;
+    }
+    auto other = buildBase(fields[1].c_str(), db->lazy, db->direct_loader, db->mmap_scanner);
+    HarmonyObject *a = db->getRoot(), *b = other->getRoot();
+    string path;
+
+    for (auto item: current_path) {
+        auto label = item->indexLabel();
+        HarmonyItem *i;
+
+        for (i = b->first(); i && i->indexLabel() != label; i = i->nextItem(b))
+            ;
+        if (!i) {
+            printf("- %s.%s\n", path.c_str(), label.c_str());
+            delete other;
+            return;
+        }
+        a = item->object;
+        b = i->object;
+        path += "." + label;
+    }
+    HdbMerkle here(db->getRoot()), there(other->getRoot());
+    auto n = here.diff(a, there, b, path.empty() ? ".": path, stdout);
+    printf("%u differences, %u objects compared\n", n, here.compared);
+    delete other;
+}
+
+// on the node's clock, the virtual one in a simulation
+static long msSince(uint64_t start)
+{
+    return (long)((node->nowNs(CLOCK_MONOTONIC) - start) / 1000000);
+}
+
+// node | node connect <id> <address> | node wait [ms] | node migrate <context> <id> | node balance [ms] |
+// node replica <subtree> <id> | node gc
+static void shell_node(const vector<string> &fields)
+{
+    if (!node) {
+        PF("Not a node, see --node");
+        return;
+    }
+    if (fields.size() < 2) {
+        node->print(stdout);
+    } else if (fields[1] == "connect" && fields.size() > 3) {
+        node->addPeer(fields[2], fields[3]);
+    } else if (fields[1] == "wait") {
+        auto start = node->nowNs(CLOCK_MONOTONIC);
+        long timeout = fields.size() > 2 ? strtol(fields[2].c_str(), NULL, 10): 1000;
+
+        for (;;) {
+            node->flush();
+            if (!node->outstanding() && engine->run_queue.empty() && node->synced())
+                break;
+            long left = timeout - msSince(start);
+            if (left <= 0) {
+                PF("%zu replies still outstanding%s", node->outstanding(), node->synced() ? "": ", replicas not synced");
+                break;
+            }
+            node->poll(left);
+        }
+    } else if (fields[1] == "migrate" && fields.size() > 3) {
+        auto contexts = db->getRoot()->findItem("context")->object;
+        HarmonyItem *item;
+
+        for (item = contexts->first(); item; item = item->nextItem(contexts))
+            if (item->indexLabel() == fields[2] || item->object->getKey() == fields[2])
+                break;
+        if (!item)
+            PF("No context %s", fields[2].c_str());
+        else if (node->migrate(item->object, fields[3]))
+            node->flush();
+    } else if (fields[1] == "balance" && fields.size() > 2) {
+        node->balance_interval = strtoul(fields[2].c_str(), NULL, 10);
+    } else if (fields[1] == "balance") { // one round, with the loads of all the peers
+        auto start = node->nowNs(CLOCK_MONOTONIC);
+
+        node->loads.clear();
+        node->report(true);
+        while (node->loads.size() < node->addresses.size() && msSince(start) < 1000)
+            node->poll(100, false);
+        printf("%u contexts migrated\n", node->balance());
+    } else if (fields[1] == "replica" && fields.size() > 3) {
+        if (node->subscribe(fields[2], fields[3]))
+            node->flush();
+    } else if (fields[1] == "gc") {   // a round of the leases now
+        node->renew();
+        node->reconcile();
+        node->flush();
+    }
+}
+
+// sim | sim node <id> <base> | sim latency <min us> [max us] | sim reorder <p> | sim drop <p> |
+// sim partition <id> <id> | sim heal [<id> <id>] | sim run <ms> | sim dump <id> <directory>
+static void shell_sim(const vector<string> &fields)
+{
+    if (!simulation) {
+        PF("Not a simulation, see --simulate");
+        return;
+    }
+    if (fields.size() < 2) {
+        simulation->print(stdout);
+    } else if (fields[1] == "node" && fields.size() > 3) {  // with the settings of this one
+        auto n = simulation->add(fields[2], fields[3].c_str(), db->lazy);
+        if (n) {
+            n->lease = node->lease;
+            n->balance_interval = node->balance_interval;
+            n->engine->slice = engine->slice;
+        }
+    } else if (fields[1] == "latency" && fields.size() > 2) {
+        simulation->latency_min = strtoul(fields[2].c_str(), NULL, 10);
+        simulation->latency_max = fields.size() > 3 ? strtoul(fields[3].c_str(), NULL, 10): simulation->latency_min;
+    } else if (fields[1] == "reorder" && fields.size() > 2) {
+        simulation->reorder = atof(fields[2].c_str());
+    } else if (fields[1] == "drop" && fields.size() > 2) {
+        simulation->drop = atof(fields[2].c_str());
+    } else if (fields[1] == "partition" && fields.size() > 3) {
+        simulation->partition(fields[2], fields[3]);
+    } else if (fields[1] == "heal") {
+        simulation->heal(fields.size() > 3 ? fields[2]: string(), fields.size() > 3 ? fields[3]: string());
+    } else if (fields[1] == "run" && fields.size() > 2) {
+        node->flush();
+        simulation->run(simulation->clock + strtoul(fields[2].c_str(), NULL, 10) * 1000000ull);
+        node->poll(0);
+    } else if (fields[1] == "dump" && fields.size() > 3) {
+        auto n = simulation->nodes.find(fields[2]);
+        if (n == simulation->nodes.end())
+            PF("No node %s in the simulation", fields[2].c_str());
+        else
+            n->second.node->db->dumpBase(n->second.node->db->root.object, fields[3].c_str());
+    }
+}
+
+// from the root with a leading ".", from the current object otherwise
+static HarmonyObject * shell_lookup(const string &name)
+{
+    HarmonyObjectPath path;
+    auto start = current_path.empty() ? db->getRoot(): current_path.back()->object;
+
+    if (path.parse(name))
+        start = db->getRoot();
+    auto object = db->getObjectByPath(path, start);
+    if (!object)
+        PF("No %s", name.c_str());
+    return object ? object->getObject(): NULL;
+}
+
+// reactor | reactor timer <target> <ms> [once] | reactor read <target> <path> | reactor watch <target> <path> |
+// reactor cancel <id> | reactor run [ms]
+static void shell_reactor(const vector<string> &fields)
+{
+    HarmonyObject *target;
+    unsigned id = 0;
+
+    if (!engine->reactor)
+        engine->reactor = new HdbReactor(db, engine);
+    auto reactor = engine->reactor;
+    if (fields.size() < 2) {
+        reactor->print(stdout);
+    } else if (fields[1] == "timer" && fields.size() > 3 && (target = shell_lookup(fields[2]))) {
+        id = reactor->timer(target, atof(fields[3].c_str()) * 1e6, fields.size() < 5 || fields[4] != "once");
+    } else if (fields[1] == "read" && fields.size() > 3 && (target = shell_lookup(fields[2]))) {
+        struct stat buf;
+        // a FIFO open for writing too doesn't end with its writers, nor before the first one
+        bool fifo = !stat(fields[3].c_str(), &buf) && S_ISFIFO(buf.st_mode);
+        int fd = open(fields[3].c_str(), (fifo ? O_RDWR: O_RDONLY) | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+            PF("Couldn't open %s: %s", fields[3].c_str(), strerror(errno));
+        else
+            id = reactor->read(target, fd, true, fields[3]);
+    } else if (fields[1] == "watch" && fields.size() > 3 && (target = shell_lookup(fields[2]))) {
+        id = reactor->watch(target, fields[3]);
+    } else if (fields[1] == "cancel" && fields.size() > 2) {
+        if (!reactor->cancel(strtoul(fields[2].c_str(), NULL, 10)))
+            PF("No source %s", fields[2].c_str());
+    } else if (fields[1] == "run") {
+        reactor->run(fields.size() > 2 ? strtol(fields[2].c_str(), NULL, 10): -1, node);
+    }
+    if (id)
+        printf("source %u\n", id);
+}
+
+// the subtrees of the root by the node owning them, "*" for everyone
+static void shell_shards()
+{
+    multimap<string, HarmonyItem *> shards;
+
+    for (auto i = db->getRoot()->first(); i; i = i->nextItem(db->getRoot())) {
+        auto p = db->placement.find(i->label);
+        shards.insert({p != db->placement.end() ? p->second: string("*"), i});
+    }
+    printf("%-12s %-8s %s\n", "node", "state", "shard");
+    for (auto &s: shards) {
+        auto object = s.second->object;
+        const char *state = object->isRemote() ? "remote": object->lazy_loader ? "stub": "loaded";
+
+        printf("%-12s %-8s %s\n", s.first.c_str(), state, s.second->indexLabel().c_str());
+    }
+    if (!db->node.empty())
+        printf("this is node %s\n", db->node.c_str());
+}
+
+// perf start | stop | clear | report
+static void shell_perf(const vector<string> &fields)
+{
+    if (fields.size() < 2 || fields[1] == "report")
+        hdb_perf.report(stdout);
+    else if (fields[1] == "start") {
+        if (!hdb_perf.start())
+            PF("Performance counters are not available: %s", hdb_perf.error.c_str());
+    } else if (fields[1] == "stop")
+        hdb_perf.stop();
+    else if (fields[1] == "clear")
+        hdb_perf.clear();
+}
+
+void shell_init()
 {
-//    Configure readline to auto-complete paths when the tab key is hit.
-    // rl_bind_key('\t', rl_complete);
     auto context = db->getRoot()->findItem("context");
     if (context) {
         auto shell_context_item = context->object->findItem("shell");
@@ -235,6 +541,71 @@ void shell(void)
         shell_receiver->add(new HarmonyObject, "named", true);
         shell_receiver->add(new HarmonyObject, "unnamed", true);
     }
+}
+
+void shell_execute(const vector<string> &fields);
+
+// repeat N <command> [args...]
+static void shell_repeat(const vector<string> &fields)
+{
+    if (fields.size() < 3)
+        return;
+    auto n = strtoul(fields[1].c_str(), NULL, 10);
+    vector<string> command(fields.begin() + 2, fields.end());
+    for (unsigned long i = 0; i < n; i++)
+        shell_execute(command);
+}
+
+void shell_execute(const vector<string> &fields)
+{
+    if (fields.size() > 0) {
+        if (fields[0] == "ls") {
+            shell_ls();
+        } else if (fields[0] == "dump") {
+            shell_dump(fields);
+        } else if (fields[0] == "cd") {
+            shell_cd(fields);
+        } else if (fields[0] == "clone") {
+            shell_clone(fields);
+        } else if (fields[0] == "rm") {
+            shell_rm(fields);
+        } else if (fields[0] == "send") {
+            shell_send(fields);
+        } else if (fields[0] == "stubs") {
+            shell_stubs();
+        } else if (fields[0] == "stats") {
+            shell_stats(fields);
+        } else if (fields[0] == "profile") {
+            shell_profile(fields);
+        } else if (fields[0] == "trace") {
+            shell_trace(fields);
+        } else if (fields[0] == "mem") {
+            shell_mem(fields);
+        } else if (fields[0] == "census") {
+            shell_census();
+        } else if (fields[0] == "diff") {
+            shell_diff(fields);
+        } else if (fields[0] == "perf") {
+            shell_perf(fields);
+        } else if (fields[0] == "shards") {
+            shell_shards();
+        } else if (fields[0] == "node") {
+            shell_node(fields);
+        } else if (fields[0] == "sim") {
+            shell_sim(fields);
+        } else if (fields[0] == "reactor") {
+            shell_reactor(fields);
+        } else if (fields[0] == "repeat") {
+            shell_repeat(fields);
+        }
+    }
+}
+
+void shell(void)
+{
+//    Configure readline to auto-complete paths when the tab key is hit.
+    // rl_bind_key('\t', rl_complete);
+    shell_init();
     for (;;) {
         char prompt[257];
 
@@ -249,47 +620,208 @@ void shell(void)
         // Add input to readline history.
         add_history(input);
 
-        // Do stuff...
-        vector<string> fields;
-
-        fields = parse_command_line(input);
-        if (fields.size() > 0) {
-            if (fields[0] == "ls") {
-                shell_ls();
-            } else if (fields[0] == "dump") {
-                shell_dump(fields);
-            } else if (fields[0] == "cd") {
-                shell_cd(fields);
-            } else if (fields[0] == "clone") {
-                shell_clone(fields);
-            } else if (fields[0] == "rm") {
-                shell_rm(fields);
-            } else if (fields[0] == "send") {
-                shell_send(fields);
-            }
-        }
+        shell_execute(parse_command_line(input));
         // Free buffer that was allocated by readline
         free(input);
     }
     printf("\nBye!\n");
 }
 
-void initHarmony(const char *filepath) {
-    db = buildBase(filepath);
+struct ShellCounters {
+    struct timespec time;
+    uint64_t instructions, allocated, freed;
+
+    void sample() {
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        instructions = engine->instructions;
+        allocated = HarmonyObject::_objects_allocated;
+        freed = HarmonyObject::_objects_freed;
+    }
+};
+
+static double elapsedMs(const struct timespec &start, const struct timespec &end)
+{
+    return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+static void jsonString(FILE *f, const string &s)
+{
+    fputc('"', f);
+    for (auto c: s) {
+        if (c == '"' || c == '\\')
+            fputc('\\', f);
+        if ((unsigned char)c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+// Executes the commands of a file ("-" for stdin) and reports every one of
+// them as a line of JSON to the report file, followed by the totals.
+void script(const char *filepath, const char *report_filepath)
+{
+    FILE *f = stdin, *report = stderr;
+    ShellCounters first, before, after;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    unsigned line_number = 0, commands = 0;
+
+    if (strcmp(filepath, "-")) {
+        f = fopen(filepath, "r");
+        assertf(f, "Couldn't open %s!", filepath);
+    }
+    if (report_filepath) {
+        report = fopen(report_filepath, "w");
+        assertf(report, "Couldn't create %s!", report_filepath);
+    }
+    shell_init();
+    first.sample();
+    while ((length = getline(&line, &size, f)) >= 0) {
+        line_number++;
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = 0;
+        auto fields = parse_command_line(line);
+        if (fields.empty() || fields[0][0] == '#')
+            continue;
+        printf("%s> %s\n", getCurrentPath().c_str(), line);
+
+        before.sample();
+        shell_execute(fields);
+        after.sample();
+        commands++;
+
+        fflush(stdout);
+        fprintf(report, "{\"line\": %u, \"command\": ", line_number);
+        jsonString(report, line);
+        fprintf(report, ", \"time_ms\": %.3f, \"instructions\": %lu, \"allocated\": %lu, \"freed\": %lu, \"objects\": %u, \"run_queue\": %lu, \"wait_queue\": %lu}\n",
+            elapsedMs(before.time, after.time), after.instructions - before.instructions, after.allocated - before.allocated, after.freed - before.freed,
+            HarmonyObject::_object_count, engine->run_queue.size(), engine->wait_queue.size());
+        fflush(report);
+    }
+    fprintf(report, "{\"commands\": %u, \"time_ms\": %.3f, \"instructions\": %lu, \"allocated\": %lu, \"freed\": %lu, \"objects\": %u}\n",
+        commands, elapsedMs(first.time, after.time), after.instructions - first.instructions, after.allocated - first.allocated, after.freed - first.freed,
+        HarmonyObject::_object_count);
+    free(line);
+    if (f != stdin)
+        fclose(f);
+    if (report != stderr)
+        fclose(report);
+}
+
+void initHarmony(const char *filepath, bool lazy, bool direct_loader, bool mmap_scanner, const char *node_id) {
+    db = buildBase(filepath, lazy, direct_loader, mmap_scanner, node_id);
     engine = new ExecutionEngine(db);
 }
 
 int main(int argc, char *argv[])
 {
-    const char *filepath = NULL;
+    const char *filepath = NULL, *script_filepath = NULL, *report_filepath = NULL, *stats_filepath = NULL;
+    const char *node_id = NULL, *listen_address = NULL, *exit_dump = NULL, *clients_address = NULL;
+    vector<pair<string, string>> peers, replicas, sim_nodes;
+    bool serve = false, simulate = false;
+    uint64_t seed = 0;
+    unsigned stats_interval = 10, balance_interval = 0, slice = 0, lease = HDB_NODE_LEASE;
+    bool lazy = false, direct_loader = false, mmap_scanner = false;
     printf("Divee 1\n");
 
-    if (argc > 1)
-        filepath = argv[1];
-    initHarmony(filepath);
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--lazy"))
+            lazy = true;
+        else if (!strcmp(argv[i], "--direct"))
+            direct_loader = true;
+        else if (!strcmp(argv[i], "--mmap"))
+            mmap_scanner = true;
+        else if (!strcmp(argv[i], "--script") && i + 1 < argc)
+            script_filepath = argv[++i];
+        else if (!strcmp(argv[i], "--report") && i + 1 < argc)
+            report_filepath = argv[++i];
+        else if (!strcmp(argv[i], "--stats-file") && i + 1 < argc)
+            stats_filepath = argv[++i];
+        else if (!strcmp(argv[i], "--stats-interval") && i + 1 < argc)
+            stats_interval = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--node") && i + 1 < argc)
+            node_id = argv[++i];
+        else if (!strcmp(argv[i], "--listen") && i + 1 < argc)
+            listen_address = argv[++i];
+        else if (!strcmp(argv[i], "--peer") && i + 1 < argc) {
+            auto peer = argv[++i], eq = strchr(peer, '=');
+            assertf(eq, "--peer <id>=<address>!");
+            peers.push_back({string(peer, eq - peer), eq + 1});
+        } else if (!strcmp(argv[i], "--serve"))
+            serve = true;
+        else if (!strcmp(argv[i], "--clients") && i + 1 < argc)
+            clients_address = argv[++i];
+        else if (!strcmp(argv[i], "--balance") && i + 1 < argc)
+            balance_interval = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--slice") && i + 1 < argc)
+            slice = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--lease") && i + 1 < argc)
+            lease = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--replica") && i + 1 < argc) {
+            auto replica = argv[++i], eq = strchr(replica, '=');
+            assertf(eq, "--replica <subtree>=<node id>!");
+            replicas.push_back({string(replica, eq - replica), eq + 1});
+        } else if (!strcmp(argv[i], "--simulate") && i + 1 < argc) {
+            simulate = true;
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--sim-node") && i + 1 < argc) {
+            auto n = argv[++i], eq = strchr(n, '=');
+            assertf(eq, "--sim-node <id>=<base>!");
+            sim_nodes.push_back({string(n, eq - n), eq + 1});
+        } else if (!strcmp(argv[i], "--dump-at-exit") && i + 1 < argc)
+            exit_dump = argv[++i];
+        else
+            filepath = argv[i];
+    }
+    if (stats_filepath)
+        hdb_stats.startDumper(stats_filepath, stats_interval ? stats_interval: 1);
+    if (simulate && !node_id)
+        node_id = "main";
+    initHarmony(filepath, lazy, direct_loader, mmap_scanner, node_id);
     PF("BASE = %p", db);
-    shell();
+    engine->slice = slice;
+    if (node_id) {
+        node = new HdbNode(node_id, db, engine);
+        node->balance_interval = balance_interval;
+        node->lease = lease ? lease: 1;
+        engine->node = node;
+        for (auto &p: peers)
+            node->addPeer(p.first, p.second);
+        if (listen_address && !node->listen(listen_address))
+            return 1;
+        if (simulate) {
+            simulation = new HdbSimulation(seed);
+            simulation->attach(node, engine);
+            for (auto &n: sim_nodes)
+                shell_sim({"sim", "node", n.first, n.second});
+        }
+        for (auto &r: replicas)
+            node->subscribe(r.first, r.second);
+        node->flush();
+    }
+    if (clients_address) {      // serving the node too if it is one
+        auto server = new HdbServer(db, engine, node);
+        if (!server->listen(clients_address))
+            return 1;
+        server->serve();
+        delete server;
+    } else if (serve) {
+        assertf(node && listen_address, "--serve needs --node and --listen!");
+        node->serve();
+    } else if (script_filepath)
+        script(script_filepath, report_filepath);
+    else
+        shell();
+    if (exit_dump)
+        db->dumpBase(db->root.object, exit_dump);
+    delete engine->reactor;
+    delete node;
+    delete simulation;
     delete db;
+    hdb_stats.stopDumper();
     PF("Bye!");
     assertf(HarmonyObject::_object_count == 0, "object_count=%d!", HarmonyObject::_object_count);
     return 0;
@@ -0,0 +1,497 @@
+// Microbenchmarks of the object store, the engine and the loaders.
+// divee_bench [--perf] --benchmark_format=json --benchmark_out=results.json
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <ext/stdio_filebuf.h>
+#include <iostream>
+#include <benchmark/benchmark.h>
+
+#include "harmonydb.h"
+#include "execution_engine.h"
+#include "hdb_generator.h"
+#include "hdb_mmap_scanner.h"
+#include "hdb_node.h"
+#include "hdb_simulation.h"
+#include "hdb_reactor.h"
+
+static string scratch;  // directory for the generated bases and dumps
+
+static string scratchPath(const string &name)
+{
+    if (scratch.empty()) {
+        scratch = "/tmp/divee_bench." + to_string(getpid());
+        mkdir(scratch.c_str(), 0755);
+    }
+    return scratch + "/" + name;
+}
+
+static string writeBase(const string &name, const char *text)
+{
+    auto path = scratchPath(name);
+    auto f = fopen(path.c_str(), "w");
+
+    assertf(f, "Couldn't create %s!", path.c_str());
+    fputs(text, f);
+    fclose(f);
+    return path;
+}
+
+// generated once per parameter set and kept for the whole run
+static string generatedBase(unsigned objects, unsigned fanout = 10, unsigned depth = 4, double xrefs = 0.1)
+{
+    HdbGeneratorOptions options;
+    struct stat sb;
+
+    options.objects = objects;
+    options.fanout = fanout;
+    options.depth = depth;
+    options.xref_ratio = xrefs;
+    auto path = scratchPath("gen_" + to_string(objects) + "_" + to_string(fanout) + "_" + to_string(depth) + "_" + to_string(xrefs) + ".hdb");
+    if (stat(path.c_str(), &sb) != 0)
+        generateBase(options, path);
+    return path;
+}
+
+// hardware counters per iteration of the phase since start, with --perf
+static void perfCounters(benchmark::State &state, HdbPerfPhase phase, const HdbPerfCounts &start)
+{
+    auto &end = hdb_perf.phases[phase];
+
+    if (!hdb_perf.enabled || !state.iterations())
+        return;
+    for (unsigned e = 0; e < HDB_PERF_EVENTS; e++)
+        if (hdb_perf.fds[e] >= 0)
+            state.counters[HdbPerf::eventName(e)] = benchmark::Counter(end.values[e] - start.values[e], benchmark::Counter::kAvgIterations);
+}
+
+static size_t fileSize(const string &path)
+{
+    struct stat sb;
+
+    assertf(stat(path.c_str(), &sb) == 0, "Couldn't stat %s!", path.c_str());
+    return sb.st_size;
+}
+
+static HarmonyObject * getObject(HarmonyDB *db, const char *path)
+{
+    HarmonyObjectPath p;
+
+    p.parse(path);
+    auto o = db->getObjectByPath(p);
+    assertf(o, "%s not found!", path);
+    return o;
+}
+
+static const char *program_base =
+    "(\n"
+    "    t: <0, 99>,\n"
+    "    x: t[5],\n"
+    "    y: $,\n"
+    "    pattern: ( [relation.next, x, y, t] ),\n"
+    "    unknowns: ( y ),\n"
+    "    negatives: (),\n"
+    "    prog: ! (args: (x: $, return: $), body: ( > (args.return, args.x) )),\n"
+    "    arg: (x: (a: t[3], b: t[4])),\n"
+    "    receiver: (x: $),\n"
+    "    relation: (next: _, prev: _, me: _, type: _, first: _, last: _, proxy: _, label: _)\n"
+    ")\n";
+
+static void BM_add_remove(benchmark::State &state)
+{
+    auto set = new HarmonyObject;
+    HarmonyObjectReference keep;    // keeps the object alive between the iterations
+
+    set->root_distance = 1;
+    for (int i = 0; i < state.range(0); i++)
+        set->add(new HarmonyObject, "i" + to_string(i), true);
+    keep.setReference(new HarmonyObject, true);
+    for (auto _ : state) {
+        auto item = set->add(keep.object, "new");
+        set->remove(item);
+    }
+    keep.removeReference();
+    set->clear();
+    delete set;
+}
+BENCHMARK(BM_add_remove)->Arg(10)->Arg(100)->Arg(1000);
+
+static void BM_findItem(benchmark::State &state)
+{
+    auto set = new HarmonyObject;
+    auto last = "i" + to_string(state.range(0) - 1);
+
+    set->root_distance = 1;
+    for (int i = 0; i < state.range(0); i++)
+        set->add(new HarmonyObject, "i" + to_string(i), true);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(set->findItem(last));
+    set->clear();
+    delete set;
+}
+BENCHMARK(BM_findItem)->Arg(10)->Arg(100)->Arg(1000);
+
+static void BM_cloneObject(benchmark::State &state)
+{
+    auto db = buildBase(generatedBase(state.range(0)).c_str());
+    auto source = getObject(db, "g0");
+    auto target = new HarmonyObject;
+
+    db->getRoot()->add(target, "target", true);
+    auto perf = hdb_perf.phases[HDB_PERF_CLONE];
+    for (auto _ : state) {
+        START_SWEEP
+        db->cloneObject(source, target, "clone");
+        FINISH_SWEEP
+        target->remove(target->first());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    perfCounters(state, HDB_PERF_CLONE, perf);
+    delete db;
+}
+BENCHMARK(BM_cloneObject)->Arg(1000)->Arg(10000)->Unit(benchmark::kMicrosecond);
+
+static void BM_createContext(benchmark::State &state)
+{
+    auto db = buildBase(writeBase("program.hdb", program_base).c_str());
+    auto prog = getObject(db, "prog");
+    auto arg = getObject(db, "arg");
+
+    for (auto _ : state) {
+        auto ctx = db->createContext(prog, string(), NULL, arg);
+        auto contexts = getObject(db, "context");
+        contexts->remove(contexts->findItem(ctx));
+    }
+    delete db;
+}
+BENCHMARK(BM_createContext);
+
+static void BM_copyArgument(benchmark::State &state)
+{
+    auto db = buildBase(writeBase("program.hdb", program_base).c_str());
+    auto arg = getObject(db, "arg");
+    auto named = getObject(db, "receiver");
+
+    for (auto _ : state)
+        db->copyArgument(arg, named);
+    delete db;
+}
+BENCHMARK(BM_copyArgument);
+
+static void BM_execute_match(benchmark::State &state)
+{
+    auto db = buildBase(writeBase("program.hdb", program_base).c_str());
+    auto engine = new ExecutionEngine(db);
+    auto pattern = getObject(db, "pattern");
+    auto unknowns = getObject(db, "unknowns");
+    auto negatives = getObject(db, "negatives");
+
+    auto perf = hdb_perf.phases[HDB_PERF_MATCH];
+    for (auto _ : state)
+        benchmark::DoNotOptimize(engine->execute_match(pattern, unknowns, negatives));
+    perfCounters(state, HDB_PERF_MATCH, perf);
+    delete engine;
+    delete db;
+}
+BENCHMARK(BM_execute_match);
+
+// range(0): objects, range(1): fanout, range(2): depth, range(3): cross references in percent
+static void BM_dumpBase(benchmark::State &state)
+{
+    auto db = buildBase(generatedBase(state.range(0), state.range(1), state.range(2), state.range(3) / 100.0).c_str());
+    auto path = scratchPath("dump");
+    uint64_t bytes = db->dump_bytes;
+
+    auto perf = hdb_perf.phases[HDB_PERF_DUMP];
+    for (auto _ : state)
+        db->dumpBase(NULL, path);
+    state.SetBytesProcessed(db->dump_bytes - bytes);
+    perfCounters(state, HDB_PERF_DUMP, perf);
+    delete db;
+}
+BENCHMARK(BM_dumpBase)->Args({1000, 10, 4, 10})->Args({100000, 10, 4, 10})
+    ->Args({100000, 2, 16, 50}) // deep and heavily cross referenced, mostly getPath()
+    ->Unit(benchmark::kMillisecond);
+
+// range(0): objects, range(1): single pass loader, range(2): mmap scanner
+static void BM_buildBase(benchmark::State &state)
+{
+    auto path = generatedBase(state.range(0));
+
+    for (auto _ : state) {
+        auto db = buildBase(path.c_str(), false, state.range(1), state.range(2));
+        state.PauseTiming();
+        delete db;
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * fileSize(path));
+}
+BENCHMARK(BM_buildBase)->ArgsProduct({{10000, 100000}, {0, 1}, {0, 1}})->Unit(benchmark::kMillisecond);
+
+static void BM_tokenize(benchmark::State &state)
+{
+    auto path = generatedBase(state.range(0));
+    hdb_mmap_scanner scanner;
+    int fd = open(path.c_str(), O_RDONLY);
+    uint64_t tokens = 0;
+
+    assertf(fd >= 0, "Couldn't open %s!", path.c_str());
+    scanner.map(fd);
+    for (auto _ : state) {
+        yy::location loc;
+
+        scanner.p = scanner.data;
+        while (scanner.next(loc).kind != yy::parser::symbol_kind::S_YYEOF)
+            tokens++;
+    }
+    scanner.unmap();
+    close(fd);
+    state.SetBytesProcessed(state.iterations() * fileSize(path));
+    state.counters["tokens"] = benchmark::Counter(tokens, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_tokenize)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+// range(0): messages sent in a row to prog of a node in a child process, each
+// coming back to a receiver of its own, before waiting for the replies
+static void BM_remote_send(benchmark::State &state)
+{
+    auto base = writeBase("program.hdb", program_base);
+    auto address = "unix:" + scratchPath("node.sock");
+
+    auto pid = fork();
+    if (pid == 0) {
+        auto db = buildBase(base.c_str());
+        auto engine = new ExecutionEngine(db);
+        auto node = new HdbNode("server", db, engine);
+
+        engine->node = node;
+        if (node->listen(address))
+            node->serve();
+        _exit(0);
+    }
+    auto db = buildBase(base.c_str());
+    auto engine = new ExecutionEngine(db);
+    auto node = new HdbNode("client", db, engine);
+    engine->node = node;
+    node->addPeer("server", address);
+
+    auto rprog = new HarmonyObject;
+    rprog->hints[HINT_NODE] = "server";
+    rprog->hints[HINT_REMOTE] = ".prog";
+    db->getRoot()->add(rprog, "rprog", true);
+    auto receivers = new HarmonyObject;
+    db->getRoot()->add(receivers, "receivers", true);
+    for (int64_t i = 0; i < state.range(0); i++) {
+        auto receiver = new HarmonyObject(HarmonyObject::Type::RECEIVE);
+        receivers->add(receiver, string(), true);
+        receiver->add(new HarmonyObject, "named", true);
+        receiver->add(new HarmonyObject, "unnamed", true);
+    }
+    auto arg = getObject(db, "arg");
+
+    uint64_t bytes = node->bytes_sent->value() + node->bytes_received->value(), writes = node->writes->value();
+    for (auto _ : state) {
+        for (auto r = receivers->first(); r; r = r->nextItem(receivers)) {
+            db->clearArguments(r->object);
+            node->send(rprog, arg, r->object);
+        }
+        node->flush();
+        while (node->outstanding())
+            node->poll(1000);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(node->bytes_sent->value() + node->bytes_received->value() - bytes);
+    state.counters["writes"] = benchmark::Counter(node->writes->value() - writes, benchmark::Counter::kAvgIterations);
+
+    delete node;
+    delete engine;
+    delete db;
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+BENCHMARK(BM_remote_send)->Arg(1)->Arg(100)->Arg(1000)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+// BM_remote_send on the simulated network, both nodes in this process:
+// range(0) messages, flushed once each with range(1) instead of as a batch.
+// The protocol overhead shows as the packets and the virtual microseconds
+// of the round trips at 100 us of latency.
+static void BM_simulated_send(benchmark::State &state)
+{
+    auto base = writeBase("program.hdb", program_base);
+    HdbSimulation simulation(1);
+
+    simulation.add("server", base.c_str());
+    auto db = buildBase(base.c_str());
+    auto engine = new ExecutionEngine(db);
+    auto node = new HdbNode("client", db, engine);
+    engine->node = node;
+    simulation.attach(node, engine);
+
+    auto rprog = new HarmonyObject;
+    rprog->hints[HINT_NODE] = "server";
+    rprog->hints[HINT_REMOTE] = ".prog";
+    db->getRoot()->add(rprog, "rprog", true);
+    auto receivers = new HarmonyObject;
+    db->getRoot()->add(receivers, "receivers", true);
+    for (int64_t i = 0; i < state.range(0); i++) {
+        auto receiver = new HarmonyObject(HarmonyObject::Type::RECEIVE);
+        receivers->add(receiver, string(), true);
+        receiver->add(new HarmonyObject, "named", true);
+        receiver->add(new HarmonyObject, "unnamed", true);
+    }
+    auto arg = getObject(db, "arg");
+
+    uint64_t packets = simulation.packets->value(), clock = simulation.clock;
+    for (auto _ : state) {
+        for (auto r = receivers->first(); r; r = r->nextItem(receivers)) {
+            db->clearArguments(r->object);
+            node->send(rprog, arg, r->object);
+            if (state.range(1))
+                node->flush();
+        }
+        node->flush();
+        while (node->outstanding())
+            node->poll(1000);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.counters["packets"] = benchmark::Counter(simulation.packets->value() - packets, benchmark::Counter::kAvgIterations);
+    state.counters["virtual_us"] = benchmark::Counter((simulation.clock - clock) / 1e3, benchmark::Counter::kAvgIterations);
+
+    delete node;
+    delete engine;
+    delete db;
+}
+BENCHMARK(BM_simulated_send)->Args({1, 0})->Args({100, 0})->Args({100, 1})->Args({1000, 0})->Unit(benchmark::kMicrosecond);
+
+// a context receiving in a loop what the reactor sends it
+static const char *reactor_base =
+    "(\n"
+    "    loop: ! (args: (), body: ( l: ( w: < (n: (source: $, count: $, data: $), ()), l ) )),\n"
+    "    go: ()\n"
+    ")\n";
+
+static uint64_t cpuNs()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+// Wake latency: a byte written to a pipe (range 0) or a timer of range 1 us
+// expiring, to the receiving context passing its RECEIVE, the engine asleep
+// in epoll_wait() in between
+static void BM_reactor_wake(benchmark::State &state)
+{
+    auto base = writeBase("reactor.hdb", reactor_base);
+    auto db = buildBase(base.c_str());
+    auto engine = new ExecutionEngine(db);
+    int fds[2] = {-1, -1};
+
+    engine->sendMessage(getObject(db, "loop"), getObject(db, "go"));
+    auto reactor = new HdbReactor(db, engine);
+    engine->reactor = reactor;
+    auto receiver = getObject(db, "context.[0].root.body.l.w");
+    if (state.range(0)) {
+        assertf(!pipe(fds), "pipe!");
+        reactor->read(receiver, fds[0]);
+    } else {
+        reactor->timer(receiver, state.range(1) * 1000ull);
+    }
+    reactor->wakes->reset();
+
+    uint64_t sends = reactor->sends->value(), instructions = engine->instructions;
+    for (auto _ : state) {
+        auto sent = reactor->sends->value();
+
+        if (state.range(0))
+            assertf(write(fds[1], "x", 1) == 1, "write!");
+        while (reactor->sends->value() == sent)
+            reactor->poll(-1);
+    }
+    state.counters["sends"] = benchmark::Counter(reactor->sends->value() - sends, benchmark::Counter::kAvgIterations);
+    state.counters["instructions"] = benchmark::Counter(engine->instructions - instructions, benchmark::Counter::kAvgIterations);
+    if (!state.range(0)) {
+        state.counters["wake_p50_us"] = reactor->wakes->quantile(0.5) / 1e3;
+        state.counters["wake_p99_us"] = reactor->wakes->quantile(0.99) / 1e3;
+    }
+
+    delete reactor;
+    if (fds[1] >= 0)
+        close(fds[1]);
+    delete engine;
+    delete db;
+}
+BENCHMARK(BM_reactor_wake)->Args({1, 0})->Args({0, 100})->Args({0, 1000})->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+// Idle CPU: 100 ms of a reactor with a timer of range 0 ms sending to a
+// receiving context, the CPU time it took in percent of the wall time
+static void BM_reactor_idle(benchmark::State &state)
+{
+    auto base = writeBase("reactor.hdb", reactor_base);
+    auto db = buildBase(base.c_str());
+    auto engine = new ExecutionEngine(db);
+
+    engine->sendMessage(getObject(db, "loop"), getObject(db, "go"));
+    auto reactor = new HdbReactor(db, engine);
+    engine->reactor = reactor;
+    reactor->timer(getObject(db, "context.[0].root.body.l.w"), state.range(0) * 1000000ull);
+
+    uint64_t cpu = 0, sends = reactor->sends->value();
+    for (auto _ : state) {
+        auto start = cpuNs();
+
+        reactor->run(100);
+        cpu += cpuNs() - start;
+    }
+    state.counters["cpu_percent"] = cpu / (state.iterations() * 100e6) * 100;
+    state.counters["sends"] = benchmark::Counter(reactor->sends->value() - sends, benchmark::Counter::kAvgIterations);
+
+    delete reactor;
+    delete engine;
+    delete db;
+}
+BENCHMARK(BM_reactor_idle)->Arg(1)->Arg(10)->Arg(100)->Iterations(5)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+int main(int argc, char *argv[])
+{
+    bool perf = false;
+
+    // the counters are read around every call, so they are off by default
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--perf") {
+            perf = true;
+            for (int j = i; j < argc; j++)
+                argv[j] = argv[j + 1];
+            argc--;
+            break;
+        }
+    }
+    if (perf && !hdb_perf.start())
+        fprintf(stderr, "Performance counters are not available: %s\n", hdb_perf.error.c_str());
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+
+    // the reports go to the original stdout, the PF()/PT() logging to /dev/null
+    fflush(stdout);
+    int out = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    __gnu_cxx::stdio_filebuf<char> report(out, ios::out);
+    auto cout_buf = cout.rdbuf(&report);
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    cout.flush();
+    cout.rdbuf(cout_buf);
+    if (!scratch.empty())
+        system(("rm -rf " + scratch).c_str());
+    return 0;
+}
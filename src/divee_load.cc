@@ -0,0 +1,153 @@
+// Load generator of the client server (divee --clients): every connection
+// keeps up to --depth requests in flight until --requests were answered in
+// all, and the totals are printed as a line of JSON with the quantiles of
+// the latency from writing a request to reading its response.
+// divee_load [--clients N] [--depth N] [--requests N] [--request <line>] unix:<path>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "hdb_stats.h"
+
+using namespace std;
+
+struct LoadClient
+{
+    int fd;
+    string in, out;
+    uint64_t sent;                              // requests, numbered from 1 as the server does
+    unordered_map<uint64_t, uint64_t> started;  // number -> ns
+};
+
+static int connectTo(const string &address)
+{
+    struct sockaddr_un sa;
+    auto path = address.compare(0, 5, "unix:") ? address: address.substr(5);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0 || path.size() >= sizeof(sa.sun_path))
+        return -1;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path.c_str());
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void usage()
+{
+    printf("usage: divee_load [--clients N] [--depth N] [--requests N] [--request <line>] unix:<path>\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned clients = 1, depth = 1;
+    uint64_t total = 1000, issued = 0, answered = 0, errors = 0;
+    string request = "send prog arg", address;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--clients") && i + 1 < argc)
+            clients = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--depth") && i + 1 < argc)
+            depth = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--requests") && i + 1 < argc)
+            total = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--request") && i + 1 < argc)
+            request = argv[++i];
+        else if (argv[i][0] != '-')
+            address = argv[i];
+        else
+            usage();
+    }
+    if (address.empty() || !clients || !depth)
+        usage();
+
+    HdbHistogram latencies("divee_load_latency_seconds", "", "");
+    vector<LoadClient> connections(clients);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    for (unsigned i = 0; i < clients; i++) {
+        struct epoll_event ev;
+
+        connections[i].fd = connectTo(address);
+        if (connections[i].fd < 0) {
+            fprintf(stderr, "Couldn't connect to %s: %s\n", address.c_str(), strerror(errno));
+            return 1;
+        }
+        connections[i].sent = 0;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connections[i].fd, &ev);
+    }
+
+    auto start = hdbNowNs();
+    while (answered < total) {
+        struct epoll_event events[64];
+
+        for (auto &c: connections) {
+            while (c.started.size() < depth && issued < total) {
+                c.out += request + "\n";
+                c.started[++c.sent] = hdbNowNs();
+                issued++;
+            }
+            if (!c.out.empty()) {   // blocking, the responses are read below
+                auto n = ::write(c.fd, c.out.data(), c.out.size());
+                if (n < 0) {
+                    fprintf(stderr, "The server is gone: %s\n", strerror(errno));
+                    return 1;
+                }
+                c.out.erase(0, n);
+            }
+        }
+        auto n = epoll_wait(epoll_fd, events, 64, 1000);
+        for (int i = 0; i < n; i++) {
+            auto &c = connections[events[i].data.u32];
+            char buffer[65536];
+            size_t used = 0, end;
+
+            auto got = ::read(c.fd, buffer, sizeof(buffer));
+            if (got <= 0) {
+                fprintf(stderr, "The server closed the connection\n");
+                return 1;
+            }
+            c.in.append(buffer, got);
+            while ((end = c.in.find('\n', used)) != string::npos) {
+                auto number = strtoull(c.in.c_str() + used, NULL, 10);
+                auto s = c.started.find(number);
+                auto status = c.in.find(' ', used);
+
+                if (status > end || c.in.compare(status + 1, 2, "ok"))
+                    errors++;
+                if (s != c.started.end()) {
+                    latencies.record(hdbNowNs() - s->second);
+                    c.started.erase(s);
+                    answered++;
+                }
+                used = end + 1;
+            }
+            c.in.erase(0, used);
+        }
+    }
+    double seconds = (hdbNowNs() - start) / 1e9;
+
+    printf("{\"clients\": %u, \"depth\": %u, \"requests\": %lu, \"errors\": %lu, \"seconds\": %.3f, \"rate\": %.0f, "
+        "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}\n", clients, depth, answered, errors, seconds,
+        answered / seconds, latencies.quantile(0.5) / 1e3, latencies.quantile(0.99) / 1e3, latencies.quantile(0.999) / 1e3,
+        latencies.max / 1e3);
+    for (auto &c: connections)
+        close(c.fd);
+    close(epoll_fd);
+    return 0;
+}
@@ -1,11 +1,14 @@
+#include <algorithm>
 #include "execution_engine.h"
+#include "hdb_node.h"
 
-ExecutionEngine::ExecutionEngine(HarmonyDB *db) : db(db)
+ExecutionEngine::ExecutionEngine(HarmonyDB *db) : db(db), instructions(0), slice(0), profiler(this), node(NULL), reactor(NULL)
 {
     HarmonyObject *relation;
     HarmonyItem *relationi;
     HarmonyItem *relationi_next, *relationi_prev, *relationi_me, *relationi_type;
     HarmonyItem *relationi_first, *relationi_last, *relationi_proxy, *relationi_label;
+    HdbMemScope scope(db->account);
 
 // find intrinsic relations
     relationi = db->getRoot()->findItem("relation");
@@ -73,18 +76,80 @@ ExecutionEngine::ExecutionEngine(HarmonyDB *db) : db(db)
 
 }
 
+// path from the root, or from the launcher of the context holding the object,
+// or below ctx; the profiler, the tracer and the migrations name them so too
+string ExecutionEngine::path(HarmonyObject *object, HarmonyObject *ctx)
+{
+    string p;
+
+    for (auto item = object->primaryItem(); item && item->parent && item->parent != ctx; item = item->parent->primaryItem()) {
+        auto l = launchers.find(item->parent);
+        if (l != launchers.end())
+            return l->second + "/" + (p.empty() ? string("."): p);
+        p = "." + item->indexLabel() + p;
+    }
+    return p.empty() ? string("."): p;
+}
+
+HdbHistogram * ExecutionEngine::histogram(const char *name, const char *help, const char *label, const string &path)
+{
+    auto labels = string(label) + "=\"" + path + "\"";
+    auto &h = histograms[labels];
+
+    if (!h)
+        h = hdb_stats.histogram(name, help, labels);
+    return h;
+}
+
+void ExecutionEngine::launched(HarmonyObject *ctx, HarmonyObject *launcher)
+{
+    auto p = path(launcher);
+
+    launchers[ctx] = p;
+    launches[ctx] = Pending {hdbNowNs(), histogram("divee_launch_latency_seconds", "From the SEND to a launcher to the first run of the context", "launcher", p)};
+}
+
+// only the first message counts when several are sent before the receive
+void ExecutionEngine::delivered(HarmonyObject *receiver, HarmonyObject *rctx)
+{
+    if (!rctx || deliveries.count(rctx))
+        return;
+    deliveries[rctx] = Pending {hdbNowNs(), histogram("divee_delivery_latency_seconds", "From the SEND to a receiver to its context passing the RECEIVE", "receiver", path(receiver))};
+}
+
+void ExecutionEngine::finished(HarmonyObject *ctx)
+{
+    launchers.erase(ctx);
+    launches.erase(ctx);
+    deliveries.erase(ctx);
+}
+
 void ExecutionEngine::sendMessage(HarmonyObject *recipient, HarmonyObject *arg, HarmonyObject *return_object)
 {
+    recipient->ensureLoaded();
+    if (node && HdbNode::isRemote(recipient)) {
+        hdb_stats.sends->add();
+        node->send(recipient, arg, return_object);
+        node->flush();
+        return;
+    }
     assertf(recipient->isCode(), "Recipient is not HarmonyCode!");
     assertf(recipient->type == HarmonyObject::Type::LAUNCH || recipient->type == HarmonyObject::Type::RECEIVE, "Receiver is not launcher nor receiver!");
+    hdb_stats.sends->add();
     if (recipient->type == HarmonyObject::Type::LAUNCH) { // launcher, new context & thread
         PT("Launcher %p found", recipient);
         auto ctx = db->createContext(recipient, string(), return_object, arg);
+        launched(ctx, recipient);
+        tracer.create(ctx, launchers[ctx]);
+        tracer.send(NULL, recipient, ctx);
         // db->dumpBase();
         run_queue.push(ctx);
+        tracer.enqueue(ctx, "run_queue");
         run();
-    } else if (recipient->type == HarmonyObject::Type::RECEIVE) { // launcher, new context & thread
+    } else if (recipient->type == HarmonyObject::Type::RECEIVE) {
         PT("Receiver %p found", recipient);
+        deliver(NULL, recipient, arg);
+        run();
     } else {
         assert(0);
     }
@@ -92,6 +157,7 @@ void ExecutionEngine::sendMessage(HarmonyObject *recipient, HarmonyObject *arg,
 
 bool ExecutionEngine::pushFrame(HarmonyObject *frame)
 {
+    frame->ensureLoaded();
     if (!frame->isEmpty()) {
         // PT("new stack %p %d", frame, frame->loop);
         if (frame->loop) {
@@ -120,22 +186,68 @@ void ExecutionEngine::run()
 {
     HarmonyObject *contexts;
 
+    HdbMemScope scope(hdb_memory.current);
+    HdbPerfScope perf(HDB_PERF_RUN);
+
     contexts = db->getRoot()->findItem("context")->object;
+    profiler.resume();
+    auto slice_end = slice ? instructions + slice: 0;
 again:
+    hdb_perf.opcode(-1);
+    hdb_stats.run_queue->set(run_queue.size());
+    hdb_stats.wait_queue->set(wait_queue.size());
     PT("rq:%ld  wq:%ld", run_queue.size(), wait_queue.size());
-    if (run_queue.empty())
+    tracer.end();
+    if (run_queue.empty()) {
+        if (node)
+            node->flush();  // the sends of this run in as few writes as possible
         return;
+    }
     ctx = run_queue.front();
+    tracer.begin(ctx);
+    if (!launches.empty()) {
+        auto l = launches.find(ctx);
+        if (l != launches.end()) {
+            l->second.histogram->record(hdbNowNs() - l->second.ns);
+            launches.erase(l);
+        }
+    }
+    hdb_memory.current = ctx->account;
     ip = ctx->findItem("ip")->object;
     assert(ip->isProxy());
     ip_stack = ctx->findItem("ip_stack")->object;
 
     PT("ctx:%p  ip:%p  ip_stack:%p", ctx, ip, ip_stack);
     for (;;) {
+        if (slice_end && instructions >= slice_end) { // back to the node, see HdbNode::poll()
+            run_queue.pop();
+            run_queue.push(ctx);
+            tracer.enqueue(ctx, "run_queue");
+            break;
+        }
+        if (ctx->account->overQuota()) {
+            PF("Context %s is over its quota of %ld bytes!", ctx->account->name.c_str(), ctx->account->quota);
+            run_queue.pop();
+            if (hdb_memory.policy == HdbMemory::PARK) {
+                parked.push_back(ctx);
+                tracer.enqueue(ctx, "parked");
+            } else {
+                hdb_stats.contexts->sub();
+                hdb_stats.contexts_finished->add();
+                tracer.finish(ctx);
+                finished(ctx);
+                db->removeContext(ctx);
+            }
+            goto again;
+        }
         current_ip = ip->getObject();
         PT(" current_ip:%p type:%d loop:%d", current_ip, current_ip->type, current_ip->loop);
         if (current_ip->isCode()) {
             const char codes[] = "_ETP?*=+-!<>^~";
+            instructions++;
+            hdb_stats.instructions[current_ip->type]->add();
+            hdb_perf.opcode(current_ip->type);
+            profiler.tick(ctx, ip_stack, current_ip);
             PT("Code: %c", codes[current_ip->type]);
             if (current_ip->type == HarmonyObject::Type::MATCH) {
                 HarmonyObject *pattern, *unknowns, *negatives, *cont;
@@ -220,20 +332,31 @@ again:
                 if (!current_ip->receiver_armed) {
                     run_queue.pop();
                     wait_queue.push_back(ctx);
+                    tracer.enqueue(ctx, "wait_queue");
                     db->clearArguments(current_ip);
                     goto again;
                 } else if (current_ip->receiver_armed != current_ip->receiver_got) {
                     run_queue.pop();
                     wait_queue.push_back(ctx);
+                    tracer.enqueue(ctx, "wait_queue");
                     goto again;
                 }
                 current_ip->receiver_armed = 0;
                 current_ip->receiver_got = 0;
+                auto d = deliveries.find(ctx);
+                if (d != deliveries.end()) {
+                    d->second.histogram->record(hdbNowNs() - d->second.ns);
+                    deliveries.erase(d);
+                }
             } else if (current_ip->type == HarmonyObject::Type::SEND) {
                 HarmonyItem *receiver_item, *argument_item;
                 receiver_item = current_ip->first();
                 if (!receiver_item) { // stop
                     run_queue.pop();
+                    hdb_stats.contexts->sub();
+                    hdb_stats.contexts_finished->add();
+                    tracer.finish(ctx);
+                    finished(ctx);
                     PT("DELETE context");
                     auto i = contexts->findItem(ctx);
                     assert(i);
@@ -243,6 +366,7 @@ again:
                 argument_item = receiver_item->nextItem(current_ip);
 
                 HarmonyObject *receiver, *argument;
+                hdb_stats.sends->add();
                 receiver = receiver_item->object->getObject();
                 argument = argument_item->object->getObject();
                 PT("Sending %p to %p...", argument, receiver);
@@ -257,52 +381,16 @@ again:
                     PT("launcher %p", launcher);
                     if (argument && return_object) {
                         auto ctx = db->createContext(launcher, string(), NULL/*return_object*/, argument);
+                        launched(ctx, launcher);
+                        tracer.create(ctx, launchers[ctx]);
+                        tracer.send(this->ctx, launcher, ctx);
                         run_queue.push(ctx);
+                        tracer.enqueue(ctx, "run_queue");
                     }
-                } else if (receiver->type == HarmonyObject::RECEIVE) {
-                    HarmonyObject *rctx = NULL;
-                    rctx = receiver->context;
-                    PT("receiver:%p  rctx:%p", receiver, rctx);
-                    assert(argument);
-
-                    auto named = receiver->first();
-                    assert(named);
-                    auto unnamed = named->nextItem(receiver);
-
-                    db->copyArgument(argument, named->object, unnamed ? unnamed->object: NULL);
-
-                    if (rctx) {
-                        for (auto it: wait_queue) {
-                            if (it == rctx) {
-                                wait_queue.remove(rctx);
-                                run_queue.push(rctx);
-                                PT("wq -> rq");
-                                break;
-                            }
-                        }
-                    }
-                    receiver->receiver_got = 1;
-                } else if (receiver->parent_receiver) {
-                    HarmonyObject *rctx = NULL;
-                    rctx = receiver->parent_receiver->context;
-                    // PT("receiver:%p  rctx:%p  ra:%d rg:%d", receiver, rctx, receiver->parent_receiver->receiver_armed, receiver->parent_receiver->receiver_got);
-                    assert(receiver->parent_receiver->receiver_armed > 0);
-                    if (argument && receiver->parent_receiver->receiver_armed > 0) {
-                        assert(receiver->parent_receiver->receiver_got < receiver->parent_receiver->receiver_armed);
-                        db->copyArgument(argument, receiver);
-                        receiver->parent_receiver->receiver_got++;
-                    }
-                    // PT("receiver:%p  rctx:%p  ra:%d rg:%d", receiver, rctx, receiver->parent_receiver->receiver_armed, receiver->parent_receiver->receiver_got);
-                    if (rctx && receiver->parent_receiver->receiver_armed == receiver->parent_receiver->receiver_got) {
-                        for (auto it: wait_queue) {
-                            if (it == rctx) {
-                                wait_queue.remove(rctx);
-                                run_queue.push(rctx);
-                                PT("wq -> rq");
-                                break;
-                            }
-                        }
-                    }
+                } else if (receiver->type == HarmonyObject::RECEIVE || receiver->parent_receiver) {
+                    deliver(ctx, receiver, argument);
+                } else if (node && HdbNode::isRemote(receiver)) {
+                    node->send(receiver, argument);
                 } else {
                     db->dumpBase();
                     assert(0);
@@ -379,6 +467,10 @@ again:
                 }
             } else { // no more instructions, done
                 run_queue.pop();
+                hdb_stats.contexts->sub();
+                hdb_stats.contexts_finished->add();
+                tracer.finish(ctx);
+                finished(ctx);
                 PT("DELETE context");
                 auto i = contexts->findItem(ctx);
                 assert(i);
@@ -387,11 +479,139 @@ again:
             }
         }
     }
+    if (node)
+        node->flush();
+    tracer.end();
     PT("Done");
 }
 
+// what of a delivery would trip the asserts of deliver(): an element of a
+// receiver's array takes as many arguments as it was armed for
+const char * ExecutionEngine::undeliverable(HarmonyObject *receiver, HarmonyObject *argument)
+{
+    if (node && node->forwarding(receiver))
+        return NULL;        // checked where its context went
+    if (!argument)
+        return "no argument";
+    if (receiver->type == HarmonyObject::RECEIVE)
+        return receiver->first() ? NULL: "a receiver of no arguments";
+    if (!receiver->parent_receiver)
+        return "no receiver";
+    if (!receiver->parent_receiver->receiver_armed)
+        return "a receiver not armed";
+    if (receiver->parent_receiver->receiver_got >= receiver->parent_receiver->receiver_armed)
+        return "a receiver that got its arguments";
+    return NULL;
+}
+
+// copies the argument to a receiver, or to an element of a receiver's array,
+// and wakes up its context once it got everything
+void ExecutionEngine::deliver(HarmonyObject *sender, HarmonyObject *receiver, HarmonyObject *argument)
+{
+    auto forward = node ? node->forwarding(receiver): NULL;
+
+    if (forward) {
+        node->send(forward, argument);
+    } else if (receiver->type == HarmonyObject::RECEIVE) {
+        HarmonyObject *rctx = NULL;
+        rctx = receiver->context;
+        PT("receiver:%p  rctx:%p", receiver, rctx);
+        assert(argument);
+
+        auto named = receiver->first();
+        assert(named);
+        auto unnamed = named->nextItem(receiver);
+
+        db->copyArgument(argument, named->object, unnamed ? unnamed->object: NULL);
+        tracer.send(sender, receiver, rctx);
+        delivered(receiver, rctx);
+
+        if (rctx) {
+            for (auto it: wait_queue) {
+                if (it == rctx) {
+                    wait_queue.remove(rctx);
+                    run_queue.push(rctx);
+                    tracer.wakeup(rctx);
+                    PT("wq -> rq");
+                    break;
+                }
+            }
+        }
+        receiver->receiver_got = 1;
+    } else if (receiver->parent_receiver) {
+        HarmonyObject *rctx = NULL;
+        rctx = receiver->parent_receiver->context;
+        // PT("receiver:%p  rctx:%p  ra:%d rg:%d", receiver, rctx, receiver->parent_receiver->receiver_armed, receiver->parent_receiver->receiver_got);
+        assert(receiver->parent_receiver->receiver_armed > 0);
+        if (argument && receiver->parent_receiver->receiver_armed > 0) {
+            assert(receiver->parent_receiver->receiver_got < receiver->parent_receiver->receiver_armed);
+            db->copyArgument(argument, receiver);
+            receiver->parent_receiver->receiver_got++;
+            tracer.send(sender, receiver, rctx);
+            delivered(receiver->parent_receiver, rctx);
+        }
+        // PT("receiver:%p  rctx:%p  ra:%d rg:%d", receiver, rctx, receiver->parent_receiver->receiver_armed, receiver->parent_receiver->receiver_got);
+        if (rctx && receiver->parent_receiver->receiver_armed == receiver->parent_receiver->receiver_got) {
+            for (auto it: wait_queue) {
+                if (it == rctx) {
+                    wait_queue.remove(rctx);
+                    run_queue.push(rctx);
+                    tracer.wakeup(rctx);
+                    PT("wq -> rq");
+                    break;
+                }
+            }
+        }
+    }
+}
+
+ExecutionEngine::Queue ExecutionEngine::suspend(HarmonyObject *ctx)
+{
+    auto queue = NONE;
+
+    for (auto n = run_queue.size(); n; n--) {
+        auto c = run_queue.front();
+        run_queue.pop();
+        if (c == ctx)
+            queue = RUN;
+        else
+            run_queue.push(c);
+    }
+    if (queue == NONE && find(wait_queue.begin(), wait_queue.end(), ctx) != wait_queue.end()) {
+        wait_queue.remove(ctx);
+        queue = WAIT;
+    }
+    if (queue == NONE && find(parked.begin(), parked.end(), ctx) != parked.end()) {
+        parked.remove(ctx);
+        queue = PARKED;
+    }
+    if (queue != NONE) {
+        hdb_stats.contexts->sub();
+        tracer.finish(ctx);
+        finished(ctx);
+    }
+    return queue;
+}
+
+void ExecutionEngine::resume(HarmonyObject *ctx, Queue queue, const string &launcher)
+{
+    static const char *names[] = {"", "run_queue", "wait_queue", "parked"};
+
+    hdb_stats.contexts->add();
+    if (!launcher.empty())
+        launchers[ctx] = launcher;
+    if (queue == WAIT)
+        wait_queue.push_back(ctx);
+    else if (queue == PARKED)
+        parked.push_back(ctx);
+    else
+        run_queue.push(ctx);
+    tracer.enqueue(ctx, names[queue == NONE ? RUN: queue]);
+}
+
 bool ExecutionEngine::execute_match(HarmonyObject *pattern, HarmonyObject *unknowns, HarmonyObject *negatives)
 {
+    HdbPerfScope perf(HDB_PERF_MATCH);
     PT("MATCH %p:%d  %p:%d  %p:%d", pattern, pattern->isEmpty(), unknowns, unknowns->isEmpty(), negatives, negatives->isEmpty());
 
     // db->dumpBase();
@@ -545,6 +765,7 @@ bool ExecutionEngine::execute_match(HarmonyObject *pattern, HarmonyObject *unkno
                     return true;
                 return false;
             } else {
+                owner->ensureLoaded();
                 auto ri = owner->relations.next;
                 while (ri != &owner->relations) {
                     auto r = static_cast<HarmonyRelation *>(ri->object);
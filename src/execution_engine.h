@@ -2,28 +2,71 @@
 #define EXECUTION_ENGINE_H
 
 #include "harmonydb.h"
+#include "execution_profiler.h"
+#include "execution_tracer.h"
 #include <queue>
+#include <unordered_map>
 
 using namespace std;
 
+struct HdbNode;
+struct HdbReactor;
+
 struct ExecutionEngine
 {
+    enum Queue {
+        NONE,
+        RUN,
+        WAIT,
+        PARKED
+    };
+
     HarmonyDB *db;
     queue<HarmonyObject *> run_queue;
     list<HarmonyObject *> wait_queue;
+    list<HarmonyObject *> parked;       // over their memory quota
 
     HarmonyObject *relation_next, *relation_prev, *relation_me, *relation_type;
     HarmonyObject *relation_first, *relation_last, *relation_proxy, *relation_label;
 
     HarmonyObject *ctx, *ip_stack, *ip, *current_ip;
+    uint64_t instructions;  // code objects executed so far
+    unsigned slice;         // instructions a run() takes before returning, 0 to empty the run queue
+    ExecutionProfiler profiler;
+    ExecutionTracer tracer;
+    HdbNode *node;          // NULL unless the process is a node of a cluster
+    HdbReactor *reactor;    // NULL unless timers or descriptors send to the programs
+
+    // latencies from the SEND creating a context to its first run, and from
+    // the first SEND to an armed receiver to its context passing the RECEIVE
+    struct Pending {
+        uint64_t ns;
+        HdbHistogram *histogram;
+    };
+    unordered_map<HarmonyObject *, string> launchers;       // context -> launcher path, see path()
+    unordered_map<HarmonyObject *, Pending> launches;       // by context
+    unordered_map<HarmonyObject *, Pending> deliveries;     // by receiving context
+    unordered_map<string, HdbHistogram *> histograms;       // by labels
 
     ExecutionEngine(HarmonyDB *db);
     void sendMessage(HarmonyObject *recipient, HarmonyObject *arg, HarmonyObject *return_object = NULL);
 
     void run();
+    void deliver(HarmonyObject *sender, HarmonyObject *receiver, HarmonyObject *argument);
+    const char * undeliverable(HarmonyObject *receiver, HarmonyObject *argument);   // NULL if deliver() takes it
+    Queue suspend(HarmonyObject *ctx);  // off its queue, to migrate it
+    void resume(HarmonyObject *ctx, Queue queue, const string &launcher);
+
+    string path(HarmonyObject *object, HarmonyObject *ctx = NULL);
 
     bool pushFrame(HarmonyObject *frame);
     bool execute_match(HarmonyObject *pattern, HarmonyObject *unknowns, HarmonyObject *negatives);
+
+private:
+    HdbHistogram * histogram(const char *name, const char *help, const char *label, const string &path);
+    void launched(HarmonyObject *ctx, HarmonyObject *launcher);
+    void delivered(HarmonyObject *receiver, HarmonyObject *rctx);
+    void finished(HarmonyObject *ctx);
 };
 
 #endif
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "execution_profiler.h"
+#include "execution_engine.h"
+
+static const char codes[] = "_ETP?*=+-!<>^~";
+
+static double elapsedMs(const struct timespec &start, const struct timespec &end)
+{
+    return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+ExecutionProfiler::ExecutionProfiler(ExecutionEngine *engine) : engine(engine)
+{
+    running = false;
+    period = 1;
+    countdown = 1;
+}
+
+void ExecutionProfiler::start(unsigned period)
+{
+    clear();
+    this->period = period ? period: 1;
+    countdown = this->period;
+    running = true;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+}
+
+void ExecutionProfiler::stop()
+{
+    running = false;
+}
+
+void ExecutionProfiler::clear()
+{
+    code.clear();
+    opcodes.clear();
+    stacks.clear();
+}
+
+void ExecutionProfiler::resume()
+{
+    if (running)
+        clock_gettime(CLOCK_MONOTONIC, &last);
+}
+
+const string & ExecutionProfiler::launcher(HarmonyObject *ctx)
+{
+    static const string unknown("?");   // not launched, e.g. the shell's
+
+    auto l = engine->launchers.find(ctx);
+    return l != engine->launchers.end() ? l->second: unknown;
+}
+
+void ExecutionProfiler::sample(HarmonyObject *ctx, HarmonyObject *ip_stack, HarmonyObject *current_ip)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ms = elapsedMs(last, now);
+    last = now;
+    countdown = period;
+
+    auto &l = launcher(ctx);
+    string op(1, codes[current_ip->type]);
+    auto p = engine->path(current_ip, ctx);
+
+    auto &e = code[l + " " + op + " " + p];
+    e.samples++;
+    e.instructions += period;
+    e.ms += ms;
+
+    auto &o = opcodes[op];
+    o.samples++;
+    o.instructions += period;
+    o.ms += ms;
+
+    string stack = l;
+    for (auto frame = ip_stack->first(); frame; frame = frame->nextItem(ip_stack))
+        stack += ";" + engine->path(frame->object, ctx);
+    stacks[stack + ";" + op + "@" + p] += period;
+}
+
+void ExecutionProfiler::report(unsigned top)
+{
+    vector<pair<string, Entry>> entries(code.begin(), code.end());
+    double total = 0;
+
+    for (auto &e: entries)
+        total += e.second.ms;
+    sort(entries.begin(), entries.end(), [](const pair<string, Entry> &a, const pair<string, Entry> &b) {
+        return a.second.ms > b.second.ms || (a.second.ms == b.second.ms && a.second.instructions > b.second.instructions);
+    });
+    printf("%10s %6s %12s %8s  %s\n", "ms", "%", "instructions", "samples", "launcher opcode path");
+    for (unsigned i = 0; i < entries.size() && i < top; i++) {
+        auto &e = entries[i].second;
+        printf("%10.3f %6.2f %12lu %8lu  %s\n", e.ms, total > 0 ? e.ms * 100 / total: 0.0, e.instructions, e.samples, entries[i].first.c_str());
+    }
+    printf("\n%10s %6s %12s %8s  %s\n", "ms", "%", "instructions", "samples", "opcode");
+    for (auto &o: opcodes)
+        printf("%10.3f %6.2f %12lu %8lu  %s\n", o.second.ms, total > 0 ? o.second.ms * 100 / total: 0.0, o.second.instructions, o.second.samples, o.first.c_str());
+    printf("%s, period %u\n", running ? "running": "stopped", period);
+}
+
+// one "frame;frame;... instructions" line per stack, for flamegraph.pl
+bool ExecutionProfiler::writeStacks(const string &filepath)
+{
+    auto f = fopen(filepath.c_str(), "w");
+
+    if (!f)
+        return false;
+    for (auto &s: stacks)
+        fprintf(f, "%s %lu\n", s.first.c_str(), s.second);
+    return fclose(f) == 0;
+}
@@ -0,0 +1,58 @@
+#ifndef EXECUTION_PROFILER_H
+#define EXECUTION_PROFILER_H
+
+#include <time.h>
+#include <stdint.h>
+#include <map>
+#include "harmonydb.h"
+
+using namespace std;
+
+struct ExecutionEngine;
+
+// Samples every period-th instruction executed by the engine. A sample is
+// attributed to the launcher of the context, the opcode and the path of the
+// code object, and to the stack of the ip_stack frames for flame graphs.
+// Paths follow the primary items from the cloned launcher down, unlabelled
+// items are named by their index so that the contexts of one launcher
+// aggregate together. The launchers are the engine's, see
+// ExecutionEngine::path().
+struct ExecutionProfiler
+{
+    struct Entry {
+        uint64_t samples, instructions;
+        double ms;
+
+        Entry() : samples(0), instructions(0), ms(0) {}
+    };
+
+    ExecutionEngine *engine;
+    bool running;
+    unsigned period, countdown;
+    struct timespec last;
+
+    map<string, Entry> code;                            // "launcher opcode path"
+    map<string, Entry> opcodes;
+    map<string, uint64_t> stacks;                       // collapsed stacks, instructions
+
+    ExecutionProfiler(ExecutionEngine *engine);
+
+    void start(unsigned period);
+    void stop();
+    void clear();
+
+    void resume();                                      // (re)entering the engine
+    void tick(HarmonyObject *ctx, HarmonyObject *ip_stack, HarmonyObject *current_ip) {
+        if (running && --countdown == 0)
+            sample(ctx, ip_stack, current_ip);
+    }
+    void sample(HarmonyObject *ctx, HarmonyObject *ip_stack, HarmonyObject *current_ip);
+
+    void report(unsigned top);
+    bool writeStacks(const string &filepath);
+
+private:
+    const string & launcher(HarmonyObject *ctx);
+};
+
+#endif
@@ -0,0 +1,163 @@
+#include <stdio.h>
+
+#include "execution_tracer.h"
+
+static string quote(const string &s)
+{
+    string q("\"");
+
+    for (auto c: s) {
+        if (c == '"' || c == '\\')
+            q += '\\';
+        q += c;
+    }
+    return q + '"';
+}
+
+ExecutionTracer::ExecutionTracer()
+{
+    running = false;
+    next_tid = 1;
+    running_tid = 0;
+    next_flow = 1;
+}
+
+void ExecutionTracer::start()
+{
+    events.clear();
+    tids.clear();
+    pending_flows.clear();
+    next_tid = 1;
+    running_tid = 0;
+    next_flow = 1;
+    running = true;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    add('M', 0, "thread_name", "\"name\": \"shell\"");
+}
+
+void ExecutionTracer::stop()
+{
+    end();
+    running = false;
+}
+
+double ExecutionTracer::now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - start_time.tv_sec) * 1e6 + (t.tv_nsec - start_time.tv_nsec) / 1e3;
+}
+
+void ExecutionTracer::add(char phase, unsigned tid, const char *name, const string &args, uint64_t id)
+{
+    events.push_back(Event {phase, now(), tid, name, id, args});
+}
+
+unsigned ExecutionTracer::tid(HarmonyObject *ctx)
+{
+    if (!ctx)
+        return 0;
+    auto it = tids.find(ctx);
+    if (it != tids.end())
+        return it->second;
+    auto t = next_tid++;
+    tids[ctx] = t;
+    add('M', t, "thread_name", "\"name\": " + quote("context " + to_string(t) + " " + ctx->getKey()));
+    return t;
+}
+
+void ExecutionTracer::create(HarmonyObject *ctx, const string &launcher)
+{
+    if (!running)
+        return;
+    auto t = next_tid++;
+    tids[ctx] = t;
+    add('M', t, "thread_name", "\"name\": " + quote("context " + to_string(t) + " " + launcher));
+    add('i', t, "create", "\"launcher\": " + quote(launcher));
+}
+
+void ExecutionTracer::enqueue(HarmonyObject *ctx, const char *queue)
+{
+    if (running)
+        add('i', tid(ctx), queue);
+}
+
+void ExecutionTracer::begin(HarmonyObject *ctx)
+{
+    if (!running)
+        return;
+    end();
+    running_tid = tid(ctx);
+    add('B', running_tid, "run");
+    auto flows = pending_flows.find(running_tid);
+    if (flows != pending_flows.end()) {
+        for (auto id: flows->second)
+            add('f', running_tid, "message", string(), id);
+        pending_flows.erase(flows);
+    }
+}
+
+void ExecutionTracer::end()
+{
+    if (!running || !running_tid)
+        return;
+    add('E', running_tid, "run");
+    running_tid = 0;
+}
+
+// a send from the shell is a slice of its own, the flows need one to start from
+void ExecutionTracer::send(HarmonyObject *sender, HarmonyObject *receiver, HarmonyObject *target)
+{
+    if (!running)
+        return;
+    auto from = tid(sender);
+    auto to = target ? tid(target): 0;
+    if (!sender)
+        add('B', 0, "send");
+    auto args = "\"receiver\": " + quote(receiver->getPrimaryPath());
+    if (target)
+        args += ", \"to\": " + to_string(to);
+    add('i', from, "send", args);
+    if (target) {
+        auto id = next_flow++;
+        add('s', from, "message", string(), id);
+        pending_flows[to].push_back(id);
+    }
+    if (!sender)
+        add('E', 0, "send");
+}
+
+void ExecutionTracer::wakeup(HarmonyObject *ctx)
+{
+    if (running)
+        add('i', tid(ctx), "wakeup");
+}
+
+void ExecutionTracer::finish(HarmonyObject *ctx)
+{
+    if (running)
+        add('i', tid(ctx), "finish");
+}
+
+bool ExecutionTracer::save(const string &filepath)
+{
+    auto f = fopen(filepath.c_str(), "w");
+
+    if (!f)
+        return false;
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (size_t i = 0; i < events.size(); i++) {
+        auto &e = events[i];
+        fprintf(f, "{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": %u", e.name, e.phase, e.ts, e.tid);
+        if (e.phase == 's' || e.phase == 'f')
+            fprintf(f, ", \"cat\": \"message\", \"id\": %lu%s", e.id, e.phase == 'f' ? ", \"bp\": \"e\"": "");
+        if (e.phase == 'i')
+            fprintf(f, ", \"s\": \"t\"");
+        if (!e.args.empty())
+            fprintf(f, ", \"args\": {%s}", e.args.c_str());
+        fprintf(f, "}%s\n", i + 1 < events.size() ? ",": "");
+    }
+    fprintf(f, "]}\n");
+    return fclose(f) == 0;
+}
@@ -0,0 +1,55 @@
+#ifndef EXECUTION_TRACER_H
+#define EXECUTION_TRACER_H
+
+#include <time.h>
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include "harmonydb.h"
+
+using namespace std;
+
+// Records the life of the contexts as Chrome trace events, one thread per
+// context: the slices when it runs, instants for creation, queueing, sends,
+// wake-ups and finish, and flow arrows from a SEND to the next run of the
+// context it woke or created. The shell is thread 0.
+struct ExecutionTracer
+{
+    struct Event {
+        char phase;             // B, E, i, s, f, M
+        double ts;              // us since start
+        unsigned tid;
+        const char *name;
+        uint64_t id;            // flow
+        string args;            // JSON object members
+    };
+
+    bool running;
+    struct timespec start_time;
+    vector<Event> events;
+    unordered_map<HarmonyObject *, unsigned> tids;
+    unordered_map<unsigned, vector<uint64_t>> pending_flows;   // tid -> flows ending at its next run
+    unsigned next_tid, running_tid;
+    uint64_t next_flow;
+
+    ExecutionTracer();
+
+    void start();
+    void stop();
+    bool save(const string &filepath);
+
+    void create(HarmonyObject *ctx, const string &launcher);     // its path, see ExecutionEngine::path()
+    void enqueue(HarmonyObject *ctx, const char *queue);
+    void begin(HarmonyObject *ctx);
+    void end();
+    void send(HarmonyObject *sender, HarmonyObject *receiver, HarmonyObject *target);
+    void wakeup(HarmonyObject *ctx);
+    void finish(HarmonyObject *ctx);
+
+private:
+    double now();
+    unsigned tid(HarmonyObject *ctx);
+    void add(char phase, unsigned tid, const char *name, const string &args = string(), uint64_t id = 0);
+};
+
+#endif
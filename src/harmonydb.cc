@@ -1,11 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdarg.h>
 #include <assert.h>
 #include <typeinfo>
+#include <algorithm>
+#include <memory>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "harmonydb.h"
+#include "hdb_writer.h"
 #include "common.h"
 
 // HarmonyObjectReference
@@ -49,11 +54,13 @@ void HarmonyObjectReference::setReference(HarmonyObject *object, bool structural
         object->reference.structural_references++;
         // PF(">>>>>>>. %p->%p %d", this, object, object->reference.structural_references);
     }
+    hdb_stats.references->add();
 }
 
 void HarmonyObjectReference::_removeReference()
 {
     // PF("%p %d:%d", object, structural, object->reference.structural_references);
+    hdb_stats.references->sub();
     if (structural) {
         structural = false;
         assert(object->reference.structural_references > 0);
@@ -71,6 +78,7 @@ void HarmonyObjectReference::removeReference()
     auto was_structural = structural;
 
     // PF("%p s:%d sr:%d", object, structural, object->reference.structural_references);
+    hdb_stats.references->sub();
     if (structural) {
         structural = false;
         assert(object->reference.structural_references > 0);
@@ -188,6 +196,18 @@ HarmonyItem * HarmonyItem::nextRelation(HarmonyObject *set)
     }
 }
 
+// the label, or the position in the parent for unlabelled items
+string HarmonyItem::indexLabel()
+{
+    unsigned index = 0;
+
+    if (!label.empty())
+        return label;
+    for (auto i = parent->first(); i && i != this; i = i->nextItem(parent))
+        index++;
+    return "[" + to_string(index) + "]";
+}
+
 HarmonyItem::~HarmonyItem()
 {
 }
@@ -249,9 +269,27 @@ const string HarmonyObjectPath::toString() const
 // HarmonyObject
 
 unsigned HarmonyObject::_object_count = 0;
+uint64_t HarmonyObject::_objects_allocated = 0;
+uint64_t HarmonyObject::_objects_freed = 0;
 bool HarmonyObject::_sweeping = false;
 unsigned HarmonyObject::_current_sweep_mark = 0;
 unsigned HarmonyObject::_old_sweep_mark = 0;
+HarmonyPathCache *HarmonyObject::_path_cache = NULL;
+HarmonyObserver *HarmonyObject::_observer = NULL;
+unsigned HarmonyObject::_observing = 0;
+
+// a mutation reported to the observer unless another one made it
+struct HarmonyObserving
+{
+    bool report;
+
+    HarmonyObserving() : report(HarmonyObject::_observer && !HarmonyObject::_observing) {
+        HarmonyObject::_observing++;
+    }
+    ~HarmonyObserving() {
+        HarmonyObject::_observing--;
+    }
+};
 
 HarmonyObject::HarmonyObject(Type t)
 {
@@ -265,8 +303,17 @@ HarmonyObject::HarmonyObject(Type t)
     sweep_mark = 0;
     sweep_parent = NULL;
     temporary_label_sweep_mark = 0;
+    census_mark = 0;
+    merkle = 0;
+    merkle_state = MERKLE_INVALID;
+    lazy_loader = NULL;
     _object_count++;
+    _objects_allocated++;
     type = t;
+    hdb_stats.objects[type]->add();
+    account = hdb_memory.current;
+    account->objects[type]++;
+    account->object_bytes[type] += sizeof(HarmonyObject);
     context = NULL;
     parent_receiver = NULL;
     receiver_armed = 0;
@@ -303,9 +350,37 @@ HarmonyObject::~HarmonyObject()
 
     assertf(reference.isEmpty() == true, "Object <%p> %p %p still referenced!", this, reference.prev, reference.next);
     _object_count--;
+    _objects_freed++;
+    hdb_stats.objects[type]->sub();
+    account->objects[type]--;
+    account->object_bytes[type] -= sizeof(HarmonyObject);
+    if (account->ctx == this)
+        account->ctx = NULL;
     // PF("object_count: %d", _object_count);
 }
 
+void HarmonyObject::load()
+{
+    HdbMemScope scope(lazy_loader->account);
+    HarmonyObserving observing;
+
+    assert(lazy_loader);
+    lazy_loader->loadStub(this);
+}
+
+// the cached hashes of the object and of everything holding it, the ones
+// not valid have their holders invalidated already
+void HarmonyObject::_invalidateMerkle()
+{
+    merkle_state = MERKLE_INVALID;
+    for (auto r = reference.next; r != &reference; r = r->next) {
+        auto parent = r->structural ? static_cast<HarmonyItem *>(r)->parent: NULL;
+
+        if (parent)
+            parent->invalidateMerkle();
+    }
+}
+
 const string HarmonyObject::getHint(const string &hint)
 {
     auto it = hints.find(hint);
@@ -314,6 +389,18 @@ const string HarmonyObject::getHint(const string &hint)
     return string();
 }
 
+void HarmonyObject::setType(Type t)
+{
+    invalidateMerkle();
+    hdb_stats.objects[type]->sub();
+    account->objects[type]--;
+    account->object_bytes[type] -= sizeof(HarmonyObject);
+    type = t;
+    hdb_stats.objects[type]->add();
+    account->objects[type]++;
+    account->object_bytes[type] += sizeof(HarmonyObject);
+}
+
 int HarmonyObject::isEmpty()
 {
     return items.prev == &items;
@@ -323,6 +410,8 @@ void HarmonyObject::clear()
 {
     HarmonyItem *item;
 
+    if (lazy_loader) // cleared before it was ever loaded
+        lazy_loader->unregisterStub(this);
     // PF("1 %p  %p %p %p", this, items.prev, &items, items.next);
     while (!isEmpty()) {
         item = items.next;
@@ -348,6 +437,7 @@ HarmonyItem * HarmonyObject::first()
 {
     HarmonyItem *item;
 
+    ensureLoaded();
     item = NULL;
     if (!isEmpty()) {
         item = items.next;
@@ -359,6 +449,7 @@ HarmonyItem * HarmonyObject::last()
 {
     HarmonyItem *item;
 
+    ensureLoaded();
     item = NULL;
     if (!isEmpty()) {
         item = items.prev;
@@ -514,12 +605,22 @@ HarmonyItem * HarmonyObject::add(HarmonyObject *object, string label, bool prima
 {
     HarmonyItem *item;
 
+    ensureLoaded();
     if (!label.empty()) {
         auto o = findItem(label);
         auto r = findRelation(label);
         assertf(o == NULL && r == NULL, "Local label \"%s\" already used!", label.c_str());
     }
+    HarmonyObserving observing;
+    if (observing.report)
+        _observer->adding(this, object, label, primary);
+    invalidateMerkle();
+    if (primary)    // no longer hashed by its content where it is held
+        object->invalidateMerkle();
     item = new HarmonyItem;
+    hdb_stats.items->add();
+    account->items++;
+    account->item_bytes += sizeof(HarmonyItem);
     item->parent = this;
     item->setReference(object, true, primary);
     item->label = label;
@@ -539,6 +640,12 @@ HarmonyItem * HarmonyObject::add(HarmonyObject *object, string label, bool prima
 
 HarmonyItem * HarmonyObject::remove(HarmonyItem *item, bool internal)
 {
+    HarmonyObserving observing;
+    if (observing.report)
+        _observer->removing(this, item);
+    invalidateMerkle();
+    if (item->primary)
+        item->object->invalidateMerkle();
     auto next = item->next;
     item->prev->next = item->next;
     item->next->prev = item->prev;
@@ -547,6 +654,9 @@ HarmonyItem * HarmonyObject::remove(HarmonyItem *item, bool internal)
     else
         item->removeReference();
     delete item;
+    hdb_stats.items->sub();
+    account->items--;
+    account->item_bytes -= sizeof(HarmonyItem);
 
     if (next == &items) { // the end
         return NULL;
@@ -583,6 +693,7 @@ HarmonyItem * HarmonyObject::findItem(HarmonyObject *object)
 
 HarmonyItem * HarmonyObject::findRelation(const string &label)
 {
+    ensureLoaded();
     auto r = relations.next;
     while (r != &relations) {
         if (r->label == label)
@@ -614,8 +725,15 @@ HarmonyItem * HarmonyObject::addRelation(HarmonyRelation *r, string label)
 {
     // PF("%p -> %p", r, this);
     HarmonyItem *item;
+    HarmonyObserving observing;
 
+    if (observing.report)
+        _observer->relating(this, r, label);
+    invalidateMerkle();
     item = new HarmonyItem;
+    hdb_stats.relations->add();
+    account->relations++;
+    account->relation_bytes += sizeof(HarmonyItem) + sizeof(HarmonyRelation) - sizeof(HarmonyObject);
     item->parent = this;
     item->setReference(r);
     item->label = label;
@@ -634,11 +752,18 @@ HarmonyItem * HarmonyObject::addRelation(HarmonyRelation *r, string label)
 
 HarmonyItem * HarmonyObject::removeRelation(HarmonyItem *item)
 {
+    HarmonyObserving observing;
+    if (observing.report)
+        _observer->unrelating(this, item);
+    invalidateMerkle();
     auto next = item->next;
     item->prev->next = item->next;
     item->next->prev = item->prev;
     item->removeReference();
     delete item;
+    hdb_stats.relations->sub();
+    account->relations--;
+    account->relation_bytes -= sizeof(HarmonyItem) + sizeof(HarmonyRelation) - sizeof(HarmonyObject);
 
     if (next == &relations) { // the end
         return NULL;
@@ -690,6 +815,7 @@ void HarmonyDB::substituteObject(HarmonyObject *old_object, HarmonyObject *new_o
     new_object->reference.structural_references = new_object->reference.structural_references + 1;
     delete old_object;
 
+    new_object->invalidateMerkle();
     new_object->updateDistance(new_object);
     // PF("%p %d:%d", new_object, new_object->reference.structural_references, new_object->root_distance);
     // int i = 0;
@@ -708,10 +834,21 @@ HarmonyObject * HarmonyDB::getObjectByPath(const HarmonyObjectPath &path, Harmon
         r = root.object;
     // PF("%p", r);
     for (auto it : path) {
+        r->ensureLoaded();
         auto oit = r->findItem(it);
+        if (!oit && it.size() > 2 && it.front() == '[' && it.back() == ']') { // unlabelled, see indexLabel()
+            auto index = strtoul(it.c_str() + 1, NULL, 10);
+            for (oit = r->first(); oit && index; oit = oit->nextItem(r))
+                index--;
+        }
         if (oit)
             r = oit->object;
-        else {
+        else if (r->isRemote() && r->hints.count(HINT_REMOTE)) { // routed to the owner, see remoteObject()
+            auto remote = r->hints[HINT_REMOTE];
+            auto child = remoteObject(r->hints[HINT_NODE], (remote == "." ? "": remote) + "." + it);
+            r->add(child, it, true);
+            r = child;
+        } else {
             auto rit = r->findRelation(it);
             if (rit)
                 return rit->object;
@@ -721,6 +858,18 @@ HarmonyObject * HarmonyDB::getObjectByPath(const HarmonyObjectPath &path, Harmon
     return r;
 }
 
+// The proxy of an object of another node, a message sent to it goes there.
+// Its items are made on demand by getObjectByPath(), the proxies of the
+// objects under it.
+HarmonyObject * HarmonyDB::remoteObject(const string &node, const string &path)
+{
+    auto object = new HarmonyObject;
+
+    object->hints[HINT_NODE] = node;
+    object->hints[HINT_REMOTE] = path;
+    return object;
+}
+
 void HarmonyDB::sweep(HarmonyObject *object, HarmonyItem *parent, bool nonstructural)
 {
     if (!parent) {
@@ -927,143 +1076,161 @@ void HarmonyObject::findPath(HarmonyObject *start)
 //     }
 // }
 
+// HarmonyPathCache
+
+HarmonyPathCache::HarmonyPathCache()
+{
+    labels.push_back(string());
+    start = NULL;
+    objects.reserve(HarmonyObject::_objects_allocated - HarmonyObject::_objects_freed);  // rehashing costs more than the lookups
+}
+
+HarmonyPathCache::~HarmonyPathCache()
+{
+    if (HarmonyObject::_path_cache == this)
+        HarmonyObject::_path_cache = NULL;
+}
+
+unsigned HarmonyPathCache::intern(const string &label)
+{
+    if (label.empty())
+        return 0;
+    auto it = ids.emplace(label, labels.size());
+    if (it.second)
+        labels.push_back(label);
+    return it.first->second;
+}
+
+const HarmonyPathCache::Labels & HarmonyPathCache::cacheLabels(HarmonyObject *object)
+{
+    auto it = objects.find(object);
+
+    if (it != objects.end())
+        return it->second;
+    Labels l;
+    l.raw = intern(object->sweep_parent->label);
+    if (object->temporary_label_sweep_mark == HarmonyObject::_old_sweep_mark)
+        l.label = intern(object->getKey());
+    else
+        l.label = l.raw;
+    return objects.emplace(object, l).first->second;
+}
+
+void HarmonyPathCache::chain(HarmonyObject *object, vector<HarmonyItem *> &chain, vector<unsigned> &labels)
+{
+    size_t same = 0;
+
+    scratch.clear();
+    for (auto i = object->sweep_parent; i; i = i->parent->sweep_parent)
+        scratch.push_back(i);
+    reverse(scratch.begin(), scratch.end());
+    // the labels of the part shared with the previous chain are already there
+    while (same < chain.size() && same < scratch.size() && chain[same] == scratch[same])
+        same++;
+    chain.swap(scratch);
+    labels.resize(chain.size());
+    for (size_t i = same; i < chain.size(); i++)
+        labels[i] = label(chain[i]);
+}
+
+void HarmonyPathCache::setStart(HarmonyObject *object)
+{
+    if (start == object)
+        return;
+    start = object;
+    chain(object, start_path, start_labels);
+    start_raw_labels.resize(start_path.size());
+    for (size_t i = 0; i < start_path.size(); i++)
+        start_raw_labels[i] = rawLabel(start_path[i]);
+}
+
+// is a label of path[pi..] shadowed by another object's label in start_path[si..]
+bool HarmonyPathCache::collision(size_t pi, size_t si)
+{
+    for (size_t i = pi; i < path.size(); i++) {
+        if (!path_labels[i])
+            continue;
+        for (size_t j = si; j < start_path.size(); j++) {
+            if (path_labels[i] == start_labels[j] && path[i]->object != start_path[j]->object)
+                return true;
+        }
+    }
+    return false;
+}
+
 string HarmonyObject::getPath(HarmonyObject *start)
 {
-    list<HarmonyItem *> path;
-    list<HarmonyItem *> start_path;
+    HarmonyPathCache *cache = _path_cache;
+    unique_ptr<HarmonyPathCache> local_cache;
     HarmonyItem *local_root = NULL;
     string spath;
+    size_t pi = 0, si = 0;
 
     // PF("%p:%p -> %p:%p", start, start->sweep_parent, this, sweep_parent);
-    HarmonyItem *i;
 
     assert(this);
 
     if (!sweep_parent)
         return ".";
-    for (i = sweep_parent; i; i = i->parent->sweep_parent) {
-        path.push_front(i);
+    if (!cache) { // called outside of a dump
+        local_cache.reset(new HarmonyPathCache);
+        cache = local_cache.get();
     }
+    auto &path = cache->path;
+    auto &start_path = cache->start_path;
 
-    for (i = start->sweep_parent; i; i = i->parent->sweep_parent) {
-        start_path.push_front(i);
-    }
+    cache->chain(this, path, cache->path_labels);
+    cache->setStart(start);
 
-    // for (auto pit: path) {
-    //     PF("pit %p [%s]", pit, pit->label.c_str());
-    // }
-    // for (auto spit: start_path) {
-    //     PF("spit %p [%s]", spit, spit->label.c_str());
-    // }
-    auto pit = path.begin();
-    auto spit = start_path.begin();
-
-    // assert(pit != path.end());
-    // assert(spit != start_path.end());
-
-    for (; pit != path.end() && spit != start_path.end(); pit++) {
-        // PF("found %p %p", (*spit)->object, this);
-        if ((*spit)->object == this) {
-            local_root = *pit;
+    // common part of both chains
+    for (; pi < path.size() && si < start_path.size(); pi++) {
+        if (start_path[si]->object == this) {
+            local_root = path[pi];
             break;
         }
-        if ((*pit)->object == (*spit)->object) {
-            auto it = spit;
-            it++;
-            if (!(*pit)->label.empty()) {
-                for (; it != start_path.end(); it++) {
-                    if ((*pit)->label == (*it)->label)
-                        goto out;
-                }
-            }
-            // PF("same");
-            local_root = *pit;
-            spit++;
+        if (path[pi]->object == start_path[si]->object) {
+            auto l = cache->rawLabel(path[pi]);
+            if (l && find(cache->start_raw_labels.begin() + si + 1, cache->start_raw_labels.end(), l) != cache->start_raw_labels.end())
+                break; // label reused further down, the path has to go through here
+            local_root = path[pi];
+            si++;
             continue;
         }
         break;
     }
-    // for (auto pit2 = pit; pit2 != path.end(); pit2++) {
-    //     PF("pit2 %p [%s]", *pit2, (*pit2)->label.c_str());
-    // }
-    // for (auto spit2 = spit; spit2 != start_path.end(); spit2++) {
-    //     PF("spit2 %p [%s]", *spit2, (*spit2)->label.c_str());
-    // }
-out:
-    // PF("local_root %p", local_root);
-    // for (i = sweep_parent; i && i != local_root; i = i->parent->sweep_parent) {
-    //     PF("%p %p %p [%s]", sweep_parent, i, local_root, i->label.c_str());
-    // if ((pit == path.begin() && pit == path.end()) || !local_root)
-    // PF("lr: %p %p", local_root, local_root->object);
-
-    // if (local_root) {
-    //     if (local_root->object->temporary_label_sweep_mark == HarmonyObject::_old_sweep_mark)
-    //         spath = local_root->object->getKey();
-    //     else
-    //         spath = local_root->label;
-    // }
-restart:
-    unsigned path_size = 1;
-    for (auto pit2 = pit; pit2 != path.end(); pit2++) {
-        for (auto spit2 = spit; spit2 != start_path.end(); spit2++) {
-            for (unsigned i = 0; i < path_size; i++) {
-                string l, p;
-                auto pit3 = pit2;
-                auto spit3 = spit2;
-
-                if ((*pit3)->object->temporary_label_sweep_mark == HarmonyObject::_old_sweep_mark)
-                    l = (*pit3)->object->getKey();
-                else
-                    l = (*pit3)->label;
-
-                if ((*spit3)->object->temporary_label_sweep_mark == HarmonyObject::_old_sweep_mark)
-                    p = (*spit3)->object->getKey();
-                else
-                    p = (*spit3)->label;
-
-                // printf("[%s]<->[%s]\n", l.c_str(), p.c_str());
-                if (!l.empty() && !p.empty() && l == p && (*pit3)->object != (*spit3)->object) {
-                    // printf("Found\n");
-                    pit--;
-                    spit--;
-                    if (pit == path.begin()) {
-                        local_root = NULL;
-                        goto out0;
-                    }
-                    auto ppit = pit;
-                    ppit--;
-                    if (ppit == path.begin())
-                        local_root = NULL;
-                    else
-                        local_root = *ppit;
-                    // printf("Restart\n");
-                    goto restart;
-                }
-                pit3++;
-                spit3++;
-            }
+    // step back as long as the rest of the path would be shadowed from the start
+    while (cache->collision(pi, si)) {
+        if (pi == 0)
+            return spath;
+        pi--;
+        si = si ? si - 1: start_path.size();
+        if (pi == 0) {
+            local_root = NULL;
+            break;
         }
+        local_root = pi - 1 == 0 ? NULL: path[pi - 1];
     }
-out0:
     // PF("local_root %p", local_root);
-    for (; pit != path.end(); pit++) {
-        string l;
+    for (; pi < path.size(); pi++) {
+        auto &l = cache->labels[cache->path_labels[pi]];
 
-        if ((*pit)->object->temporary_label_sweep_mark == HarmonyObject::_old_sweep_mark)
-            l = (*pit)->object->getKey();
-        else
-            l = (*pit)->label;
         // PF("%d [%s]", spath.empty(), l.c_str());
         if (spath.empty() && local_root)
             spath = l;
-        else
-            spath = spath + string(".") + l;
+        else {
+            spath += '.';
+            spath += l;
+        }
     }
     return spath;
 }
 
 void HarmonyObject::copy(HarmonyObject *source)
 {
+    HarmonyObserving observing;
+    if (observing.report)
+        _observer->copying(this, source);
+    invalidateMerkle();
     switch (type) {
         case Type::ELEMENT:
             element_type.removeReference();
@@ -1074,7 +1241,7 @@ void HarmonyObject::copy(HarmonyObject *source)
         default:
             break;
     }
-    type = source->type;
+    setType(source->type);
     switch (type) {
         case Type::ELEMENT:
             element_value = source->element_value;
@@ -1155,6 +1322,10 @@ HarmonyObject * HarmonyRelation::clone() {
 void HarmonyObject::link(HarmonyObject *object)
 {
     assert(isProxy());
+    HarmonyObserving observing;
+    if (observing.report)
+        _observer->linking(this, object);
+    invalidateMerkle();
     if (proxy.object) { // unlink
         // PF("UNLINK %p -> %p", this, reference.object);
         proxy.removeReference();
@@ -1180,13 +1351,49 @@ bool HarmonyObject::compare(HarmonyObject *object)
 
 HarmonyObject * HarmonyObject::getObject()
 {
-    if (isProxy())
+    if (isProxy()) {
+        if (proxy.object)
+            proxy.object->ensureLoaded();
         return proxy.object;
+    }
+    ensureLoaded();
     return this;
 }
 
+// the item of the set the object belongs to, oldest first: the references
+// are linked in at the head and the primary one usually comes first
+HarmonyItem * HarmonyObject::primaryItem()
+{
+    for (auto r = reference.prev; r != &reference; r = r->prev)
+        if (r->primary)
+            return static_cast<HarmonyItem *>(r);
+    return NULL;
+}
+
+// path along the primary items, unlabelled ones by their position
+string HarmonyObject::getPrimaryPath()
+{
+    string p;
+
+    for (auto item = primaryItem(); item && item->parent; item = item->parent->primaryItem())
+        p = "." + item->indexLabel() + p;
+    return p.empty() ? string("."): p;
+}
+
 HarmonyDB::HarmonyDB()
 {
+    lazy = false;
+    direct_loader = false;
+    mmap_scanner = false;
+    stubs_loaded = 0;
+    symbol_hits = 0;
+    symbol_misses = 0;
+    writers_used = 0;
+    dump_bytes = 0;
+    // the first base alive keeps the base account, the ones loaded next to it get their own
+    account = hdb_memory.base.db ? hdb_memory.open("base", this): &hdb_memory.base;
+    account->db = this;
+    account->quota = 0;
 }
 
 HarmonyDB::~HarmonyDB()
@@ -1194,14 +1401,15 @@ HarmonyDB::~HarmonyDB()
     getRoot()->clearRelations();
     getRoot()->clear();
     setRoot(NULL);
+    for (auto w: writers)
+        delete w;
+    hdb_memory.release(this);
 }
 
-#define PRINT_CONFIG(fmt, ...) pbs.print_config(fmt, ##__VA_ARGS__)
-//fprintf(config_file, fmt, ##__VA_ARGS__)
 #define PRINT_CONFIG_COLORING(fmt, ...)
 //fprintf(config_file, fmt, ##__VA_ARGS__)
 
-static FILE * createConfigFile(const string &filepath)
+static int createConfigFile(const string &filepath)
 {
     size_t e = 0;
 
@@ -1215,59 +1423,98 @@ static FILE * createConfigFile(const string &filepath)
         mkdir(token.c_str(), 0755);
     }
     // PF("[%s]\n", filepath.c_str());
-    auto f = fopen(filepath.c_str(), "w");
-    assert(f);
-    return f;
+    auto fd = open(filepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assertf(fd >= 0, "Couldn't create %s!", filepath.c_str());
+    return fd;
 }
 
-void HarmonyDB::dumpBase(HarmonyObject *object, string const &filepath)
+HdbWriter * HarmonyDB::acquireWriter(int fd)
 {
-    FILE *config_file;
+    if (writers_used == writers.size())
+        writers.push_back(new HdbWriter);
+    auto writer = writers[writers_used++];
+    writer->open(fd);
+    return writer;
+}
+
+void HarmonyDB::releaseWriter(HdbWriter *writer)
+{
+    assert(writers_used && writers[writers_used - 1] == writer);
+    writer->close();
+    writers_used--;
+}
 
-    if (filepath.empty())
-        config_file = stdout;
-    else {
-        config_file = createConfigFile(filepath + "/root.hdb");
+void HarmonyDB::dumpBase(HarmonyObject *object, string const &filepath)
+{
+    HdbPerfScope perf(HDB_PERF_DUMP);
+    HdbWriter *writer;
+    struct timespec start, end;
+    uint64_t written = 0;
+
+    loadStubs();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (auto w: writers)
+        written -= w->written;
+    if (filepath.empty()) {
+        fflush(stdout); // keep the order with whatever was printed before
+        writer = acquireWriter(STDOUT_FILENO);
+    } else {
+        writer = acquireWriter(createConfigFile(filepath + "/root.hdb"));
     }
     // PF(" csm %x", HarmonyObject::_current_sweep_mark);
     sweep(root.object);
     findTemporaryLabels(root.object);
     // PF("dumpBase");
     START_SWEEP
-    dumpBase(object ? object: root.object, 0, false, true, string(), filepath, config_file);
+    {
+        HarmonyPathCache paths;
+
+        HarmonyObject::_path_cache = &paths;
+        dumpBase(object ? object: root.object, 0, false, true, string(), filepath, writer);
+    }
     FINISH_SWEEP
     // PF("dumped");
+    releaseWriter(writer);
+    for (auto w: writers)
+        written += w->written;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    dump_bytes += written;
+    hdb_stats.dumped_bytes->add(written);
     if (!filepath.empty())
-        fclose(config_file);
-}
-
-static string sprint(const char *fmt, ...)
-{
-    static char buf[1024];
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, ap);
-    va_end(ap);
-    return string(buf);
+        PF("Dumped %lu bytes in %.3f ms, %.1f MB/s", written, ms, ms > 0 ? written / ms / 1e3: 0.0);
 }
 
 struct print_base_state {
-    FILE *config_file;
+    HdbWriter *writer;
     string header_to_print;
 
-    void print_config(const char *fmt, ...) {
+    void flushHeader() {
         if (!header_to_print.empty()) {
-            fprintf(config_file, "%s", header_to_print.c_str());
+            writer->append(header_to_print);
             header_to_print.clear();
         }
-        va_list ap;
-        va_start(ap, fmt);
-        vfprintf(config_file, fmt, ap);
-        va_end(ap);
+    }
+    void print(const char *s) {
+        flushHeader();
+        writer->append(s);
+    }
+    void print(const string &s) {
+        flushHeader();
+        writer->append(s);
+    }
+    void print(char c) {
+        flushHeader();
+        writer->append(c);
+    }
+    void print(int64_t value) {
+        flushHeader();
+        writer->append(value);
     }
     void indent(int level) {
         while (level > 0) {
-            print_config("    ");
+            print("    ");
             level--;
         }
     }
@@ -1280,18 +1527,22 @@ struct print_base_state {
     void dumpHints(const map<string, string> &hints) {
         if (!hints.empty()) {
             for (auto h: hints) {
-                if (h.first != HINT_BACKEND && h.first != HINT_FILEPATH)
-                    print_config("#\"%s\":\"%s\"", h.first.c_str(), h.second.c_str());
+                if (h.first != HINT_BACKEND && h.first != HINT_FILEPATH) {
+                    print("#\"");
+                    print(h.first);
+                    print("\":\"");
+                    print(h.second);
+                    print('"');
+                }
             }
         }
     }
 };
 
-
-void HarmonyDB::dumpBase(HarmonyObject *object, int indent_level, bool dont_indent, bool primary, string const &label, string const &filepath, FILE *config_file)
+void HarmonyDB::dumpBase(HarmonyObject *object, int indent_level, bool dont_indent, bool primary, string const &label, string const &filepath, HdbWriter *writer)
 {
     struct print_base_state pbs;
-    pbs.config_file = config_file;
+    pbs.writer = writer;
 
     bool add_space = false;
     bool add_newline = false;
@@ -1302,7 +1553,8 @@ void HarmonyDB::dumpBase(HarmonyObject *object, int indent_level, bool dont_inde
     if (!dont_indent)
         pbs.indent2(indent_level);
     if (!label.empty()) {
-        pbs.header_to_print += sprint("%s: ", label.c_str());
+        pbs.header_to_print += label;
+        pbs.header_to_print += ": ";
         // PRINT_CONFIG("%s: ", label.c_str());
     }
     PRINT_CONFIG_COLORING("\e[32m{%p:%c:%d:%d:  R:%p:%p}\e[0m ", object, primary ? 'P': 'p',
@@ -1316,30 +1568,37 @@ void HarmonyDB::dumpBase(HarmonyObject *object, int indent_level, bool dont_inde
     if (object->isProxy()) {
         if (object->proxy.object) {
             auto o = object->proxy.object;
-            PRINT_CONFIG("$ ");
+            pbs.print("$ ");
             if ((o->has_primary && !object->proxy.primary) || (!o->has_primary && (o->root_distance <= object->root_distance // don't move closer to root
                || o->sweep_mark == o->_current_sweep_mark))) {
                 PRINT_CONFIG_COLORING("\e[93m{%p:%c:%d:%d}\e[0m ", o,  o->has_primary ? (object->proxy.primary ? 'P': 'p'): '-',
                     o->root_distance, o->reference.structural_references);
-                PRINT_CONFIG("%s", o->getPath(object).c_str());
+                pbs.print(o->getPath(object));
             } else {
-                dumpBase(o, indent_level + 1, true, object->proxy.primary, string(), filepath, config_file);
+                dumpBase(o, indent_level + 1, true, object->proxy.primary, string(), filepath, writer);
             }
             // PRINT_CONFIG("$aa");//%s", o->reference.object->getPath().c_str());
         } else
-            PRINT_CONFIG("$");
+            pbs.print('$');
     } else if (object->isElement()) {
-        PRINT_CONFIG("%s[%ld]", object->element_type.object->getPath(object).c_str(), object->element_value);
+        pbs.print(object->element_type.object->getPath(object));
+        pbs.print('[');
+        pbs.print(object->element_value);
+        pbs.print(']');
         add_space = true;
     } else if (object->isType()) {
-        PRINT_CONFIG("<%ld, %ld>", object->type_lower, object->type_higher);
+        pbs.print('<');
+        pbs.print(object->type_lower);
+        pbs.print(", ");
+        pbs.print(object->type_higher);
+        pbs.print('>');
         add_space = true;
     } else if (object->isCode() && object->type != HarmonyObject::Type::PATTERN) {
         const char codes[] = "_ETP?*=+-!<>^~";
-        PRINT_CONFIG("%c", codes[object->type]);
+        pbs.print(codes[object->type]);
         add_space = true;
     } else if (object->isEmpty() && object->relations.next == &object->relations && object->type != HarmonyObject::Type::PATTERN) {
-        PRINT_CONFIG("_");
+        pbs.print('_');
     }
 
     if (!object->isEmpty() || object->relations.next != &object->relations) {
@@ -1357,20 +1616,21 @@ void HarmonyDB::dumpBase(HarmonyObject *object, int indent_level, bool dont_inde
                || item->object->sweep_mark == item->object->_current_sweep_mark))) {
                 if (add_comma) {
                     add_comma = false;
-                    PRINT_CONFIG(",");
+                    pbs.print(',');
                 }
                 if (add_newline) {
                     add_newline = false;
-                    PRINT_CONFIG("\n");
+                    pbs.print('\n');
                 }
                 pbs.indent(indent_level + 1);
                 if (!item->label.empty()) {
-                    PRINT_CONFIG("%s: ", item->label.c_str());
+                    pbs.print(item->label);
+                    pbs.print(": ");
                 }
                 PRINT_CONFIG_COLORING("\e[32m{%p:%c:%d:%d:  R:%p:%p}\e[0m ", item->object, item->object->has_primary ? (item->primary ? 'P': 'p'): '-',
                     item->object->root_distance, item->object->reference.structural_references,
                     item->object->context, item->object->parent_receiver);
-                PRINT_CONFIG("%s", item->object->getPath(object).c_str());
+                pbs.print(item->object->getPath(object));
                 add_comma = true;
                 add_newline = true;
             } else {
@@ -1383,38 +1643,37 @@ void HarmonyDB::dumpBase(HarmonyObject *object, int indent_level, bool dont_inde
                 auto hint_backend = item->object->getHint(HINT_BACKEND);
                 auto hint_filepath = item->object->getHint(HINT_FILEPATH);
 
-                if (config_file != stdout && hint_backend == "file") {
-                    FILE *new_config_file = config_file;
+                if (writer->fd != STDOUT_FILENO && hint_backend == "file") {
                     PF("SETTING TARGET FILE to %s\n", hint_filepath.c_str());
-                    new_config_file = createConfigFile(filepath + hint_filepath);
-                    dumpBase(item->object, 0, false, item->primary, name, filepath, new_config_file);
-                    fclose(new_config_file);
+                    auto new_writer = acquireWriter(createConfigFile(filepath + hint_filepath));
+                    dumpBase(item->object, 0, false, item->primary, name, filepath, new_writer);
+                    releaseWriter(new_writer);
                 } else {
                     if (add_comma) {
                         add_comma = false;
-                        PRINT_CONFIG(",");
+                        pbs.print(',');
                     }
                     if (add_newline) {
                         add_newline = false;
-                        PRINT_CONFIG("\n");
+                        pbs.print('\n');
                     }
                     // pbs.indent(indent_level + 1);
-                    PRINT_CONFIG("");
-                    dumpBase(item->object, indent_level + 1, false, item->primary, name, filepath, config_file);
+                    pbs.flushHeader();
+                    dumpBase(item->object, indent_level + 1, false, item->primary, name, filepath, writer);
                     add_comma = true;
                     add_newline = true;
                 }
             }
 
             // if (item->next != &object->items || !object->relations.isEmpty())
-            //     PRINT_CONFIG(",\n");
+            //     pbs.print(",\n");
             // else
-            //     PRINT_CONFIG("\n");
+            //     pbs.print('\n');
         }
         add_comma = false;
         if (add_newline) {
             add_newline = false;
-            PRINT_CONFIG("\n");
+            pbs.print('\n');
         }
         for (auto item = object->relations.next; item != &object->relations; item = item->next) {
             string name;
@@ -1428,64 +1687,72 @@ void HarmonyDB::dumpBase(HarmonyObject *object, int indent_level, bool dont_inde
 
             pbs.indent(indent_level + 1);
             if (!name.empty()) {
-                PRINT_CONFIG("%s: ", name.c_str());
+                pbs.print(name);
+                pbs.print(": ");
             }
             PRINT_CONFIG_COLORING("\e[32m{%p}\e[0m ", r);
-            PRINT_CONFIG("[\n");
+            pbs.print("[\n");
             pbs.indent(indent_level + 2);
 
             PRINT_CONFIG_COLORING("\e[32m{%p:%d:%d}\e[0m ", r->relation.object, r->relation.object->root_distance, r->relation.object->reference.structural_references);
-            PRINT_CONFIG("%s,\n", r->relation.object->getPath(item->object).c_str());
+            pbs.print(r->relation.object->getPath(item->object));
+            pbs.print(",\n");
 
             pbs.indent(indent_level + 2);
             PRINT_CONFIG_COLORING("\e[32m{%p:%d:%d}\e[0m ", r->source.object, r->source.object->root_distance, r->source.object->reference.structural_references);
-            PRINT_CONFIG("%s,\n", r->source.object->getPath(item->object).c_str());
+            pbs.print(r->source.object->getPath(item->object));
+            pbs.print(",\n");
 
             pbs.indent(indent_level + 2);
             PRINT_CONFIG_COLORING("\e[32m{%p:%d:%d}\e[0m ", r->destination.object, r->destination.object->root_distance, r->destination.object->reference.structural_references);
-            PRINT_CONFIG("%s\n", r->destination.object->getPath(item->object).c_str());
+            pbs.print(r->destination.object->getPath(item->object));
+            pbs.print('\n');
 
             pbs.indent(indent_level + 1);
-            PRINT_CONFIG("]");
+            pbs.print(']');
 
             pbs.dumpHints(r->hints);
 
             if (item != &object->relations)
                     // add_comma = true;
                     // add_newline = true;
-                PRINT_CONFIG(",\n");
+                pbs.print(",\n");
             else
-                PRINT_CONFIG("\n");
+                pbs.print('\n');
         }
         pbs.indent(indent_level);
-        PRINT_CONFIG(")");
+        pbs.print(')');
     } else if (object->type == HarmonyObject::Type::PATTERN) {
-        PRINT_CONFIG("[\n");
+        pbs.print("[\n");
         pbs.indent(indent_level + 1);
 
         // PRINT_CONFIG(" {%p:%d:%d} ", object->relation.object, object->relation.object->root_distance, object->relation.object->reference.structural_references);
-        PRINT_CONFIG("%s,\n", object->relation.object->getPath(object).c_str());
+        pbs.print(object->relation.object->getPath(object));
+        pbs.print(",\n");
 
         pbs.indent(indent_level + 1);
         // PRINT_CONFIG(" {%p:%d:%d} ", object->source.object, object->source.object->root_distance, object->source.object->reference.structural_references);
-        PRINT_CONFIG("%s,\n", object->source.object->getPath(object).c_str());
+        pbs.print(object->source.object->getPath(object));
+        pbs.print(",\n");
 
         pbs.indent(indent_level + 1);
         // PRINT_CONFIG(" {%p:%d:%d} ", object->destination.object, object->destination.object->root_distance, object->destination.object->reference.structural_references);
-        PRINT_CONFIG("%s,\n", object->destination.object->getPath(object).c_str());
+        pbs.print(object->destination.object->getPath(object));
+        pbs.print(",\n");
 
         pbs.indent(indent_level + 1);
         // PRINT_CONFIG(" {%p:%d:%d} ", object->pattern_owner.object, object->pattern_owner.object->root_distance, object->pattern_owner.object->reference.structural_references);
-        PRINT_CONFIG("%s\n", object->pattern_owner.object->getPath(object).c_str());
+        pbs.print(object->pattern_owner.object->getPath(object));
+        pbs.print('\n');
 
         pbs.indent(indent_level);
-        PRINT_CONFIG("]");
+        pbs.print(']');
     }
 
     pbs.dumpHints(object->hints);
 
     if (indent_level == 0)
-        PRINT_CONFIG("\n");
+        pbs.print('\n');
 }
 
 void HarmonyDB::clear()
@@ -1523,8 +1790,14 @@ HarmonyObject * HarmonyDB::createContext(HarmonyObject *source, string name, Har
         contexts->hints[HINT_FILEPATH] = "/context.hdb";
     }
 
+    auto account = hdb_memory.open(source ? source->getPrimaryPath(): name, this);
+    HdbMemScope scope(account);
     ctx = new HarmonyObject;
+    account->ctx = ctx;
+    account->name = ctx->getKey() + " " + account->name;
     contexts->add(ctx, name, true);
+    hdb_stats.contexts->add();
+    hdb_stats.contexts_created->add();
     if (source) {
         HarmonyObject *no;
         {
@@ -1569,11 +1842,39 @@ HarmonyObject * HarmonyDB::createContext(HarmonyObject *source, string name, Har
     return ctx;
 }
 
+// Takes a context out of .context. The receivers cloned in it can outlive it,
+// held by the return proxies of the contexts it launched, so they are
+// detached first: a reply to one of them mustn't wake or forward to a
+// context that is gone, or to another one allocated at its address.
+void HarmonyDB::removeContext(HarmonyObject *ctx)
+{
+    auto contexts = getRoot()->findItem("context")->object;
+    vector<HarmonyObject *> stack {ctx};
+    unordered_set<HarmonyObject *> visited;
+
+    while (!stack.empty()) {
+        auto object = stack.back();
+
+        stack.pop_back();
+        if (!visited.insert(object).second)
+            continue;
+        if (object->type == HarmonyObject::Type::RECEIVE && object->context == ctx)
+            object->context = NULL;
+        for (auto i = object->first(); i; i = i->nextItem(object))
+            if (i->primary)
+                stack.push_back(i->object);
+    }
+    contexts->remove(contexts->findItem(ctx));
+}
+
 HarmonyObject * HarmonyDB::cloneObject(HarmonyObject *source, HarmonyObject *parent, string label, bool primary)
 {
+    HdbPerfScope perf(HDB_PERF_CLONE);
     HarmonyObject *object;
 
+    source->ensureLoaded();
     object = source->clone();
+    hdb_stats.clones->add();
     // PF("%p -> %p", source, object);
     source->sweep_mark = HarmonyObject::_current_sweep_mark;
     source->sweep_object = object;
@@ -1701,6 +2002,7 @@ HarmonyObject * HarmonyDB::cloneArgument(HarmonyObject *source, HarmonyObject *p
 {
     HarmonyObject *object;
 
+    source->ensureLoaded();
     if (parent) {
         object = parent;
     } else {
@@ -2,10 +2,16 @@
 #define HARMONYDB_H
 
 #include "common.h"
+#include "hdb_stats.h"
+#include "hdb_memory.h"
+#include "hdb_perf.h"
 #include <stdint.h>
 #include <string>
 #include <list>
+#include <vector>
 #include <map>
+#include <unordered_set>
+#include <unordered_map>
 
 using namespace std;
 
@@ -43,14 +49,33 @@ struct HarmonyItem : HarmonyObjectReference {
     HarmonyItem * nextItem(HarmonyObject *set);
     HarmonyItem * previousItem(HarmonyObject *set);
     HarmonyItem * nextRelation(HarmonyObject *set);
+    string indexLabel();
     ~HarmonyItem();
 };
 
 struct HarmonyRelation;
+struct HarmonyDB;
+
+// Told of the mutations of the graph before they are made, see HdbNode's
+// replication. The ones made by another one, e.g. the items of an object
+// deleted by remove(), or by loading a stub aren't reported.
+struct HarmonyObserver {
+    virtual ~HarmonyObserver() {}
+    virtual void adding(HarmonyObject *set, HarmonyObject *object, const string &label, bool primary) = 0;
+    virtual void removing(HarmonyObject *set, HarmonyItem *item) = 0;
+    virtual void linking(HarmonyObject *proxy, HarmonyObject *object) = 0;
+    virtual void copying(HarmonyObject *object, HarmonyObject *source) = 0;
+    virtual void relating(HarmonyObject *owner, HarmonyRelation *r, const string &label) = 0;
+    virtual void unrelating(HarmonyObject *owner, HarmonyItem *item) = 0;
+};
+
+struct HdbWriter;
+struct HarmonyPathCache;
 
 #define START_SWEEP \
 { \
     HarmonyObject::_old_sweep_mark = HarmonyObject::_current_sweep_mark++; \
+    hdb_stats.sweeps->add(); \
     assert(HarmonyObject::_sweeping == false); \
     HarmonyObject::_sweeping = true; \
 }
@@ -65,8 +90,11 @@ struct HarmonyRelation;
 struct HarmonyObject {
     HarmonyObjectReference reference;
     map<string, string> hints;
+    HarmonyDB *lazy_loader;             // set while the file-backed contents are not loaded yet
+    HdbMemAccount *account;             // charged for the object, its items and relations
 
     static unsigned _object_count;
+    static uint64_t _objects_allocated, _objects_freed;
 
     unsigned int root_distance;
     bool has_primary;
@@ -78,6 +106,12 @@ struct HarmonyObject {
 
     unsigned int sweep_mark;
     unsigned int temporary_label_sweep_mark;
+    unsigned int census_mark;           // visited by HdbCensus, apart from the sweeps
+    uint64_t merkle;                    // cached structural hash, see HdbMerkle
+    uint8_t merkle_state;
+    static HarmonyPathCache *_path_cache;
+    static HarmonyObserver *_observer;  // NULL unless something replicates
+    static unsigned _observing;         // depth of the mutations in progress
     union {
         HarmonyItem *sweep_parent;
         HarmonyObject *sweep_object;
@@ -93,6 +127,12 @@ struct HarmonyObject {
     HarmonyItem items;
     HarmonyItem relations;
 
+    enum MerkleState : uint8_t {
+        MERKLE_INVALID = 0,
+        MERKLE_COMPUTING,
+        MERKLE_VALID
+    };
+
     enum Type {
         NUL = 0,
         ELEMENT,
@@ -110,6 +150,7 @@ struct HarmonyObject {
         RELATE,         // ~
         PATTERN         // pattern relation
     } type;
+    static_assert(PATTERN + 1 == HDB_TYPES, "a type without a name in hdb_type_names");
 
     HarmonyObjectReference element_type;
     int64_t element_value;              // ELEMENT
@@ -120,6 +161,7 @@ struct HarmonyObject {
     virtual ~HarmonyObject();
 
     const string getHint(const string &hint);
+    void setType(Type t);
     bool isNul() {
         return type == Type::NUL;
     }
@@ -141,6 +183,17 @@ struct HarmonyObject {
     bool isSend() {
         return type == Type::SEND;
     }
+    bool isRemote();
+    void invalidateMerkle() {
+        if (merkle_state == MERKLE_VALID)
+            _invalidateMerkle();
+    }
+    void _invalidateMerkle();
+    void load();
+    void ensureLoaded() {
+        if (lazy_loader)
+            load();
+    }
     int isEmpty();
     void clear();
     void clearRelations();
@@ -162,6 +215,8 @@ struct HarmonyObject {
     HarmonyItem * removeRelation(HarmonyItem *relation);
 
     HarmonyObject * getObject();
+    HarmonyItem * primaryItem();
+    string getPrimaryPath();
 
     void updateDistance(HarmonyObject *start, HarmonyObject * parent_root_distance = 0);
     int isReachable(HarmonyObject *start);
@@ -175,6 +230,37 @@ struct HarmonyObject {
     unsigned getItems(unsigned size, HarmonyObject *items[]);
 };
 
+// Interned labels of the sweep_parent chains, valid while the sweep parents
+// don't change, i.e. for one dump. The labels of the objects are kept here,
+// not in the objects, for the cache lives only as long as the dump.
+struct HarmonyPathCache {
+    struct Labels {
+        unsigned label, raw;                    // the temporary label if any, and the label
+    };
+
+    unordered_map<string, unsigned> ids;
+    vector<string> labels;                      // by id, 0 is the empty label
+    vector<HarmonyItem *> path, start_path;     // the last chains, root first
+    vector<HarmonyItem *> scratch;
+    vector<unsigned> path_labels, start_labels, start_raw_labels;
+    HarmonyObject *start;                       // start_path is kept for it
+    unordered_map<HarmonyObject *, Labels> objects;
+
+    HarmonyPathCache();
+    ~HarmonyPathCache();
+    unsigned intern(const string &label);
+    const Labels & cacheLabels(HarmonyObject *object);
+    unsigned label(HarmonyItem *item) {
+        return cacheLabels(item->object).label;
+    }
+    unsigned rawLabel(HarmonyItem *item) {
+        return cacheLabels(item->object).raw;
+    }
+    void chain(HarmonyObject *object, vector<HarmonyItem *> &chain, vector<unsigned> &labels);
+    void setStart(HarmonyObject *object);
+    bool collision(size_t pi, size_t si);
+};
+
 struct HarmonyRelation : HarmonyObject {
     string label;
     HarmonyObject *owner;
@@ -187,12 +273,33 @@ struct HarmonyRelation : HarmonyObject {
 #define HINT_BACKEND "backend"
 #define HINT_BACKEND_FILE "file"
 #define HINT_FILEPATH "filepath"
+#define HINT_NODE "node"        // the node owning the object, see HdbNode
+#define HINT_REMOTE "remote"    // its path there
+
+inline bool HarmonyObject::isRemote()
+{
+    return !hints.empty() && hints.count(HINT_NODE);
+}
 
 struct HarmonyDB
 {
     HarmonyItem root;
     HarmonyObject *local_root;
 
+    string base_path;
+    bool lazy;
+    bool direct_loader;
+    bool mmap_scanner;
+    unordered_set<HarmonyObject *> lazy_stubs;
+    unsigned stubs_loaded;
+    unsigned symbol_hits, symbol_misses;   // reference resolution while loading
+    vector<HdbWriter *> writers;            // dump buffers, one per open backend file
+    unsigned writers_used;
+    uint64_t dump_bytes;
+    string node;                        // of a partitioned base, the node loading it
+    map<string, string> placement;      // subtree of the root -> node owning it
+    HdbMemAccount *account;             // charged for its objects outside of the contexts
+
     HarmonyDB();
     ~HarmonyDB();
     void setRoot(HarmonyObject *object);
@@ -204,10 +311,20 @@ struct HarmonyDB
     HarmonyObject * queryRelation(HarmonyObject *relation, HarmonyObject *source_set, HarmonyObject *source_object,
         HarmonyObject *destination_set);
 
-    void loadFile(string filepath, HarmonyObject *root, string relative_path = string());
+    void loadFile(string filepath, HarmonyObject *root, string relative_path = string(), HarmonyObject *stub = NULL);
+    void loadFileDirect(string filepath, HarmonyObject *root, string relative_path = string(), HarmonyObject *stub = NULL);
     void loadDir(string filepath, HarmonyObject *root, string relative_path = string());
+    void placeShards(const string &filepath, HarmonyObject *root, unordered_set<string> &placed);
+    HarmonyObject * remoteObject(const string &node, const string &path);
+    void registerStub(HarmonyObject *stub);
+    void unregisterStub(HarmonyObject *stub);
+    void loadStub(HarmonyObject *stub);
+    void loadStubs();
+    void adoptObject(HarmonyObject *stub, HarmonyObject *object);
     void dumpBase(HarmonyObject *object = NULL, string const &filepath = string());
-    void dumpBase(HarmonyObject *object, int indent_level, bool dont_indent, bool primary, string const &label, string const &filepath, FILE *config_file);
+    void dumpBase(HarmonyObject *object, int indent_level, bool dont_indent, bool primary, string const &label, string const &filepath, HdbWriter *writer);
+    HdbWriter * acquireWriter(int fd);
+    void releaseWriter(HdbWriter *writer);
 // sweep
     void sweep(HarmonyObject *object, HarmonyItem *parent = NULL, bool nonstructural = false);
 // sweep
@@ -215,6 +332,7 @@ struct HarmonyDB
     void substituteObject(HarmonyObject *old_object, HarmonyObject *new_object);
 
     HarmonyObject * createContext(HarmonyObject *source, string name = string(), HarmonyObject *return_object = NULL, HarmonyObject *arg = NULL);
+    void removeContext(HarmonyObject *ctx);
     HarmonyObject * cloneObject(HarmonyObject *source, HarmonyObject *parent = NULL, string label = string(), bool primary = false);
 // sweep
     HarmonyObject * cloneArgument(HarmonyObject *source, HarmonyObject *parent = NULL);
@@ -224,6 +342,6 @@ struct HarmonyDB
     bool clearArguments(HarmonyObject *receiver, unsigned level = 0);
 };
 
-HarmonyDB * buildBase(const char *filepathS);
+HarmonyDB * buildBase(const char *filepath, bool lazy = false, bool direct_loader = false, bool mmap_scanner = false, const char *node = NULL);
 
 #endif
\ No newline at end of file
@@ -16,6 +16,8 @@
 
 %{
     yy::location &loc = drv.location;
+    if (drv.use_mmap)
+        return drv.mmap_scanner.lex(loc);
     loc.step();
 %}
 
@@ -58,10 +60,18 @@
 void hdb_driver::scan_begin(FILE *file)
 {
     yy_flex_debug = trace_scanning;
-    yyin = file;
+    if (use_mmap) {
+        mmap_scanner.map(fileno(file));
+        this->file = file;
+    } else
+        yyin = file;
 }
 
 void hdb_driver::scan_end()
 {
-    fclose(yyin);
+    if (use_mmap) {
+        mmap_scanner.unmap();
+        fclose(file);
+    } else
+        fclose(yyin);
 }
@@ -0,0 +1,155 @@
+#include <string.h>
+#include <time.h>
+
+#include "hdb_census.h"
+
+unsigned HdbCensus::_census_mark = 0;
+
+HdbCensusDistribution::HdbCensusDistribution()
+{
+    memset(buckets, 0, sizeof(buckets));
+    sum = 0;
+    max = 0;
+}
+
+void HdbCensusDistribution::add(uint64_t value)
+{
+    unsigned b = value ? 64 - __builtin_clzll(value): 0;
+
+    buckets[b < HDB_CENSUS_BUCKETS ? b: HDB_CENSUS_BUCKETS - 1]++;
+    sum += value;
+    if (value > max)
+        max = value;
+}
+
+void HdbCensusDistribution::print(FILE *f, const char *name, uint64_t count)
+{
+    fprintf(f, "%s: mean %.2f, max %lu\n", name, count ? (double)sum / count: 0.0, max);
+    for (unsigned b = 0; b < HDB_CENSUS_BUCKETS; b++) {
+        if (!buckets[b])
+            continue;
+        if (b < 2)
+            fprintf(f, "%23u %12lu\n", b, buckets[b]);
+        else
+            fprintf(f, "%10lu - %10lu %12lu\n", 1ul << (b - 1), (1ul << b) - 1, buckets[b]);
+    }
+}
+
+HdbCensus::HdbCensus()
+{
+    memset(objects, 0, sizeof(objects));
+    memset(alive, 0, sizeof(alive));
+    stubs = 0;
+    ms = 0;
+}
+
+void HdbCensus::count(HarmonyObject *object, Subtree &subtree)
+{
+    uint64_t n = 0;
+
+    objects[object->type]++;
+    subtree.objects[object->type]++;
+    if (object->lazy_loader) {
+        stubs++;
+        subtree.stubs++;
+    }
+    references.add(object->reference.countReferences());
+    root_distance.add(object->root_distance);
+
+    for (auto i = object->items.next; i != &object->items; i = i->next, n++)
+        visit(i->object);
+    items.add(n);
+    n = 0;
+    for (auto r = object->relations.next; r != &object->relations; r = r->next, n++)
+        visit(r->object);
+    relations.add(n);
+    if (object->isProxy())
+        visit(object->proxy.object);
+    visit(object->element_type.object);
+    visit(object->relation.object);
+    visit(object->source.object);
+    visit(object->destination.object);
+    visit(object->pattern_owner.object);
+}
+
+// each object is counted in the first subtree of the root reaching it
+void HdbCensus::walk(HarmonyDB *db)
+{
+    struct timespec start, end;
+    auto root = db->getRoot();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    _census_mark++;
+    subtrees.clear();
+    subtrees.push_back(Subtree {"(root)", {}, 0});
+    root->census_mark = _census_mark;
+    // the root alone, its items are the subtrees
+    objects[root->type]++;
+    subtrees[0].objects[root->type]++;
+    references.add(root->reference.countReferences());
+    root_distance.add(root->root_distance);
+    for (auto i = root->items.next; i != &root->items; i = i->next)
+        subtrees.push_back(Subtree {i->indexLabel(), {}, 0});
+    items.add(subtrees.size() - 1);
+    relations.add(0);
+
+    unsigned s = 1;
+    for (auto i = root->items.next; i != &root->items; i = i->next, s++) {
+        visit(i->object);
+        while (!stack.empty()) {
+            auto o = stack.back();
+            stack.pop_back();
+            count(o, subtrees[s]);
+        }
+    }
+    // the relations of the root last
+    for (auto r = root->relations.next; r != &root->relations; r = r->next)
+        visit(r->object);
+    while (!stack.empty()) {
+        auto o = stack.back();
+        stack.pop_back();
+        count(o, subtrees[0]);
+    }
+    stack.shrink_to_fit();
+    hdb_memory.live(db, alive);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+void HdbCensus::print(FILE *f)
+{
+    uint64_t reached = 0, unreachable = 0;
+    int64_t live = 0;
+
+    for (auto n: objects)
+        reached += n;
+    for (auto n: alive)
+        live += n;
+    fprintf(f, "%lu objects reached in %.3f ms, %ld alive in the base\n\n", reached, ms, live);
+
+    fprintf(f, "%12s %12s %12s  %s\n", "reached", "alive", "unreachable", "type");
+    for (unsigned t = 0; t < HDB_TYPES; t++) {
+        int64_t lost = alive[t] - (int64_t)objects[t];
+
+        if (!alive[t] && !objects[t])
+            continue;
+        fprintf(f, "%12lu %12ld %12ld  %s\n", objects[t], alive[t], lost, hdb_type_names[t]);
+        if (lost > 0)
+            unreachable += lost;
+    }
+    fprintf(f, "%lu alive objects are not reachable from the root\n\n", unreachable);
+
+    fprintf(f, "%12s %12s  %s\n", "objects", "stubs", "subtree");
+    for (auto &s: subtrees) {
+        uint64_t n = 0;
+
+        for (auto o: s.objects)
+            n += o;
+        fprintf(f, "%12lu %12lu  %s\n", n, s.stubs, s.label.c_str());
+    }
+    fprintf(f, "\n");
+    items.print(f, "items per object", reached);
+    relations.print(f, "relations per object", reached);
+    references.print(f, "references per object", reached);
+    root_distance.print(f, "root_distance", reached);
+}
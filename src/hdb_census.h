@@ -0,0 +1,64 @@
+#ifndef HDB_CENSUS_H
+#define HDB_CENSUS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "harmonydb.h"
+
+using namespace std;
+
+#define HDB_CENSUS_BUCKETS 33   // 0, 1, 2-3, 4-7, ... 2^31-
+
+// Power of two histogram of small counts
+struct HdbCensusDistribution
+{
+    uint64_t buckets[HDB_CENSUS_BUCKETS];
+    uint64_t sum, max;
+
+    HdbCensusDistribution();
+    void add(uint64_t value);
+    void print(FILE *f, const char *name, uint64_t count);
+};
+
+// Walks the live graph from the root with an explicit stack and its own
+// census_mark, so that it can run at any time between the commands without
+// touching the sweep marks. Lazy stubs are counted but not loaded. The live
+// objects that weren't reached, by type, are what the memory accounts of the
+// base count minus what the walk found. One walk per census.
+struct HdbCensus
+{
+    struct Subtree {
+        string label;
+        uint64_t objects[HDB_TYPES];
+        uint64_t stubs;
+    };
+
+    static unsigned _census_mark;
+
+    uint64_t objects[HDB_TYPES];
+    int64_t alive[HDB_TYPES];           // by the accounts of the base when walked
+    uint64_t stubs;
+    vector<Subtree> subtrees;           // the items of the root
+    HdbCensusDistribution items, relations, references, root_distance;
+    double ms;
+
+    HdbCensus();
+
+    void walk(HarmonyDB *db);
+    void print(FILE *f);
+
+private:
+    vector<HarmonyObject *> stack;
+
+    void visit(HarmonyObject *object) {
+        if (object && object->census_mark != _census_mark) {
+            object->census_mark = _census_mark;
+            stack.push_back(object);
+        }
+    }
+    void count(HarmonyObject *object, Subtree &subtree);
+};
+
+#endif
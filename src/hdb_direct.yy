@@ -0,0 +1,280 @@
+%skeleton "lalr1.cc"
+%require "3.7.6"
+%defines
+
+%define api.namespace {hdbd}
+%define api.token.raw
+%define api.token.constructor
+%define api.value.type variant
+%define parse.assert
+
+%code requires {
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "location.hh"  // generated for hdb.yy
+class hdb_direct_driver;
+#include "hdb_objects.h"
+}
+
+%param { hdb_direct_driver &drv }
+%locations
+%define api.location.type {yy::location}
+
+%define parse.trace
+%define parse.error detailed
+%define parse.lac full
+
+%code {
+#include "hdb_direct_driver.h"
+}
+
+%define api.token.prefix {TOK_}
+
+// same tokens in the same order as hdb.yy, the scanner is shared
+%token
+    LEFT_ROUND "("
+    RIGHT_ROUND ")"
+    LEFT_SQUARE "["
+    RIGHT_SQUARE "]"
+    LEFT_CURLY "{"
+    RIGHT_CURLY "}"
+    LEFT_TRIANGLE "<"
+    RIGHT_TRIANGLE ">"
+    COLON ":"
+    DOT "."
+    COMMA ","
+    TILDE "~"
+    EXCLAMATION "!"
+    AT "@"
+    HASH "#"
+    DOLLAR "$"
+    PERCENT "%"
+    APOSTROPHE "^"
+    AMPERSAND "&"
+    ASTERISK "*"
+    UNDERSCORE "_"
+    QUESTION "?"
+    EQUAL "="
+    PLUS "+"
+    MINUS "-"
+;
+%token<int64_t> INT
+%token<double> FLOAT
+%token<string> TEXT NAME SYMBOL DOTSYMBOL
+%type<vector<HdbDirectEntry> *> final_expression expr_next set set_next
+%type<HdbDirectEntry> expression
+%type<HarmonyObject *> item item_noref item_proxy object
+%type<HdbDirectReference> reference
+%type<HarmonyObjectPath> absolute_path path_next
+%type<list<HdbHint>> hints
+%type<HdbHint> hint
+
+%start final_expression
+
+%%
+
+final_expression: expression expr_next {
+        $2->push_back($1);
+        reverse($2->begin(), $2->end());
+        drv.root = $2;
+    }
+
+expr_next: {
+        $$ = new vector<HdbDirectEntry>;
+    }
+    | "," expression expr_next { // collected backwards
+        $3->push_back($2);
+        $$ = $3;
+    }
+
+expression: item_proxy hints {
+        $$.object = $1;
+        $$.temporary = false;
+        drv.setHints($1, $2);
+    }
+    | SYMBOL ":" item_proxy hints {
+        $$.object = $3;
+        $$.label = $1;
+        $$.temporary = false;
+        drv.setHints($3, $4);
+    }
+    | DOTSYMBOL ":" item_proxy hints {
+        $$.object = $3;
+        $$.label = $1;
+        $$.temporary = true;
+        drv.setHints($3, $4);
+    }
+
+reference: absolute_path {
+        $$.path = $1;
+        $$.absolute = true;
+    }
+    | SYMBOL absolute_path {
+        $2.push_front($1);
+        $$.path = $2;
+        $$.absolute = false;
+    }
+    | DOT {
+        $$.absolute = true;
+    }
+    | SYMBOL {
+        $$.path.push_front($1);
+        $$.absolute = false;
+    }
+
+absolute_path: DOTSYMBOL path_next {
+        $2.push_front($1);
+        $$ = $2;
+    }
+
+path_next: DOTSYMBOL path_next {
+        $2.push_front($1);
+        $$ = $2;
+    }
+    | {
+    }
+
+item_proxy: "$" { // empty proxy
+        $$ = new HarmonyObject(HarmonyObject::Type::PROXY);
+    }
+    | "$" reference { // proxy to a symbol, linked when resolved
+        auto p = new HarmonyObject(HarmonyObject::Type::PROXY);
+        drv.addFixup(HdbFixup::LINK, p, $2);
+        $$ = p;
+    }
+    | "$" item_noref { // proxy
+        auto p = new HarmonyObject(HarmonyObject::Type::PROXY);
+        p->link($2);
+        $$ = p;
+    }
+    | item {
+        $$ = $1;
+    }
+
+item: item_noref {
+        $$ = $1;
+    }
+    | reference { // stub, substituted when resolved
+        auto o = new HarmonyObject;
+        drv.addFixup(HdbFixup::SUBSTITUTE, o, $1);
+        $$ = o;
+    }
+
+item_noref: object {
+        $$ = $1;
+    }
+    | "_" { // null
+        $$ = new HarmonyObject;
+    }
+    | object set {
+        drv.attach($1, $2);
+        $$ = $1;
+    }
+    | set {
+        auto object = new HarmonyObject;
+        drv.attach(object, $1);
+        $$ = object;
+    }
+    | "[" reference "," reference "," reference "]" {
+        auto r = new HarmonyRelation;
+        drv.addFixup(HdbFixup::RELATION, r, $2);
+        drv.addFixup(HdbFixup::SOURCE, r, $4);
+        drv.addFixup(HdbFixup::DESTINATION, r, $6);
+        $$ = r;
+    }
+    | "[" reference "," reference "," reference "," reference "]" {
+        auto p = new HarmonyObject(HarmonyObject::Type::PATTERN);
+        drv.addFixup(HdbFixup::RELATION, p, $2);
+        drv.addFixup(HdbFixup::SOURCE, p, $4);
+        drv.addFixup(HdbFixup::DESTINATION, p, $6);
+        drv.addFixup(HdbFixup::OWNER, p, $8);
+        $$ = p;
+    }
+
+hints: {
+    }
+    | "#" hint hints {
+        $3.push_front($2);
+        $$ = $3;
+    }
+
+hint: TEXT ":" TEXT {
+        $$.name = $1;
+        $$.value = $3;
+    }
+
+set: "(" expression set_next {
+        $3->push_back($2);
+        reverse($3->begin(), $3->end());
+        $$ = $3;
+    }
+    | "(" ")" {
+        $$ = new vector<HdbDirectEntry>;
+    }
+
+set_next: RIGHT_ROUND {
+        $$ = new vector<HdbDirectEntry>;
+    }
+    | "," expression set_next { // collected backwards
+        $3->push_back($2);
+        $$ = $3;
+    }
+
+object:
+    reference "[" INT "]" { // element
+        auto o = new HarmonyObject(HarmonyObject::Type::ELEMENT);
+        o->element_value = $3;
+        drv.addFixup(HdbFixup::ELEMENT_TYPE, o, $1);
+        $$ = o;
+    }
+    | "<" INT "," INT ">" { // enum type
+        auto o = new HarmonyObject(HarmonyObject::Type::TYPE);
+        o->type_lower = $2;
+        o->type_higher = $4;
+        $$ = o;
+    }
+    | "<" ">" { // complex type
+        $$ = new HarmonyObject(HarmonyObject::Type::TYPE);
+    }
+    | TEXT {
+        $$ = new HarmonyObject;
+    }
+// instructions
+    | "?" { // match and resolve (pattern, unknowns, negatives, [cont])
+        $$ = new HarmonyObject(HarmonyObject::Type::MATCH);
+    }
+    | "*" { // create object (where)
+        $$ = new HarmonyObject(HarmonyObject::Type::CREATE);
+    }
+    | "=" { // assign value (dest, src) or (dest) to clear
+        $$ = new HarmonyObject(HarmonyObject::Type::ASSIGN);
+    }
+    | "+" { // add to set (set, element)
+        $$ = new HarmonyObject(HarmonyObject::Type::ADD);
+    }
+    | "-" { // remove from set (set, element) or remove relation (set, $relation)
+        $$ = new HarmonyObject(HarmonyObject::Type::REMOVE);
+    }
+    | "!" { // launcher (args, cont)
+        $$ = new HarmonyObject(HarmonyObject::Type::LAUNCH);
+    }
+    | "<" { // receive (args)
+        $$ = new HarmonyObject(HarmonyObject::Type::RECEIVE);
+    }
+    | ">" { // send (receiver, args)
+        $$ = new HarmonyObject(HarmonyObject::Type::SEND);
+    }
+    | "^" { // link (dest, src) or unlink (dest)
+        $$ = new HarmonyObject(HarmonyObject::Type::LINK);
+    }
+    | "~" { // relate (source, destination, relation, owner)
+        $$ = new HarmonyObject(HarmonyObject::Type::RELATE);
+    }
+
+%%
+
+void hdbd::parser::error(const location_type &l, const std::string &m)
+{
+    std::cerr << l << ": " << m << endl;
+}
@@ -0,0 +1,238 @@
+#include "hdb_direct_driver.h"
+#include "hdb_direct_parser.h"
+#include "common.h"
+
+hdb_direct_driver::hdb_direct_driver(HarmonyDB *db)
+    : db(db), root(NULL), trace_parsing(false)
+{
+}
+
+// token numbers are the same in both grammars
+YY_DIRECT_DECL
+{
+    auto t = yylex(drv.scanner);
+    auto &location = t.location;
+
+    switch (t.kind()) {
+        case yy::parser::symbol_kind::S_INT:
+            return hdbd::parser::symbol_type(t.kind(), t.value.as<int64_t>(), location);
+        case yy::parser::symbol_kind::S_FLOAT:
+            return hdbd::parser::symbol_type(t.kind(), t.value.as<double>(), location);
+        case yy::parser::symbol_kind::S_TEXT:
+        case yy::parser::symbol_kind::S_NAME:
+        case yy::parser::symbol_kind::S_SYMBOL:
+        case yy::parser::symbol_kind::S_DOTSYMBOL:
+            return hdbd::parser::symbol_type(t.kind(), std::move(t.value.as<string>()), location);
+        default:
+            return hdbd::parser::symbol_type(t.kind(), location);
+    }
+}
+
+int hdb_direct_driver::parse(FILE *file)
+{
+    scanner.scan_begin(file);
+    hdbd::parser parse(*this);
+    parse.set_debug_level(trace_parsing);
+    int res = parse();
+    scanner.scan_end();
+    return res;
+}
+
+void hdb_direct_driver::attach(HarmonyObject *parent, vector<HdbDirectEntry> *entries)
+{
+    list<HarmonyItem *> labels;
+
+    for (auto &e: *entries) {
+        HarmonyItem *item;
+
+        if (auto r = dynamic_cast<HarmonyRelation *>(e.object)) {
+            r->label = e.label;
+            item = parent->addRelation(r, !e.temporary ? e.label: string());
+        } else {
+            item = parent->add(e.object, !e.temporary ? e.label: string(), true); // make structural and primary
+        }
+        if (e.temporary)
+            labels.push_back(item);
+    }
+    // temporary labels are set after all the others, they are not checked for collisions
+    auto e = entries->begin();
+    for (auto item: labels) {
+        while (!e->temporary)
+            e++;
+        item->label = e->label;
+        temporaries.push_back(item);
+        e++;
+    }
+    delete entries;
+}
+
+void hdb_direct_driver::setHints(HarmonyObject *object, const list<HdbHint> &hints)
+{
+    for (auto &h: hints)
+        object->hints[h.name] = h.value;
+}
+
+void hdb_direct_driver::addFixup(HdbFixup::Kind kind, HarmonyObject *object, const HdbDirectReference &reference)
+{
+    HdbFixup fixup;
+
+    fixup.kind = kind;
+    fixup.object = object;
+    fixup.reference = reference;
+    if (kind == HdbFixup::SUBSTITUTE)
+        substitutions.push_back(fixup);
+    else
+        fixups[reference.toString()].push_back(fixup);
+}
+
+void hdb_direct_driver::replaceObject(HarmonyObject *old_object, HarmonyObject *new_object)
+{
+    for (auto &f: substitutions) {
+        if (f.object == old_object)
+            f.object = new_object;
+    }
+    for (auto &it: fixups) {
+        for (auto &f: it.second) {
+            if (f.object == old_object)
+                f.object = new_object;
+        }
+    }
+    for (auto &t: tops) {
+        if (t == old_object)
+            t = new_object;
+    }
+}
+
+// enclosing object in the file being loaded and the label the object has there
+HarmonyObject * hdb_direct_driver::scopeParent(HarmonyObject *object, string &label)
+{
+    HarmonyObject *parent = NULL;
+    HarmonyItem *i;
+
+    label.clear();
+    if (auto r = dynamic_cast<HarmonyRelation *>(object)) {
+        label = r->label;
+        parent = r->owner;
+    } else if ((i = object->primaryItem())) {
+        label = i->label;
+        parent = i->parent;
+    }
+    for (auto t: tops) {
+        if (t == object)
+            return NULL;
+    }
+    return parent;
+}
+
+// same scoping rules as getObjectByReference(), walked on the objects being built
+HarmonyObject * hdb_direct_driver::lookup(const HdbDirectReference &reference, HarmonyObject *start)
+{
+    HarmonyObject *last_start_object = NULL;
+
+    if (!reference.absolute) {
+        auto pi = reference.path.begin();
+
+        do {
+            HarmonyItem *i;
+            string label;
+
+            if ((i = start->findItem(*pi)) || (i = start->findRelation(*pi))) {
+                pi++;
+                if (pi == reference.path.end())
+                    return i->object;
+                start = i->object;
+                continue;
+            }
+            last_start_object = start;
+
+            auto parent = scopeParent(start, label);
+            if (label == *pi) {
+                pi++;
+                if (pi == reference.path.end())
+                    return start;
+                continue;
+            }
+            start = parent;
+        } while (start);
+    }
+    return db->getObjectByPath(reference.path, last_start_object);
+}
+
+// the first object up the scope chain the lookup can stop at, leaves resolve like their parents
+HarmonyObject * hdb_direct_driver::lookupScope(const HdbDirectReference &reference, HarmonyObject *start)
+{
+    string label;
+
+    if (reference.absolute)
+        return NULL;
+    while (start->isEmpty() && start->relations.next == &start->relations) {
+        auto parent = scopeParent(start, label);
+        if (!parent || label == reference.path.front())
+            break;
+        start = parent;
+    }
+    return start;
+}
+
+void hdb_direct_driver::resolve()
+{
+    // references standing for objects come first as they change the graph, they may depend on each other
+    for (bool progress = true; progress && !substitutions.empty(); ) {
+        progress = false;
+        for (auto f = substitutions.begin(); f != substitutions.end(); ) {
+            auto destination = lookup(f->reference, f->object);
+            if (destination && destination != f->object) {
+                db->substituteObject(f->object, destination);
+                f = substitutions.erase(f);
+                progress = true;
+            } else
+                f++;
+        }
+    }
+    assertf(substitutions.empty(), "Destination object [%s] not found!", substitutions.front().reference.toString().c_str());
+
+    for (auto &it: fixups) {
+        unordered_map<HarmonyObject *, HarmonyObject *> resolved; // by scope, absolute ones resolve once
+
+        for (auto &f: it.second) {
+            HarmonyObject *destination;
+            auto scope = lookupScope(f.reference, f.object);
+            auto r = resolved.find(scope);
+
+            if (r != resolved.end()) {
+                destination = r->second;
+            } else {
+                destination = lookup(f.reference, scope ? scope: f.object);
+                resolved[scope] = destination;
+            }
+            assertf(destination, "Destination object [%s] not found!", it.first.c_str());
+            switch (f.kind) {
+                case HdbFixup::ELEMENT_TYPE:
+                    f.object->element_type.setReference(destination);
+                    break;
+                case HdbFixup::LINK:
+                    f.object->link(destination);
+                    break;
+                case HdbFixup::RELATION:
+                    f.object->relation.setReference(destination);
+                    break;
+                case HdbFixup::SOURCE:
+                    f.object->source.setReference(destination);
+                    break;
+                case HdbFixup::DESTINATION:
+                    f.object->destination.setReference(destination);
+                    break;
+                case HdbFixup::OWNER:
+                    f.object->pattern_owner.setReference(destination);
+                    break;
+                default:
+                    assert(0);
+            }
+        }
+    }
+    fixups.clear();
+
+    for (auto i: temporaries)
+        i->label.clear();
+    temporaries.clear();
+}
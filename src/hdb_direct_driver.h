@@ -0,0 +1,45 @@
+#ifndef DIRECT_DRIVER_H
+#define DIRECT_DRIVER_H
+
+#include <map>
+#include <list>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "hdb_driver.h"
+#include "hdb_direct_parser.h"
+
+#define YY_DIRECT_DECL \
+     hdbd::parser::symbol_type yylex (hdb_direct_driver& drv)
+YY_DIRECT_DECL;
+
+// Builds HarmonyObjects straight from the grammar actions. References are
+// collected as fixups and patched in one batch once the whole file is parsed.
+class hdb_direct_driver
+{
+public:
+    hdb_direct_driver(HarmonyDB *db);
+    HarmonyDB *db;
+    vector<HdbDirectEntry> *root;
+
+    list<HdbFixup> substitutions;
+    map<string, list<HdbFixup> > fixups;   // by path
+    list<HarmonyItem *> temporaries;        // temporary labels, visible until resolved
+    list<HarmonyObject *> tops;
+
+    int parse(FILE *file);
+    bool trace_parsing;
+
+    void attach(HarmonyObject *parent, vector<HdbDirectEntry> *entries);
+    void setHints(HarmonyObject *object, const list<HdbHint> &hints);
+    void addFixup(HdbFixup::Kind kind, HarmonyObject *object, const HdbDirectReference &reference);
+    void replaceObject(HarmonyObject *old_object, HarmonyObject *new_object);
+    HarmonyObject * scopeParent(HarmonyObject *object, string &label);
+    HarmonyObject * lookup(const HdbDirectReference &reference, HarmonyObject *start);
+    HarmonyObject * lookupScope(const HdbDirectReference &reference, HarmonyObject *start);
+    void resolve();
+
+    hdb_driver scanner;
+};
+
+#endif
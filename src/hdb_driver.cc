@@ -2,7 +2,7 @@
 #include "hdb_parser.h"
 
 hdb_driver::hdb_driver()
-    : trace_parsing(false), trace_scanning(false)
+    : trace_parsing(false), trace_scanning(false), use_mmap(false), file(NULL)
 {
 }
 
@@ -5,6 +5,7 @@
 #include <list>
 #include <string>
 #include "hdb_parser.h"
+#include "hdb_mmap_scanner.h"
 
 #define YY_DECL \
      yy::parser::symbol_type yylex (hdb_driver& drv)
@@ -26,6 +27,10 @@ public:
     void scan_end();
     bool trace_scanning;
     yy::location location;
+
+    bool use_mmap;      // scan the mapped file instead of going through flex
+    hdb_mmap_scanner mmap_scanner;
+    FILE *file;
 };
 
 #endif
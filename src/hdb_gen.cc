@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hdb_generator.h"
+#include "common.h"
+
+static void usage()
+{
+    printf("usage: divee_gen [--objects N] [--fanout N] [--depth N] [--types N] [--relations R]\n"
+           "                 [--xrefs R] [--files N] [--seed N] [--program] <path>\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    HdbGeneratorOptions options;
+    const char *filepath = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') {
+            filepath = argv[i];
+            continue;
+        }
+        if (!strcmp(argv[i], "--program")) {
+            options.program = true;
+            continue;
+        }
+        if (i + 1 == argc)
+            usage();
+        auto value = argv[++i];
+        if (!strcmp(argv[i - 1], "--objects"))
+            options.objects = atoi(value);
+        else if (!strcmp(argv[i - 1], "--fanout"))
+            options.fanout = atoi(value);
+        else if (!strcmp(argv[i - 1], "--depth"))
+            options.depth = atoi(value);
+        else if (!strcmp(argv[i - 1], "--types"))
+            options.types = atoi(value);
+        else if (!strcmp(argv[i - 1], "--relations"))
+            options.relation_density = atof(value);
+        else if (!strcmp(argv[i - 1], "--xrefs"))
+            options.xref_ratio = atof(value);
+        else if (!strcmp(argv[i - 1], "--files"))
+            options.files = atoi(value);
+        else if (!strcmp(argv[i - 1], "--seed"))
+            options.seed = atoi(value);
+        else
+            usage();
+    }
+    if (!filepath)
+        usage();
+    auto count = generateBase(options, filepath);
+    printf("%u objects written to %s\n", count, filepath);
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <vector>
+#include <random>
+
+#include "hdb_generator.h"
+#include "common.h"
+
+HdbGeneratorOptions::HdbGeneratorOptions()
+{
+    objects = 10000;
+    fanout = 10;
+    depth = 4;
+    types = 4;
+    relation_density = 0.1;
+    xref_ratio = 0.1;
+    files = 1;
+    seed = 1;
+    program = false;
+}
+
+struct HdbGenerator {
+    const HdbGeneratorOptions &options;
+    mt19937 random;
+    FILE *file;
+    unsigned count;
+    string group;
+    vector<string> paths;   // of the objects written so far in the group, relative to it
+    vector<string> leaves;  // cross references only point to leaves, cloneObject() can't follow a proxy into a set it cloned already
+
+    HdbGenerator(const HdbGeneratorOptions &options) : options(options), random(options.seed), file(NULL), count(0) {}
+
+    double uniform() {
+        return uniform_real_distribution<double>(0, 1)(random);
+    }
+    unsigned pick(unsigned n) {
+        return uniform_int_distribution<unsigned>(0, n - 1)(random);
+    }
+    const string & pickPath() {
+        return paths[pick(paths.size())];
+    }
+    const string & pickLeaf() {
+        return leaves[pick(leaves.size())];
+    }
+    void indent(unsigned level) {
+        for (unsigned i = 0; i < level; i++)
+            fputs("    ", file);
+    }
+    void leaf(const string &path) {
+        if (!leaves.empty() && uniform() < options.xref_ratio) {
+            fprintf(file, "$ %s", pickLeaf().c_str());
+        } else {
+            unsigned t = pick(options.types);
+            fprintf(file, "types.t%u[%u]", t, pick(100));
+        }
+        paths.push_back(path);
+        leaves.push_back(path);
+        count++;
+    }
+    void set(const string &path, unsigned level, unsigned depth, unsigned budget) {
+        unsigned children = budget < options.fanout ? budget: options.fanout;
+        unsigned relations = 0;
+
+        fputs("(\n", file);
+        count++;
+        for (unsigned i = 0; i < children; i++) {
+            unsigned share = (budget - children) / children + ((budget - children) % children > i);
+            auto label = "n" + to_string(i);
+            auto child = path + "." + label;
+
+            indent(level + 1);
+            fprintf(file, "%s: ", label.c_str());
+            if (share && depth < options.depth)
+                set(child, level + 1, depth + 1, share);
+            else
+                leaf(child);
+            if (i + 1 < children)
+                fputs(",\n", file);
+        }
+        // fractional densities are rounded randomly
+        double r = options.relation_density;
+        while (r >= 1) {
+            relations++;
+            r -= 1;
+        }
+        if (uniform() < r)
+            relations++;
+        for (unsigned i = 0; i < relations && !paths.empty(); i++) {
+            fputs(",\n", file);
+            indent(level + 1);
+            fprintf(file, "r%u: [types.t%u, %s, %s]", i, pick(options.types), pickPath().c_str(), pickPath().c_str());
+            count++;
+        }
+        fputs("\n", file);
+        indent(level);
+        fputs(")", file);
+        paths.push_back(path);
+    }
+    void types(unsigned level) {
+        indent(level);
+        fputs("types: (\n", file);
+        count++;
+        for (unsigned t = 0; t < options.types; t++) {
+            indent(level + 1);
+            fprintf(file, "t%u: <0, 99>%s\n", t, t + 1 < options.types ? ",": "");
+            count++;
+        }
+        indent(level);
+        fputs(")", file);
+    }
+    // "send prog arg" clones the launcher and g0, executes a match and returns g0's clone
+    void program(unsigned level) {
+        static const char *lines[] = {
+            "pt: <0, 99>",
+            "px: pt[5]",
+            "py: $",
+            "pattern: ( [relation.next, px, py, pt] )",
+            "unknowns: ( py )",
+            "negatives: ()",
+            "prog: ! (args: (x: $, return: $), body: ( ? (pattern, unknowns, negatives), > (args.return, args.x) ))",
+            "arg: (x: g0)",
+            "relation: (next: _, prev: _, me: _, type: _, first: _, last: _, proxy: _, label: _)"
+        };
+
+        for (auto line: lines) {
+            fputs(",\n", file);
+            indent(level);
+            fputs(line, file);
+        }
+        count += 24;
+    }
+    // one top level group, its budget doesn't include the types
+    void writeGroup(unsigned level, unsigned budget) {
+        unsigned children = budget < options.fanout ? budget: options.fanout;
+
+        paths.clear();
+        leaves.clear();
+        fputs("(\n", file);
+        count++;
+        types(level + 1);
+        for (unsigned i = 0; i < children; i++) {
+            unsigned share = (budget - children) / children + ((budget - children) % children > i);
+            auto label = "n" + to_string(i);
+
+            fputs(",\n", file);
+            indent(level + 1);
+            fprintf(file, "%s: ", label.c_str());
+            if (share && options.depth)
+                set(group + "." + label, level + 1, 1, share);
+            else
+                leaf(group + "." + label);
+        }
+        fputs("\n", file);
+        indent(level);
+        fputs(")", file);
+    }
+};
+
+static FILE * createFile(const string &filepath)
+{
+    auto f = fopen(filepath.c_str(), "w");
+    assertf(f, "Couldn't create %s!", filepath.c_str());
+    return f;
+}
+
+unsigned generateBase(const HdbGeneratorOptions &options, const string &filepath)
+{
+    HdbGenerator g(options);
+    unsigned files = options.files ? options.files: 1;
+    unsigned budget = options.objects / files;
+
+    assert(options.fanout > 0 && options.types > 0);
+    assertf(!options.program || options.files <= 1, "The program needs a single file base!");
+    if (files == 1) {
+        g.file = createFile(filepath);
+        fputs("(\n", g.file);
+        g.count++;
+        g.indent(1);
+        g.group = "g0";
+        fputs("g0: ", g.file);
+        g.writeGroup(1, budget);
+        if (options.program)
+            g.program(1);
+        fputs("\n)\n", g.file);
+        fclose(g.file);
+    } else {
+        mkdir(filepath.c_str(), 0755);
+        for (unsigned i = 0; i < files; i++) {
+            g.group = "g" + to_string(i);
+            g.file = createFile(filepath + "/" + g.group + ".hdb");
+            fprintf(g.file, "%s: ", g.group.c_str());
+            g.writeGroup(0, budget);
+            fputs("\n", g.file);
+            fclose(g.file);
+        }
+    }
+    return g.count;
+}
@@ -0,0 +1,30 @@
+#ifndef HDB_GENERATOR_H
+#define HDB_GENERATOR_H
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+// Parameters of a synthetic base. The objects are spread over top level
+// groups, one group per file. Every group has its own enum types which the
+// elements refer to, cross references and relations stay inside the group
+// so the files can be loaded in any order.
+struct HdbGeneratorOptions {
+    unsigned objects;           // approximate number of objects
+    unsigned fanout;            // items per set
+    unsigned depth;             // maximum set nesting below a group
+    unsigned types;             // enum types per group
+    double relation_density;    // relations per set
+    double xref_ratio;          // share of leaves that are proxies to other objects
+    unsigned files;             // 1 for a single file base, otherwise a directory
+    unsigned seed;
+    bool program;               // a launcher "prog" matching a pattern and returning its argument "arg", g0
+
+    HdbGeneratorOptions();
+};
+
+// Writes the base to filepath (a file or a directory), returns the number of objects
+unsigned generateBase(const HdbGeneratorOptions &options, const string &filepath);
+
+#endif
@@ -0,0 +1,175 @@
+#include <string.h>
+#include <map>
+#include <vector>
+#include <unordered_set>
+
+#include "hdb_memory.h"
+#include "harmonydb.h"
+
+HdbMemory hdb_memory;
+
+HdbMemAccount::HdbMemAccount(const string &name, HarmonyObject *ctx, HarmonyDB *db) : name(name), ctx(ctx), db(db)
+{
+    memset(objects, 0, sizeof(objects));
+    memset(object_bytes, 0, sizeof(object_bytes));
+    items = 0;
+    item_bytes = 0;
+    relations = 0;
+    relation_bytes = 0;
+    string_bytes = 0;
+    hint_bytes = 0;
+    quota = 0;
+}
+
+int64_t HdbMemAccount::bytes() const
+{
+    int64_t sum = item_bytes + relation_bytes + string_bytes + hint_bytes;
+
+    for (unsigned t = 0; t < HDB_TYPES; t++)
+        sum += object_bytes[t];
+    return sum;
+}
+
+bool HdbMemAccount::held() const
+{
+    return ctx || (db && db->account == this);
+}
+
+HdbMemory::HdbMemory() : policy(ABORT), base("base"), current(&base), collected(0), quota(0)
+{
+}
+
+HdbMemory::~HdbMemory()
+{
+    for (auto a: accounts)
+        delete a;
+}
+
+// collects once the accounts doubled, the contexts are rarely removed
+HdbMemAccount * HdbMemory::open(const string &name, HarmonyDB *db)
+{
+    if (accounts.size() >= 2 * collected)
+        collect();
+    auto account = new HdbMemAccount(name, NULL, db);
+    account->quota = quota;
+    accounts.push_back(account);
+    return account;
+}
+
+void HdbMemory::collect()
+{
+    for (auto it = accounts.begin(); it != accounts.end(); ) {
+        auto a = *it;
+        int64_t objects = 0;
+
+        for (unsigned t = 0; t < HDB_TYPES; t++)
+            objects += a->objects[t];
+        if (!a->held() && !objects && !a->items && !a->relations && a != current) {
+            delete a;
+            it = accounts.erase(it);
+        } else
+            it++;
+    }
+    collected = accounts.size();
+}
+
+// the objects left, e.g. leaked out of the graph, stay on accounts of no base
+void HdbMemory::release(HarmonyDB *db)
+{
+    if (base.db == db)
+        base.db = NULL;
+    for (auto a: accounts)
+        if (a->db == db)
+            a->db = NULL;
+}
+
+void HdbMemory::live(HarmonyDB *db, int64_t objects[HDB_TYPES])
+{
+    memset(objects, 0, HDB_TYPES * sizeof(int64_t));
+    if (base.db == db)
+        for (unsigned t = 0; t < HDB_TYPES; t++)
+            objects[t] += base.objects[t];
+    for (auto a: accounts)
+        if (a->db == db)
+            for (unsigned t = 0; t < HDB_TYPES; t++)
+                objects[t] += a->objects[t];
+}
+
+// The labels and hints are set directly, so they are counted by walking the
+// base instead of when they change. Lazy stubs are not loaded for it.
+void HdbMemory::countStrings(HarmonyObject *root)
+{
+    unordered_set<HarmonyObject *> visited;
+    vector<HarmonyObject *> stack;
+    // a map node holds the colour and three pointers besides the pair
+    const int64_t node_bytes = 4 * sizeof(void *) + 2 * sizeof(string);
+
+    base.string_bytes = 0;
+    base.hint_bytes = 0;
+    for (auto a: accounts) {
+        a->string_bytes = 0;
+        a->hint_bytes = 0;
+    }
+    if (!root)
+        return;
+    stack.push_back(root);
+    visited.insert(root);
+    while (!stack.empty()) {
+        auto o = stack.back();
+        stack.pop_back();
+        for (auto &h: o->hints)
+            o->account->hint_bytes += node_bytes + stringBytes(h.first) + stringBytes(h.second);
+
+        auto visit = [&](HarmonyObject *next) {
+            if (next && visited.insert(next).second)
+                stack.push_back(next);
+        };
+        for (auto i = o->items.next; i != &o->items; i = i->next) {
+            o->account->string_bytes += stringBytes(i->label);
+            visit(i->object);
+        }
+        for (auto r = o->relations.next; r != &o->relations; r = r->next) {
+            o->account->string_bytes += stringBytes(r->label) + stringBytes(static_cast<HarmonyRelation *>(r->object)->label);
+            visit(r->object);
+        }
+        if (o->isProxy())
+            visit(o->proxy.object);
+    }
+}
+
+void HdbMemory::print(FILE *f)
+{
+    vector<HdbMemAccount *> all;
+    int64_t objects[HDB_TYPES] = {}, bytes[HDB_TYPES] = {};
+
+    collect();
+    all.push_back(&base);
+    all.insert(all.end(), accounts.begin(), accounts.end());
+    fprintf(f, "%10s %10s %10s %10s %10s %12s %10s  %s\n", "objects", "items", "relations", "strings", "hints", "bytes", "quota", "account");
+    for (auto a: all) {
+        int64_t n = 0;
+
+        for (unsigned t = 0; t < HDB_TYPES; t++) {
+            n += a->objects[t];
+            objects[t] += a->objects[t];
+            bytes[t] += a->object_bytes[t];
+        }
+        fprintf(f, "%10ld %10ld %10ld %10ld %10ld %12ld %10ld  %s%s\n", n, a->items, a->relations, a->string_bytes, a->hint_bytes,
+            a->bytes(), a->quota, a->name.c_str(), a->held() || a == &base ? "": " (removed)");
+    }
+    fprintf(f, "\n%10s %12s  %s\n", "objects", "bytes", "type");
+    for (unsigned t = 0; t < HDB_TYPES; t++)
+        if (objects[t])
+            fprintf(f, "%10ld %12ld  %s\n", objects[t], bytes[t], hdb_type_names[t]);
+}
+
+HdbMemScope::HdbMemScope(HdbMemAccount *account)
+{
+    saved = hdb_memory.current;
+    hdb_memory.current = account;
+}
+
+HdbMemScope::~HdbMemScope()
+{
+    hdb_memory.current = saved;
+}
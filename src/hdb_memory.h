@@ -0,0 +1,80 @@
+#ifndef HDB_MEMORY_H
+#define HDB_MEMORY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <list>
+#include "hdb_types.h"
+
+using namespace std;
+
+
+struct HarmonyObject;
+struct HarmonyDB;
+
+// Memory charged to a context, or to the base for everything else. The
+// objects remember their account so that they are credited back to it
+// wherever they are freed, and the account its base, so that the objects
+// of the bases loaded side by side (diff, a simulation) are told apart.
+struct HdbMemAccount
+{
+    string name;
+    HarmonyObject *ctx;                 // NULL for the base and once the context is freed
+    HarmonyDB *db;                      // NULL for none and once the base is deleted
+    int64_t objects[HDB_TYPES], object_bytes[HDB_TYPES];
+    int64_t items, item_bytes;
+    int64_t relations, relation_bytes;
+    int64_t string_bytes;               // labels outside of the small string buffer, and
+    int64_t hint_bytes;                 // hints, both counted by HdbMemory::countStrings()
+    int64_t quota;                      // bytes, 0 for none
+
+    HdbMemAccount(const string &name, HarmonyObject *ctx = NULL, HarmonyDB *db = NULL);
+
+    int64_t bytes() const;
+    bool held() const;                  // by a context or by its base, not collected
+    bool overQuota() const {
+        return quota && bytes() > quota;
+    }
+};
+
+struct HdbMemory
+{
+    enum Policy {
+        ABORT,      // remove the context
+        PARK        // keep it aside until resumed
+    } policy;
+
+    HdbMemAccount base;                 // of the first base alive, and of the objects of none
+    HdbMemAccount *current;             // charged for the new objects
+    list<HdbMemAccount *> accounts;     // of the contexts
+    size_t collected;                   // accounts left by the last collect()
+    int64_t quota;                      // for the new contexts
+
+    HdbMemory();
+    ~HdbMemory();
+
+    HdbMemAccount * open(const string &name, HarmonyDB *db);
+    void collect();                         // drops the empty accounts of removed contexts
+    void release(HarmonyDB *db);            // the base is deleted
+    void live(HarmonyDB *db, int64_t objects[HDB_TYPES]);  // the objects of the base alive, by type
+
+    static int64_t stringBytes(const string &s) {
+        return s.capacity() > 15 ? s.capacity() + 1: 0;
+    }
+    void countStrings(HarmonyObject *root);
+    void print(FILE *f);
+};
+
+// charges the objects created in a scope to an account
+struct HdbMemScope
+{
+    HdbMemAccount *saved;
+
+    HdbMemScope(HdbMemAccount *account);
+    ~HdbMemScope();
+};
+
+extern HdbMemory hdb_memory;
+
+#endif
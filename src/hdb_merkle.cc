@@ -0,0 +1,153 @@
+#include <map>
+
+#include "hdb_merkle.h"
+
+// along the primary items, empty unless they lead to the root
+string HdbMerkle::path(HarmonyObject *object)
+{
+    auto top = object;
+
+    for (auto item = object->primaryItem(); item && item->parent; item = item->parent->primaryItem())
+        top = item->parent;
+    return top == root ? object->getPrimaryPath(): string();
+}
+
+// Held structurally, the anonymous objects count by their hash. The ends of
+// relations and patterns aren't, a mutation of them doesn't get to the
+// owner: only their type counts.
+void HdbMerkle::reference(HdbHasher &h, HarmonyObject *object, bool held)
+{
+    if (!object) {
+        h.u8('N');
+        return;
+    }
+    if (object->isElement()) {
+        h.u8('E');
+        h.str(object->element_type.object ? path(object->element_type.object): string());
+        h.u64(object->element_value);
+        return;
+    }
+    auto p = path(object);
+    if (!p.empty()) {
+        h.u8('P');
+        h.str(p);
+    } else if (held) {
+        h.u8('H');
+        h.u64(hash(object));
+    } else {
+        h.u8('A');
+        h.u8(object->type);
+    }
+}
+
+// An object met again while it is hashed, in a cycle of anonymous objects,
+// counts as 0 there.
+uint64_t HdbMerkle::hash(HarmonyObject *object, Mode mode)
+{
+    HdbHasher h;
+
+    if (mode == FULL && object->merkle_state == HarmonyObject::MERKLE_VALID)
+        return object->merkle;
+    if (object->merkle_state == HarmonyObject::MERKLE_COMPUTING)
+        return 0;
+    object->ensureLoaded();
+    auto state = object->merkle_state;
+    object->merkle_state = HarmonyObject::MERKLE_COMPUTING;
+
+    h.u8(object->type);
+    switch (object->type) {
+    case HarmonyObject::ELEMENT:
+        reference(h, object, false);
+        break;
+    case HarmonyObject::TYPE:
+        h.u64(object->type_lower);
+        h.u64(object->type_higher);
+        break;
+    case HarmonyObject::PROXY:
+        reference(h, object->proxy.object, true);
+        break;
+    case HarmonyObject::PATTERN:
+        reference(h, object->relation.object, false);
+        reference(h, object->source.object, false);
+        reference(h, object->destination.object, false);
+        reference(h, object->pattern_owner.object, false);
+        break;
+    default:
+        break;
+    }
+    for (auto i = object->items.next; i != &object->items; i = i->next) {
+        if (i->primary) {
+            if (mode == OWN)
+                continue;
+            h.u8('I');
+            h.str(i->label);
+            if (mode == FULL)
+                h.u64(hash(i->object));
+            else
+                h.u8(i->object->type);
+        } else {
+            h.u8('i');
+            h.str(i->label);
+            reference(h, i->object, true);
+        }
+    }
+    for (auto r = object->relations.next; r != &object->relations; r = r->next) {
+        h.u8('R');
+        h.str(r->label);
+        reference(h, r->object->relation.object, false);
+        reference(h, r->object->source.object, false);
+        reference(h, r->object->destination.object, false);
+    }
+
+    object->merkle_state = state;
+    if (mode == FULL) {
+        object->merkle = h.value;
+        object->merkle_state = HarmonyObject::MERKLE_VALID;
+    }
+    return h.value;
+}
+
+// Reports how the object a here and b of the other base differ, descending
+// only into the primary items whose hashes differ: "~ path" for an object
+// differing itself, "- path" for an item only here, "+ path" for one only
+// in b. The items match by their labels, the unlabelled ones by position.
+unsigned HdbMerkle::diff(HarmonyObject *a, HdbMerkle &other, HarmonyObject *b, const string &path, FILE *f)
+{
+    map<string, HarmonyObject *> items;
+    unsigned n = 0;
+    auto join = [&](const string &label) {
+        return path == "." ? "." + label: path + "." + label;
+    };
+
+    compared++;
+    if (hash(a) == other.hash(b))
+        return 0;
+    if (hash(a, OWN) != other.hash(b, OWN)) {
+        fprintf(f, "~ %s\n", path.c_str());
+        n++;
+    }
+    for (auto i = b->items.next; i != &b->items; i = i->next)
+        if (i->primary)
+            items[i->indexLabel()] = i->object;
+    for (auto i = a->items.next; i != &a->items; i = i->next) {
+        if (!i->primary)
+            continue;
+        auto label = i->indexLabel();
+        auto it = items.find(label);
+
+        if (it == items.end()) {
+            fprintf(f, "- %s\n", join(label).c_str());
+            n++;
+            continue;
+        }
+        n += diff(i->object, other, it->second, join(label), f);
+        items.erase(it);
+    }
+    for (auto i = b->items.next; i != &b->items; i = i->next) {
+        if (i->primary && items.count(i->indexLabel())) {
+            fprintf(f, "+ %s\n", join(i->indexLabel()).c_str());
+            n++;
+        }
+    }
+    return n;
+}
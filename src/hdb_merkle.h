@@ -0,0 +1,70 @@
+#ifndef HDB_MERKLE_H
+#define HDB_MERKLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include "harmonydb.h"
+
+using namespace std;
+
+// FNV-1a of the fields fed to it
+struct HdbHasher
+{
+    uint64_t value;
+
+    HdbHasher(): value(14695981039346656037ull) {}
+    void bytes(const void *p, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            value ^= ((const uint8_t *)p)[i];
+            value *= 1099511628211ull;
+        }
+    }
+    void u8(uint8_t v) {
+        bytes(&v, 1);
+    }
+    void u64(uint64_t v) {
+        bytes(&v, sizeof(v));
+    }
+    void str(const string &s) {
+        u64(s.size());
+        bytes(s.data(), s.size());
+    }
+};
+
+// Structural hashes of the objects of a base, equal for equal subtrees of
+// two bases or nodes. An object's covers its type, its element value or
+// range and its items in order: the labels and the hashes of the objects
+// of the primary ones. The objects it holds otherwise, by the other items
+// or as a proxy, count by their primary path from the root if they have
+// one and by their own hash if not, the elements by type and value. The
+// relations count by their label and the paths of their relation, source
+// and destination. The hints and the state of the execution don't count.
+//
+// The hashes are cached in the objects and a mutation invalidates them up
+// through everything holding the object (HarmonyObject::invalidateMerkle()),
+// so a hash is recomputed only along the paths mutated since the last one.
+// Moving an object doesn't invalidate what refers to it by path. The lazy
+// stubs are loaded to be hashed.
+struct HdbMerkle
+{
+    enum Mode {
+        FULL,       // cached
+        SHAPE,      // the objects of the primary items only by their type
+        OWN         // without the primary items
+    };
+
+    HarmonyObject *root;
+    unsigned compared;          // objects diff() looked at
+
+    HdbMerkle(HarmonyObject *root): root(root), compared(0) {}
+
+    uint64_t hash(HarmonyObject *object, Mode mode = FULL);
+    unsigned diff(HarmonyObject *a, HdbMerkle &other, HarmonyObject *b, const string &path, FILE *f);
+
+private:
+    string path(HarmonyObject *object);
+    void reference(HdbHasher &h, HarmonyObject *object, bool held);
+};
+
+#endif
@@ -0,0 +1,202 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <assert.h>
+#include <charconv>
+
+#include "hdb_mmap_scanner.h"
+#include "common.h"
+
+hdb_mmap_scanner::hdb_mmap_scanner()
+    : data(NULL), end(NULL), p(NULL), size(0)
+{
+}
+
+hdb_mmap_scanner::~hdb_mmap_scanner()
+{
+    unmap();
+}
+
+void hdb_mmap_scanner::map(int fd)
+{
+    struct stat sb;
+
+    unmap();
+    assertf(fstat(fd, &sb) == 0, "Couldn't stat the file!");
+    size = sb.st_size;
+    if (size) { // empty files can't be mapped
+        auto m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        assertf(m != MAP_FAILED, "Couldn't map the file!");
+        madvise(m, size, MADV_SEQUENTIAL);
+        data = (const char *)m;
+    }
+    p = data;
+    end = data + size;
+}
+
+void hdb_mmap_scanner::unmap()
+{
+    if (data)
+        munmap((void *)data, size);
+    data = end = p = NULL;
+    size = 0;
+}
+
+static inline bool isSymbolStart(char c)
+{
+    return isalpha((unsigned char)c) || c == '_';
+}
+
+static inline bool isSymbol(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+HdbToken hdb_mmap_scanner::next(yy::location &loc)
+{
+    using kind = yy::parser::symbol_kind;
+    HdbToken t;
+
+    for (;;) {
+        loc.step();
+        if (p == end) {
+            t.kind = kind::S_YYEOF;
+            return t;
+        }
+
+        const char *s = p;
+        char c = *p;
+
+        if (c == '/' && p + 1 < end && p[1] == '/') { // comment
+            while (p < end && *p != '\n')
+                p++;
+            loc.columns(p - s);
+            continue;
+        }
+        if (c == ' ' || c == '\t') {
+            while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+            loc.columns(p - s);
+            continue;
+        }
+        if (c == '\n') {
+            while (p < end && *p == '\n')
+                p++;
+            loc.columns(p - s);
+            loc.lines(p - s);
+            continue;
+        }
+        if (isdigit((unsigned char)c) || (c == '-' && p + 1 < end && isdigit((unsigned char)p[1]))) {
+            auto q = p + 1;
+
+            while (q < end && isdigit((unsigned char)*q))
+                q++;
+            if (q + 1 < end && *q == '.' && isdigit((unsigned char)q[1])) {
+                float f; // same precision as stof()
+
+                q++;
+                while (q < end && isdigit((unsigned char)*q))
+                    q++;
+                auto r = from_chars(p, q, f);
+                assertf(r.ec == errc(), "%s:%d: number out of range: %.*s", loc.begin.filename ? loc.begin.filename->c_str(): "",
+                    loc.begin.line, (int)(q - p), p);
+                t.kind = kind::S_FLOAT;
+                t.number = f;
+            } else {
+                auto r = from_chars(p, q, t.integer);
+                assertf(r.ec == errc(), "%s:%d: number out of range: %.*s", loc.begin.filename ? loc.begin.filename->c_str(): "",
+                    loc.begin.line, (int)(q - p), p);
+                t.kind = kind::S_INT;
+            }
+            t.text = string_view(p, q - p);
+            p = q;
+            loc.columns(p - s);
+            return t;
+        }
+        if (c == '.' && p + 1 < end && isSymbolStart(p[1])) {
+            auto q = p + 2;
+
+            while (q < end && isSymbol(*q))
+                q++;
+            t.kind = kind::S_DOTSYMBOL;
+            t.text = string_view(p + 1, q - p - 1);
+            p = q;
+            loc.columns(p - s);
+            return t;
+        }
+        if (isSymbolStart(c) && !(c == '_' && (p + 1 == end || !isSymbol(p[1])))) {
+            auto q = p + 1;
+
+            while (q < end && isSymbol(*q))
+                q++;
+            t.kind = kind::S_SYMBOL;
+            t.text = string_view(p, q - p);
+            p = q;
+            loc.columns(p - s);
+            return t;
+        }
+        if (c == '"') {
+            auto q = p + 1;
+
+            while (q < end && *q != '"')
+                q++;
+            assertf(q < end, "%s: unterminated text", loc.begin.filename ? loc.begin.filename->c_str(): "");
+            t.kind = kind::S_TEXT;
+            t.text = string_view(p + 1, q - p - 1);
+            p = q + 1;
+            loc.columns(p - s);
+            return t;
+        }
+
+        p++;
+        loc.columns(1);
+        switch (c) {
+            case '[': t.kind = kind::S_LEFT_SQUARE; break;
+            case ']': t.kind = kind::S_RIGHT_SQUARE; break;
+            case '<': t.kind = kind::S_LEFT_TRIANGLE; break;
+            case '>': t.kind = kind::S_RIGHT_TRIANGLE; break;
+            case '.': t.kind = kind::S_DOT; break;
+            case ',': t.kind = kind::S_COMMA; break;
+            case ':': t.kind = kind::S_COLON; break;
+            case '~': t.kind = kind::S_TILDE; break;
+            case '!': t.kind = kind::S_EXCLAMATION; break;
+            case '@': t.kind = kind::S_AT; break;
+            case '#': t.kind = kind::S_HASH; break;
+            case '$': t.kind = kind::S_DOLLAR; break;
+            case '%': t.kind = kind::S_PERCENT; break;
+            case '^': t.kind = kind::S_APOSTROPHE; break;
+            case '&': t.kind = kind::S_AMPERSAND; break;
+            case '*': t.kind = kind::S_ASTERISK; break;
+            case '(': t.kind = kind::S_LEFT_ROUND; break;
+            case ')': t.kind = kind::S_RIGHT_ROUND; break;
+            case '?': t.kind = kind::S_QUESTION; break;
+            case '_': t.kind = kind::S_UNDERSCORE; break;
+            case '=': t.kind = kind::S_EQUAL; break;
+            case '+': t.kind = kind::S_PLUS; break;
+            case '-': t.kind = kind::S_MINUS; break;
+            default: // flex echoes what it doesn't match
+                putchar(c);
+                continue;
+        }
+        t.text = string_view(s, 1);
+        return t;
+    }
+}
+
+yy::parser::symbol_type hdb_mmap_scanner::lex(yy::location &loc)
+{
+    auto t = next(loc);
+
+    switch (t.kind) {
+        case yy::parser::symbol_kind::S_INT:
+            return yy::parser::symbol_type(t.kind, t.integer, loc);
+        case yy::parser::symbol_kind::S_FLOAT:
+            return yy::parser::symbol_type(t.kind, t.number, loc);
+        case yy::parser::symbol_kind::S_TEXT:
+        case yy::parser::symbol_kind::S_SYMBOL:
+        case yy::parser::symbol_kind::S_DOTSYMBOL:
+            return yy::parser::symbol_type(t.kind, string(t.text), loc);
+        default:
+            return yy::parser::symbol_type(t.kind, loc);
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef HDB_MMAP_SCANNER_H
+#define HDB_MMAP_SCANNER_H
+
+#include <stdint.h>
+#include <string_view>
+#include "hdb_parser.h"
+
+using namespace std;
+
+// Token as found in the mapped file, the text points into the mapping.
+// The kinds are the same in both grammars.
+struct HdbToken {
+    yy::parser::symbol_kind_type kind;
+    string_view text;
+    int64_t integer;
+    double number;
+};
+
+// Scanner working on a memory mapped file, all of its state is in the object.
+// It accepts the same language as hdb.ll.
+class hdb_mmap_scanner
+{
+public:
+    hdb_mmap_scanner();
+    ~hdb_mmap_scanner();
+
+    void map(int fd);
+    void unmap();
+    HdbToken next(yy::location &loc);
+    yy::parser::symbol_type lex(yy::location &loc);
+
+    const char *data, *end, *p;
+    size_t size;
+};
+
+#endif
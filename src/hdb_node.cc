@@ -0,0 +1,2029 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <vector>
+#include <set>
+#include <algorithm>
+
+#include "hdb_node.h"
+#include "hdb_reactor.h"
+#include "execution_engine.h"
+
+// bounds checked reading of a frame, ok drops to false past its end
+struct HdbNodeReader
+{
+    const char *p, *end;
+    bool ok;
+
+    bool has(size_t n) {
+        if (ok && (size_t)(end - p) < n)
+            ok = false;
+        return ok;
+    }
+    uint8_t u8() {
+        return has(1) ? *p++: 0;
+    }
+    template <typename T> T get() {
+        T v = 0;
+
+        if (has(sizeof(T))) {
+            memcpy(&v, p, sizeof(T));
+            p += sizeof(T);
+        }
+        return v;
+    }
+    string str() {
+        auto n = get<uint32_t>();
+
+        if (!has(n))
+            return string();
+        p += n;
+        return string(p - n, n);
+    }
+    // a count of strings, each at least its length, so a count past the
+    // end of the frame is caught before anything is allocated for it
+    bool strings(vector<string> &v) {
+        auto n = get<uint32_t>();
+
+        if (!has((size_t)n * sizeof(uint32_t)))
+            return false;
+        for (uint32_t i = 0; i < n && ok; i++)
+            v.push_back(str());
+        return ok;
+    }
+};
+
+template <typename T> static void put(string &out, T v)
+{
+    out.append((const char *)&v, sizeof(T));
+}
+
+static void putString(string &out, const string &s)
+{
+    put<uint32_t>(out, s.size());
+    out += s;
+}
+
+static size_t beginFrame(string &out, HdbNode::Kind kind)
+{
+    auto start = out.size();
+
+    put<uint32_t>(out, 0);
+    put<uint8_t>(out, kind);
+    return start;
+}
+
+static void endFrame(string &out, size_t start)
+{
+    uint32_t length = out.size() - start - sizeof(uint32_t);
+
+    memcpy(&out[start], &length, sizeof(length));
+}
+
+static void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// "unix:<path>" or "tcp:<host>:<port>", bound and listening or connected
+static int openSocket(const string &address, bool listening)
+{
+    int fd = -1;
+
+    if (address.compare(0, 5, "unix:") == 0) {
+        struct sockaddr_un sa;
+        auto path = address.substr(5);
+
+        if (path.size() >= sizeof(sa.sun_path))
+            return -1;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strcpy(sa.sun_path, path.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        if (listening)
+            unlink(path.c_str());
+        if (listening ? bind(fd, (struct sockaddr *)&sa, sizeof(sa)) || ::listen(fd, 64):
+                connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+            close(fd);
+            return -1;
+        }
+    } else if (address.compare(0, 4, "tcp:") == 0) {
+        struct addrinfo hints, *ai;
+        auto colon = address.rfind(':');
+        auto host = address.substr(4, colon - 4), port = address.substr(colon + 1);
+        int one = 1;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE: 0;
+        if (colon < 4 || getaddrinfo(host.empty() ? NULL: host.c_str(), port.c_str(), &hints, &ai))
+            return -1;
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) || ::listen(fd, 64):
+                    connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(ai);
+        if (fd < 0)
+            return -1;
+    } else {
+        return -1;
+    }
+    setNonBlocking(fd);
+    return fd;
+}
+
+HdbNode::HdbNode(const string &id, HarmonyDB *db, ExecutionEngine *engine)
+    : id(id), db(db), engine(engine), listen_fd(-1), next_reply(1), lease(HDB_NODE_LEASE), next_lease(0), leasing(false), renewed(0),
+      connect_timeout(5000), balance_interval(0), next_balance(0), next_migration(0), network(NULL)
+{
+    auto contexts = db->getRoot()->findItem("context");
+    auto node_item = contexts ? contexts->object->findItem("node"): NULL;
+    HdbMemScope scope(db->account);
+
+    node_context = node_item ? node_item->object: db->createContext(NULL, "node");
+    auto remotes_item = node_context->findItem("remote");
+    if (remotes_item) {
+        remotes = remotes_item->object;
+    } else {
+        remotes = new HarmonyObject;
+        node_context->add(remotes, "remote", true);
+    }
+    frames_sent = hdb_stats.counter("divee_node_frames_sent_total", "Frames sent to the other nodes");
+    frames_received = hdb_stats.counter("divee_node_frames_received_total", "Frames received from the other nodes");
+    bytes_sent = hdb_stats.counter("divee_node_bytes_sent_total", "Bytes sent to the other nodes");
+    bytes_received = hdb_stats.counter("divee_node_bytes_received_total", "Bytes received from the other nodes");
+    writes = hdb_stats.counter("divee_node_writes_total", "Socket writes, a batch of frames each");
+    contexts_sent = hdb_stats.counter("divee_node_contexts_migrated_out_total", "Contexts migrated to the other nodes");
+    contexts_received = hdb_stats.counter("divee_node_contexts_migrated_in_total", "Contexts migrated from the other nodes");
+    mutations_sent = hdb_stats.counter("divee_replica_mutations_sent_total", "Mutations of the replicated subtrees sent to the replicas");
+    mutations_applied = hdb_stats.counter("divee_replica_mutations_applied_total", "Mutations of the primaries applied to the replicas here");
+    sync_bytes = hdb_stats.counter("divee_replica_sync_bytes_total", "Bytes of the SYNC frames sent to the replicas");
+    exports_held = hdb_stats.counter("divee_node_exports", "Objects of this node held by id by other nodes", HdbCounter::GAUGE);
+    imports_held = hdb_stats.counter("divee_node_imports", "Proxies of the objects of other nodes held here by id", HdbCounter::GAUGE);
+    exports_reclaimed = hdb_stats.counter("divee_node_exports_reclaimed_total", "Exported objects no node held any more, released");
+    reclamation_lags = hdb_stats.histogram("divee_node_reclamation_lag_seconds",
+        "From the last holder of an exported object dropping it to reclaiming it", string());
+}
+
+HdbNode::~HdbNode()
+{
+    if (HarmonyObject::_observer == this)
+        HarmonyObject::_observer = NULL;
+    flush();
+    while (!peers.empty())
+        close(peers.front());
+    if (listen_fd >= 0) {
+        ::close(listen_fd);
+        if (listen_address.compare(0, 5, "unix:") == 0)
+            unlink(listen_address.c_str() + 5);
+    }
+    exports.clear();
+}
+
+bool HdbNode::listen(const string &address)
+{
+    listen_fd = openSocket(address, true);
+    if (listen_fd < 0) {
+        PF("Couldn't listen on %s: %s", address.c_str(), strerror(errno));
+        return false;
+    }
+    listen_address = address;
+    return true;
+}
+
+void HdbNode::addPeer(const string &id, const string &address)
+{
+    addresses[id] = address;
+}
+
+HdbNodePeer * HdbNode::peer(const string &id, bool waiting)
+{
+    for (auto p: peers)
+        if (p->id == id)
+            return p;
+    return connect(id, waiting);
+}
+
+// the peer may still be starting, waiting it gets connect_timeout ms to listen
+HdbNodePeer * HdbNode::connect(const string &id, bool waiting)
+{
+    auto a = addresses.find(id);
+    int fd = -1;
+
+    if (a == addresses.end())
+        return NULL;
+    for (unsigned waited = 0; !network; waited += 10) {
+        fd = openSocket(a->second, false);
+        if (fd >= 0 || !waiting || waited >= connect_timeout)
+            break;
+        usleep(10000);
+    }
+    if (fd < 0 && !waiting && !network)
+        return NULL;
+    if (fd < 0 && !network) {
+        PF("Couldn't connect to node %s at %s: %s", id.c_str(), a->second.c_str(), strerror(errno));
+        return NULL;
+    }
+    auto p = new HdbNodePeer {id, a->second, fd, string(), string()};
+    auto start = beginFrame(p->out, HELLO);
+    putString(p->out, this->id);
+    endFrame(p->out, start);
+    frames_sent->add();
+    peers.push_back(p);
+    return p;
+}
+
+// the objects held for the node only are reclaimed once its last
+// connection is gone
+void HdbNode::close(HdbNodePeer *peer)
+{
+    auto node = peer->id;
+
+    if (peer->fd >= 0)
+        ::close(peer->fd);
+    peers.remove(peer);
+    delete peer;
+    if (node.empty())
+        return;
+    for (auto p: peers)
+        if (p->id == node)
+            return;
+    for (auto e = exports.begin(); e != exports.end(); ) {
+        auto next = std::next(e);
+
+        if (e->second.holders.erase(node) && e->second.holders.empty())
+            reclaim(e, 0);
+        e = next;
+    }
+}
+
+// the receivers become reply ids, the launchers paths in this node
+void HdbNode::encode(string &out, HarmonyObject *object, unordered_set<HarmonyObject *> &visited)
+{
+    if (object && object->isProxy()) {
+        if (!object->proxy.object) {
+            out += 'P';
+            return;
+        }
+        object = object->getObject();
+    }
+    if (!object) {
+        out += 'N';
+        return;
+    }
+    object->ensureLoaded();
+    if (isRemote(object) || object->type == HarmonyObject::RECEIVE || object->parent_receiver || object->type == HarmonyObject::LAUNCH) {
+        encodeRemote(out, object);
+    } else if (object->isElement()) {
+        out += 'E';
+        putString(out, object->element_type.object->getPrimaryPath());
+        put<int64_t>(out, object->element_value);
+    } else if (object->isType()) {
+        out += 'T';
+        putString(out, object->getPrimaryPath());
+    } else if (object->isNul() && visited.insert(object).second) {
+        uint32_t n = 0;
+
+        for (auto i = object->first(); i; i = i->nextItem(object))
+            n++;
+        out += 'S';
+        put<uint32_t>(out, n);
+        for (auto i = object->first(); i; i = i->nextItem(object)) {
+            putString(out, i->label);
+            encode(out, i->object, visited);
+        }
+        visited.erase(object);
+    } else {
+        PF("%s %p can't be sent to another node, sending nothing", object->isNul() ? "Cycle through": "Code", object);
+        out += 'N';
+    }
+}
+
+// A proxy of the object for the other side: the receivers by reply ids,
+// what isn't found by path, being in no subtree of the root but a context,
+// by ids too.
+void HdbNode::encodeRemote(string &out, HarmonyObject *object)
+{
+    auto t = top(object);
+
+    out += 'X';
+    if (isRemote(object)) {
+        putString(out, object->getHint(HINT_NODE));
+        putString(out, object->getHint(HINT_REMOTE));
+        put<uint64_t>(out, strtoull(object->getHint(HINT_REPLY).c_str(), NULL, 10));
+    } else if (object->type == HarmonyObject::RECEIVE || object->parent_receiver || !t || t->label == "context") {
+        putString(out, id);
+        putString(out, string());
+        put<uint64_t>(out, exportObject(object, object->type == HarmonyObject::RECEIVE || object->parent_receiver));
+    } else {
+        putString(out, id);
+        putString(out, object->getPrimaryPath());
+        put<uint64_t>(out, 0);
+    }
+}
+
+// Migrated with the context: reached from it and not reached from the root
+// but through it. The anonymous objects, the arguments cloned into its
+// proxies and what the code created, go with it.
+bool HdbNode::owned(HarmonyObject *object, HarmonyObject *ctx)
+{
+    auto top = object;
+
+    for (auto item = object->primaryItem(); item && item->parent; item = item->parent->primaryItem()) {
+        if (item->parent == ctx)
+            return true;
+        top = item->parent;
+    }
+    return top != db->getRoot();
+}
+
+// the item of the root the object is under along the primary items
+HarmonyItem * HdbNode::top(HarmonyObject *object)
+{
+    HarmonyItem *top = NULL;
+
+    for (auto item = object->primaryItem(); item && item->parent; item = item->parent->primaryItem())
+        top = item;
+    return top && top->parent == db->getRoot() ? top: NULL;
+}
+
+// found by path on every node: the types, the intrinsic relations, and the
+// subtrees of a partitioned base that aren't placed on a node
+bool HdbNode::shared(HarmonyObject *object)
+{
+    if (object->isType())
+        return true;
+    auto t = top(object);
+    if (!t)
+        return false;
+    return t->label == "relation" || (!db->placement.empty() && !db->placement.count(t->label) && t->label != "context");
+}
+
+// where the object is: its primary item, else the proxy linking it, else
+// any set holding it
+static HarmonyItem * holder(HarmonyObject *object)
+{
+    auto item = object->primaryItem();
+    HarmonyItem *held = NULL;
+
+    for (auto r = object->reference.next; !item && r != &object->reference; r = r->next) {
+        auto i = static_cast<HarmonyItem *>(r);
+
+        if (!r->structural || !i->parent)
+            continue;
+        if (i == &i->parent->proxy)
+            item = i;
+        else if (!held)
+            held = i;
+    }
+    return item ? item: held;
+}
+
+// the object is the root or under it along the holders
+static bool within(HarmonyObject *object, HarmonyObject *root)
+{
+    for (unsigned depth = 0; object && depth < 4096; depth++) {
+        if (object == root)
+            return true;
+        auto item = holder(object);
+        object = item ? item->parent: NULL;
+    }
+    return false;
+}
+
+static void putSteps(string &out, const vector<string> &steps)
+{
+    put<uint32_t>(out, steps.size());
+    for (auto &s: steps)
+        putString(out, s);
+}
+
+// With the subtree, for its replicas: the objects in it by their steps and
+// the rest of the base by path, the replicas have it too.
+void HdbNode::encodeReference(string &out, HarmonyObject *object, unordered_map<HarmonyObject *, uint32_t> &index,
+    HarmonyItem *subtree)
+{
+    vector<string> steps;
+
+    if (!object) {
+        out += 'N';
+        return;
+    }
+    auto i = index.find(object);
+    if (i != index.end()) {
+        out += 'L';
+        put<uint32_t>(out, i->second);
+        return;
+    }
+    object->ensureLoaded();
+    if (subtree && locate(object, &steps) == subtree) {
+        out += 'R';
+        putSteps(out, steps);
+    } else if (object->isElement()) {
+        out += 'E';
+        putString(out, object->element_type.object->getPrimaryPath());
+        put<int64_t>(out, object->element_value);
+    } else if (!isRemote(object) && (shared(object) || (subtree && top(object)))) {
+        out += 'T';
+        putString(out, object->getPrimaryPath());
+    } else {
+        encodeRemote(out, object);
+    }
+}
+
+// The objects the root owns by index, what they refer to outside of it
+// becomes remote proxies back to this node. Migrating, the root is the
+// context. Replicating, it is the subtree, an object of it replaced or a
+// value put in it, and what the contexts hold goes along too: it isn't
+// found by path elsewhere.
+void HdbNode::encodeGraph(string &out, HarmonyObject *root, HarmonyItem *subtree)
+{
+    vector<HarmonyObject *> objects {root};
+    unordered_map<HarmonyObject *, uint32_t> index {{root, 0}};
+    auto reach = [&](HarmonyObject *object) {
+        if (!object || index.count(object))
+            return;
+        if (subtree) {
+            if (!within(object, root)) {
+                auto t = top(object);
+
+                if (t && t->label != "context")
+                    return;
+                if (locate(object, NULL) == subtree)
+                    return;
+            }
+        } else if (!owned(object, root)) {
+            return;
+        }
+        index[object] = objects.size();
+        objects.push_back(object);
+    };
+
+    for (size_t n = 0; n < objects.size(); n++) {
+        auto o = objects[n];
+
+        o->ensureLoaded();
+        for (auto i = o->items.next; i != &o->items; i = i->next)
+            reach(i->object);
+        for (auto r = o->relations.next; r != &o->relations; r = r->next) {
+            reach(r->object);
+            reach(r->object->relation.object);
+            reach(r->object->source.object);
+            reach(r->object->destination.object);
+        }
+        if (o->isProxy())
+            reach(o->proxy.object);
+        reach(o->element_type.object);
+        reach(o->relation.object);
+        reach(o->source.object);
+        reach(o->destination.object);
+        reach(o->pattern_owner.object);
+        reach(o->parent_receiver);
+    }
+
+    unordered_set<HarmonyObject *> relations;
+    for (auto o: objects)
+        for (auto r = o->relations.next; r != &o->relations; r = r->next)
+            relations.insert(r->object);
+
+    put<uint32_t>(out, objects.size());
+    for (auto o: objects)
+        put<uint8_t>(out, relations.count(o) ? 0xff: o->type);
+    for (auto o: objects) {
+        put<uint32_t>(out, o->hints.size());
+        for (auto &h: o->hints) {
+            putString(out, h.first);
+            putString(out, h.second);
+        }
+        put<uint8_t>(out, o->loop | o->unknown << 1 | o->negative << 2 | (o->context == root) << 3);
+        put<uint32_t>(out, o->receiver_armed);
+        put<uint32_t>(out, o->receiver_got);
+        encodeReference(out, index.count(o->parent_receiver) ? o->parent_receiver: NULL, index, subtree);
+        if (relations.count(o)) {
+            putString(out, static_cast<HarmonyRelation *>(o)->label);
+            encodeReference(out, o->relation.object, index, subtree);
+            encodeReference(out, o->source.object, index, subtree);
+            encodeReference(out, o->destination.object, index, subtree);
+        } else if (o->isElement()) {
+            encodeReference(out, o->element_type.object, index, subtree);
+            put<int64_t>(out, o->element_value);
+        } else if (o->isType()) {
+            put<int64_t>(out, o->type_lower);
+            put<int64_t>(out, o->type_higher);
+        } else if (o->isProxy()) {
+            encodeReference(out, o->proxy.object, index, subtree);
+        } else if (o->isPattern()) {
+            encodeReference(out, o->relation.object, index, subtree);
+            encodeReference(out, o->source.object, index, subtree);
+            encodeReference(out, o->destination.object, index, subtree);
+            encodeReference(out, o->pattern_owner.object, index, subtree);
+        }
+        uint32_t n = 0;
+        for (auto i = o->items.next; i != &o->items; i = i->next)
+            n++;
+        put<uint32_t>(out, n);
+        for (auto i = o->items.next; i != &o->items; i = i->next) {
+            putString(out, i->label);
+            put<uint8_t>(out, i->primary);
+            encodeReference(out, i->object, index, subtree);
+        }
+        n = 0;
+        for (auto r = o->relations.next; r != &o->relations; r = r->next)
+            n++;
+        put<uint32_t>(out, n);
+        for (auto r = o->relations.next; r != &o->relations; r = r->next) {
+            putString(out, r->label);
+            encodeReference(out, r->object, index, subtree);
+        }
+    }
+}
+
+// A value of a replicated mutation: what is in the subtree by its steps,
+// the rest of the base by path, new objects and those of the contexts as
+// a graph of copies.
+void HdbNode::encodeValue(string &out, HarmonyObject *object, HarmonyItem *subtree)
+{
+    unordered_map<HarmonyObject *, uint32_t> index;
+
+    if (object && !object->isElement() && !isRemote(object) && !object->isType() && locate(object, NULL) != subtree) {
+        auto t = top(object);
+
+        if (!t || t->label == "context") {
+            out += 'G';
+            encodeGraph(out, object, subtree);
+            return;
+        }
+    }
+    encodeReference(out, object, index, subtree);
+}
+
+// ".", ".a.b" or ".a.[2]"
+HarmonyObject * HdbNode::lookup(const string &path)
+{
+    HarmonyObjectPath p;
+
+    if (path == ".")
+        return db->getRoot();
+    p.parse(path);
+    return db->getObjectByPath(p);
+}
+
+HarmonyObject * HdbNode::resolve(const string &node, const string &path, uint64_t reply)
+{
+    if (node == id) {
+        if (!reply)
+            return lookup(path);
+        auto e = exports.find(reply);
+        return e != exports.end() ? e->second.object.object: NULL;
+    }
+    HarmonyObject *object;
+    if (reply) {
+        object = new HarmonyObject;
+        object->hints[HINT_NODE] = node;
+        object->hints[HINT_REPLY] = to_string(reply);
+        leasing = true;
+        renewed = ~0ull;
+    } else {
+        object = db->remoteObject(node, path);
+    }
+    remotes->add(object, string(), true);
+    return object;
+}
+
+HarmonyObject * HdbNode::decode(HdbNodeReader &in, HarmonyObject *parent, const string &label)
+{
+    HarmonyObject *object = NULL;
+    string path;
+
+    switch (in.u8()) {
+    case 'S': {
+        object = new HarmonyObject;
+        parent->add(object, label, true);
+        auto n = in.get<uint32_t>();
+        for (uint32_t i = 0; i < n && in.ok; i++) {
+            auto l = in.str();
+            decode(in, object, l);
+        }
+        break;
+    }
+    case 'E': {
+        path = in.str();
+        auto value = in.get<int64_t>();
+        auto type = lookup(path);
+        if (!type || !type->isType()) {
+            PF("No type %s in node %s", path.c_str(), id.c_str());
+            in.ok = false;
+            break;
+        }
+        object = new HarmonyObject(HarmonyObject::Type::ELEMENT);
+        object->element_type.setReference(type);
+        object->element_value = value;
+        parent->add(object, label, true);
+        break;
+    }
+    case 'T':
+        path = in.str();
+        object = lookup(path);
+        if (!object || !object->isType()) {
+            PF("No type %s in node %s", path.c_str(), id.c_str());
+            in.ok = false;
+            break;
+        }
+        parent->add(object, label);
+        break;
+    case 'P':
+        object = new HarmonyObject(HarmonyObject::Type::PROXY);
+        parent->add(object, label, true);
+        break;
+    case 'X': {
+        auto node = in.str();
+        path = in.str();
+        auto reply = in.get<uint64_t>();
+        if (!in.ok)
+            break;
+        object = resolve(node, path, reply);
+        if (!object) {
+            PF("Node %s has no %s reply %lu", id.c_str(), path.c_str(), reply);
+            in.ok = false;
+            break;
+        }
+        parent->add(object, label);
+        break;
+    }
+    case 'N':
+        object = new HarmonyObject;
+        parent->add(object, label, true);
+        break;
+    default:
+        in.ok = false;
+        break;
+    }
+    return object;
+}
+
+HarmonyObject * HdbNode::decodeReference(HdbNodeReader &in, vector<HarmonyObject *> &objects, HarmonyObject *subtree)
+{
+    string path;
+
+    switch (in.u8()) {
+    case 'R': {
+        vector<string> steps;
+        auto object = in.strings(steps) && subtree ? descend(subtree, steps): NULL;
+        if (object)
+            return object;
+        PF("No %s in the replica of node %s", steps.empty() ? ".": steps.back().c_str(), id.c_str());
+        break;
+    }
+    case 'L': {
+        auto i = in.get<uint32_t>();
+        if (in.ok && i < objects.size())
+            return objects[i];
+        break;
+    }
+    case 'N':
+        return NULL;
+    case 'E': {
+        path = in.str();
+        auto value = in.get<int64_t>();
+        auto type = in.ok ? lookup(path): NULL;
+        if (type && type->isType()) {
+            auto object = new HarmonyObject(HarmonyObject::Type::ELEMENT);
+            object->element_type.setReference(type);
+            object->element_value = value;
+            return object;
+        }
+        PF("No type %s in node %s", path.c_str(), id.c_str());
+        break;
+    }
+    case 'T': {
+        path = in.str();
+        auto object = in.ok ? lookup(path): NULL;
+        if (object)
+            return object;
+        PF("No %s in node %s", path.c_str(), id.c_str());
+        break;
+    }
+    case 'X': {
+        auto node = in.str();
+        path = in.str();
+        auto reply = in.get<uint64_t>();
+        auto object = in.ok ? resolve(node, path, reply): NULL;
+        if (object)
+            return object;
+        PF("Node %s has no %s reply %lu", id.c_str(), path.c_str(), reply);
+        break;
+    }
+    }
+    in.ok = false;
+    return NULL;
+}
+
+// The objects of encodeGraph(), empty, held by the message until they are
+// in place. The root, when given, stands for the first one.
+bool HdbNode::decodeObjects(HdbNodeReader &in, HarmonyObject *message, vector<HarmonyObject *> &objects,
+    unordered_set<HarmonyObject *> &relations, HarmonyObject *root)
+{
+    auto count = in.get<uint32_t>();
+
+    if (!in.ok || !count || !in.has(count))
+        return false;
+    for (uint32_t n = 0; n < count; n++) {
+        auto kind = in.u8();
+        auto type = (HarmonyObject::Type)(kind <= HarmonyObject::PATTERN ? kind: 0);
+        HarmonyObject *object;
+
+        if (root && !n) {
+            if (kind == 0xff)
+                return false;
+            object = root;
+            if (object->type != type)
+                object->setType(type);
+            objects.push_back(object);
+            continue;
+        }
+        object = kind == 0xff ? new HarmonyRelation: new HarmonyObject(type);
+        if (kind == 0xff)
+            relations.insert(object);
+        message->add(object);
+        objects.push_back(object);
+    }
+    return true;
+}
+
+// fills the objects of decodeObjects(), the root's context is its own
+bool HdbNode::decodeGraph(HdbNodeReader &in, vector<HarmonyObject *> &objects, unordered_set<HarmonyObject *> &relations,
+    HarmonyObject *subtree)
+{
+    auto root = objects[0];
+
+    for (auto o: objects) {
+        HarmonyObject *r[4] = {};
+
+        auto hints = in.get<uint32_t>();
+        for (uint32_t h = 0; h < hints && in.ok; h++) {
+            auto hint = in.str();
+            o->hints[hint] = in.str();
+        }
+        auto flags = in.u8();
+        o->loop = flags & 1;
+        o->unknown = flags & 2;
+        o->negative = flags & 4;
+        if (flags & 8)
+            o->context = root;
+        o->receiver_armed = in.get<uint32_t>();
+        o->receiver_got = in.get<uint32_t>();
+        o->parent_receiver = decodeReference(in, objects, subtree);
+        if (relations.count(o)) {
+            static_cast<HarmonyRelation *>(o)->label = in.str();
+            for (unsigned i = 0; i < 3; i++)
+                r[i] = decodeReference(in, objects, subtree);
+            if (r[0] && r[1] && r[2]) {
+                o->relation.setReference(r[0]);
+                o->source.setReference(r[1]);
+                o->destination.setReference(r[2]);
+            }
+        } else if (o->isElement()) {
+            r[0] = decodeReference(in, objects, subtree);
+            o->element_value = in.get<int64_t>();
+            if (r[0])
+                o->element_type.setReference(r[0]);
+        } else if (o->isType()) {
+            o->type_lower = in.get<int64_t>();
+            o->type_higher = in.get<int64_t>();
+        } else if (o->isProxy()) {
+            r[0] = decodeReference(in, objects, subtree);
+            if (r[0])
+                o->link(r[0]);
+        } else if (o->isPattern()) {
+            for (unsigned i = 0; i < 4; i++)
+                r[i] = decodeReference(in, objects, subtree);
+            if (r[0] && r[1] && r[2] && r[3]) {
+                o->relation.setReference(r[0]);
+                o->source.setReference(r[1]);
+                o->destination.setReference(r[2]);
+                o->pattern_owner.setReference(r[3]);
+            }
+        }
+        auto items = in.get<uint32_t>();
+        for (uint32_t i = 0; i < items && in.ok; i++) {
+            auto l = in.str();
+            auto primary = in.u8();
+            auto object = decodeReference(in, objects, subtree);
+            if (object && (!primary || !object->has_primary) && (l.empty() || !o->findItem(l)))
+                o->add(object, l, primary);
+            else
+                in.ok = false;
+        }
+        auto n = in.get<uint32_t>();
+        for (uint32_t i = 0; i < n && in.ok; i++) {
+            auto l = in.str();
+            auto object = decodeReference(in, objects, subtree);
+            if (relations.count(object))
+                o->addRelation(static_cast<HarmonyRelation *>(object), l);
+            else
+                in.ok = false;
+        }
+        if (!in.ok)
+            break;
+    }
+    return in.ok;
+}
+
+// held by the message until it is in place
+HarmonyObject * HdbNode::decodeValue(HdbNodeReader &in, HarmonyObject *message, HarmonyObject *subtree)
+{
+    vector<HarmonyObject *> objects;
+    unordered_set<HarmonyObject *> relations;
+
+    if (in.has(1) && *in.p == 'G') {
+        in.p++;
+        if (decodeObjects(in, message, objects, relations) && decodeGraph(in, objects, relations, subtree))
+            return objects[0];
+        in.ok = false;
+        return NULL;
+    }
+    auto object = decodeReference(in, objects, subtree);
+    if (object)
+        message->add(object);
+    return object;
+}
+
+// a context of another node, resumed on the queue it was taken from
+bool HdbNode::adopt(HdbNodePeer *peer, HdbNodeReader &in, HarmonyObject *message)
+{
+    auto label = in.str();
+    auto queue = (ExecutionEngine::Queue)in.u8();
+    auto launcher = in.str();
+    auto contexts = db->getRoot()->findItem("context")->object;
+    vector<HarmonyObject *> objects;
+    unordered_set<HarmonyObject *> relations;
+
+    if (!in.ok || queue > ExecutionEngine::PARKED || contexts->findItem(label))
+        return false;
+    auto account = hdb_memory.open(launcher.empty() ? label: launcher, db);
+    HdbMemScope scope(account);
+    if (!decodeObjects(in, message, objects, relations))
+        return false;
+    auto ctx = objects[0];
+    account->ctx = ctx;
+    account->name = ctx->getKey() + " " + account->name;
+    contexts->add(ctx, label, true);
+
+    if (!decodeGraph(in, objects, relations)) {
+        PF("Malformed context %s from node %s", label.c_str(), peer->id.c_str());
+        contexts->remove(contexts->findItem(ctx));
+        return false;
+    }
+    contexts_received->add();
+    engine->resume(ctx, queue, launcher);
+    return true;
+}
+
+// Moves the context to the node: it goes in a MIGRATE frame and the one
+// left here is hinted with where it went, see forwarding(). Between runs.
+bool HdbNode::migrate(HarmonyObject *ctx, const string &node)
+{
+    auto p = ctx->isRemote() || node == id ? NULL: peer(node);
+
+    if (!p) {
+        PF("Context %s can't migrate to node %s", ctx->getKey().c_str(), node.c_str());
+        return false;
+    }
+    auto l = engine->launchers.find(ctx);
+    auto launcher = l != engine->launchers.end() ? l->second: string();
+    auto queue = engine->suspend(ctx);
+    if (queue == ExecutionEngine::NONE) {
+        PF("Context %s is neither running nor waiting", ctx->getKey().c_str());
+        return false;
+    }
+    auto label = id + "_" + to_string(next_migration++);
+    auto start = beginFrame(p->out, MIGRATE);
+    putString(p->out, label);
+    put<uint8_t>(p->out, queue);
+    putString(p->out, launcher);
+    encodeGraph(p->out, ctx);
+    endFrame(p->out, start);
+    grant(node);
+    frames_sent->add();
+    contexts_sent->add();
+    ctx->hints[HINT_NODE] = node;
+    ctx->hints[HINT_REMOTE] = ".context." + label;
+    return true;
+}
+
+// the proxy of a receiver of a migrated context at its new place, made once
+HarmonyObject * HdbNode::forwarding(HarmonyObject *receiver)
+{
+    auto rctx = receiver->type == HarmonyObject::RECEIVE ? receiver->context:
+        receiver->parent_receiver ? receiver->parent_receiver->context: NULL;
+
+    if (!rctx || !rctx->isRemote())
+        return NULL;
+    auto &f = forwards[receiver];
+    if (!f) {
+        auto top = receiver;
+        string path;
+
+        for (auto item = receiver->primaryItem(); item && item->parent && top != rctx; item = item->parent->primaryItem()) {
+            path = "." + item->indexLabel() + path;
+            top = item->parent;
+        }
+        if (top != rctx) { // the cloned launcher isn't the primary item of its context
+            auto item = rctx->findItem(top);
+            if (!item) {
+                PF("Receiver %p of migrated context %s has no path there", receiver, rctx->getKey().c_str());
+                return NULL;
+            }
+            path = "." + item->indexLabel() + path;
+        }
+        f = db->remoteObject(rctx->getHint(HINT_NODE), rctx->getHint(HINT_REMOTE) + path);
+        remotes->add(f, string(), true);
+    }
+    return f;
+}
+
+void HdbNode::send(HarmonyObject *remote, HarmonyObject *argument, HarmonyObject *return_object)
+{
+    auto node = remote->getHint(HINT_NODE);
+    auto reply = remote->getHint(HINT_REPLY);
+    unordered_set<HarmonyObject *> visited;
+    auto p = peer(node);
+
+    if (!p) {
+        PF("Node %s is unknown or unreachable, the message to %p is dropped", node.c_str(), remote);
+        return;
+    }
+    if (!reply.empty()) {
+        auto start = beginFrame(p->out, DELIVER);
+        put<uint64_t>(p->out, strtoull(reply.c_str(), NULL, 10));
+        encode(p->out, argument, visited);
+        endFrame(p->out, start);
+    } else {
+        auto start = beginFrame(p->out, SEND);
+        putString(p->out, remote->getHint(HINT_REMOTE));
+        put<uint8_t>(p->out, return_object != NULL);
+        if (return_object)
+            encode(p->out, return_object, visited);
+        encode(p->out, argument, visited);
+        endFrame(p->out, start);
+    }
+    grant(node);
+    frames_sent->add();
+}
+
+// reads what's there, false once the peer is gone
+bool HdbNode::readable(HdbNodePeer *peer)
+{
+    char buffer[65536];
+
+    for (;;) {
+        auto n = ::read(peer->fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            peer->in.append(buffer, n);
+            bytes_received->add(n);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return true;
+        return false;
+    }
+}
+
+// writes the buffers, reading meanwhile so that two nodes flushing to each
+// other can't block each other
+void HdbNode::flush()
+{
+    for (auto p: peers) {
+        size_t written = 0;
+
+        if (network) {
+            if (!p->out.empty()) {
+                writes->add();
+                bytes_sent->add(p->out.size());
+                network->transmit(this, p->id, p->out);
+            }
+            p->out.clear();
+            continue;
+        }
+
+        while (written < p->out.size()) {
+            auto n = ::send(p->fd, p->out.data() + written, p->out.size() - written, MSG_NOSIGNAL);
+            if (n > 0) {
+                writes->add();
+                bytes_sent->add(n);
+                written += n;
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                struct pollfd pfd {p->fd, POLLIN | POLLOUT, 0};
+
+                ::poll(&pfd, 1, 1000);
+                if (pfd.revents & POLLIN && readable(p))
+                    continue;
+                if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+                    continue;
+            }
+            // closed by the next poll()
+            PF("Node %s at %s is gone, %zu bytes not sent", p->id.c_str(), p->address.c_str(), p->out.size() - written);
+            shutdown(p->fd, SHUT_RDWR);
+            break;
+        }
+        p->out.clear();
+    }
+}
+
+bool HdbNode::dispatch(HdbNodePeer *peer, HdbNodeReader &in)
+{
+    auto kind = in.u8();
+
+    frames_received->add();
+    if (kind == HELLO) {
+        peer->id = in.str();
+        return in.ok;
+    }
+    if (kind == LEASE) {
+        leased(peer, in);
+        return in.ok;
+    }
+    if (kind == LOAD) {
+        auto run_queue = in.get<uint32_t>();
+        in.get<uint32_t>();
+        if (in.u8())
+            load(peer, false);
+        if (in.ok)
+            loads[peer->id] = run_queue;
+        return in.ok;
+    }
+    auto message = new HarmonyObject;
+    node_context->add(message, "message", true);
+    // the decoded objects have to be older than the current sweep for cloneArgument()
+    START_SWEEP
+    FINISH_SWEEP
+    if (kind == SEND) {
+        auto path = in.str();
+        auto return_object = in.u8() ? decode(in, message, "return"): NULL;
+        auto argument = decode(in, message, "argument");
+        auto target = in.ok ? lookup(path): NULL;
+
+        if (target)
+            target->ensureLoaded();
+        if (!in.ok) {
+            PF("Malformed SEND from node %s", peer->id.c_str());
+        } else if (target && target->isRemote()) { // in a shard of another node
+            send(target, argument, return_object);
+        } else if (target && target->type == HarmonyObject::LAUNCH && !argument) {
+            PF("Node %s drops the SEND to %s from node %s: no argument", id.c_str(), path.c_str(), peer->id.c_str());
+        } else if (target && target->type == HarmonyObject::LAUNCH) {
+            engine->sendMessage(target, argument, return_object);
+        } else if (!target || (target->type != HarmonyObject::RECEIVE && !target->parent_receiver)) {
+            PF("Node %s has no launcher or receiver %s", id.c_str(), path.c_str());
+        } else if (auto why = engine->undeliverable(target, argument)) {
+            PF("Node %s drops the SEND to %s from node %s: %s", id.c_str(), path.c_str(), peer->id.c_str(), why);
+        } else {
+            engine->deliver(NULL, target, argument);
+        }
+    } else if (kind == DELIVER) {
+        auto reply = in.get<uint64_t>();
+        auto argument = decode(in, message, "argument");
+        auto e = exports.find(reply);
+        auto object = e != exports.end() ? e->second.object.object: NULL;
+
+        if (!in.ok) {
+            PF("Malformed DELIVER from node %s", peer->id.c_str());
+        } else if (object && object->type == HarmonyObject::LAUNCH && !argument) {
+            PF("Node %s drops the DELIVER of reply %lu from node %s: no argument", id.c_str(), reply, peer->id.c_str());
+        } else if (object && object->type == HarmonyObject::LAUNCH) {
+            engine->sendMessage(object, argument);
+        } else if (!object || (object->type != HarmonyObject::RECEIVE && !object->parent_receiver)) {
+            PF("Node %s has no receiver waiting for reply %lu", id.c_str(), reply);
+        } else if (auto why = engine->undeliverable(object, argument)) {
+            PF("Node %s drops the DELIVER of reply %lu from node %s: %s", id.c_str(), reply, peer->id.c_str(), why);
+        } else {
+            engine->deliver(NULL, object, argument);
+            if (e->second.reply) {
+                exports.erase(e);
+                exports_held->set(exports.size());
+            }
+        }
+    } else if (kind == MIGRATE) {
+        adopt(peer, in, message);
+    } else if (kind == SUBSCRIBE) {
+        auto subtree = in.str();
+        auto count = in.get<uint32_t>();
+        map<string, pair<uint64_t, uint64_t>> digest;
+        for (uint32_t n = 0; n < count && in.ok; n++) {
+            auto key = in.str();
+            auto hash = in.get<uint64_t>();
+            digest[key] = {hash, in.get<uint64_t>()};
+        }
+        if (in.ok)
+            sync(peer, subtree, digest);
+    } else if (kind == SYNC || kind == REPLICATE) {
+        HarmonyObject::_observing++;    // not replicated further
+        in.ok = kind == SYNC ? replace(peer, in, message): apply(peer, in, message);
+        HarmonyObject::_observing--;
+    } else {
+        in.ok = false;
+    }
+    node_context->remove(node_context->findItem(message));
+    return in.ok;
+}
+
+// with running, the runs sliced by the engine go on, the reactor's events
+// are sent and the balancer gets its turns
+bool HdbNode::poll(int timeout, bool running)
+{
+    vector<struct pollfd> pfds;
+    vector<HdbNodePeer *> polled;
+    bool dispatched = false;
+    auto reactor = running && !network ? engine->reactor: NULL;     // not on the virtual clock
+    HdbMemScope scope(db->account);     // the objects of the frames, a simulation polls several bases
+
+    if (running && (!engine->run_queue.empty() || (reactor && reactor->pending())))
+        timeout = 0;
+    auto now = nowNs(CLOCK_MONOTONIC);     // not past the renewal of the leases
+    int due = next_lease > now ? (next_lease - now + 999999) / 1000000: 0;
+    if (timeout < 0 || timeout > due)
+        timeout = due;
+    if (listen_fd >= 0)
+        pfds.push_back({listen_fd, POLLIN, 0});
+    for (auto p: peers) {
+        pfds.push_back({p->fd, POLLIN, 0});
+        polled.push_back(p);
+    }
+    if (reactor)
+        pfds.push_back({reactor->fd(), POLLIN, 0});     // last, its events are taken below
+    if (network) {
+        network->wait(this, timeout);
+        polled.assign(peers.begin(), peers.end());
+        for (auto p: polled)
+            if (!frames(p, dispatched))
+                close(p);
+    } else if (::poll(pfds.data(), pfds.size(), timeout) > 0) {
+        unsigned i = 0;
+        if (listen_fd >= 0 && pfds[i++].revents & POLLIN) {
+            int fd;
+
+            while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                int one = 1;
+
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                peers.push_back(new HdbNodePeer {string(), string("accepted"), fd, string(), string()});
+            }
+        }
+        for (auto p: polled) {
+            bool alive = !(pfds[i++].revents & (POLLIN | POLLHUP | POLLERR)) || readable(p);
+
+            if (!frames(p, dispatched) || !alive)
+                close(p);
+        }
+    }
+    if (reactor)
+        reactor->poll(0);
+    if (running && (dispatched || !engine->run_queue.empty()))
+        engine->run();
+    now = nowNs(CLOCK_MONOTONIC);
+    if (now >= next_lease) {
+        renew();
+        reconcile();
+        next_lease = now + lease * 500000ull;     // renewed at half of the lease
+    } else if (leasing && engine->instructions != renewed) {
+        renew(false);       // what a run let go of is released right away
+    }
+    if (running && balance_interval) {
+        now = nowNs(CLOCK_MONOTONIC);
+        if (now >= next_balance) {
+            balance();
+            report(true);
+            next_balance = now + balance_interval * 1000000ull;
+        }
+    }
+    flush();
+    return dispatched;
+}
+
+// dispatches the whole frames read, false after a malformed one
+bool HdbNode::frames(HdbNodePeer *peer, bool &dispatched)
+{
+    size_t used = 0;
+    uint32_t length;
+    bool ok = true;
+
+    while (peer->in.size() - used >= sizeof(length)) {
+        memcpy(&length, peer->in.data() + used, sizeof(length));
+        if (peer->in.size() - used - sizeof(length) < length)
+            break;
+        HdbNodeReader in {peer->in.data() + used + sizeof(length), peer->in.data() + used + sizeof(length) + length, true};
+        used += sizeof(length) + length;
+        if (!dispatch(peer, in)) {
+            ok = false;
+            break;
+        }
+        dispatched = true;
+    }
+    peer->in.erase(0, used);
+    return ok;
+}
+
+// The network has one connection per pair of nodes, named by the network
+// rather than by the HELLO frame coming first.
+void HdbNode::receive(const string &from, const string &frames)
+{
+    HdbNodePeer *p = NULL;
+
+    for (auto q: peers)
+        if (q->id == from)
+            p = q;
+    if (!p) {
+        p = new HdbNodePeer {from, string("simulated"), -1, string(), string()};
+        peers.push_back(p);
+    }
+    p->in += frames;
+    bytes_received->add(frames.size());
+}
+
+// what isn't read or written yet is lost, the next frames connect again
+// and the replicas of the node's subtrees start over from a SYNC
+void HdbNode::disconnected(const string &node)
+{
+    for (auto p = peers.begin(); p != peers.end(); ) {
+        auto q = *p++;
+
+        if (q->id == node)
+            close(q);
+    }
+    for (auto &r: replicated)
+        if (r.second.primary == node)
+            subscribe(r.first, node);
+}
+
+void HdbNode::load(HdbNodePeer *peer, bool ask)
+{
+    auto start = beginFrame(peer->out, LOAD);
+    put<uint32_t>(peer->out, engine->run_queue.size());
+    put<uint32_t>(peer->out, engine->wait_queue.size());
+    put<uint8_t>(peer->out, ask);
+    endFrame(peer->out, start);
+    frames_sent->add();
+}
+
+void HdbNode::report(bool ask)
+{
+    for (auto &a: addresses)
+        peer(a.first, false);
+    for (auto p: peers)
+        if (!p->id.empty())
+            load(p, ask);
+    flush();
+}
+
+// Half of the difference to the least loaded peer goes there once it is
+// more than one context, taken from the back of the run queue, where they
+// would wait the longest. The peer's load counts them until it reports.
+unsigned HdbNode::balance()
+{
+    string target;
+    unsigned least = UINT_MAX, moved = 0;
+
+    for (auto &l: loads) {
+        if (l.second < least) {
+            least = l.second;
+            target = l.first;
+        }
+    }
+    if (target.empty() || engine->run_queue.size() <= least + 1)
+        return 0;
+    for (auto n = (engine->run_queue.size() - least) / 2; n; n--) {
+        if (!migrate(engine->run_queue.back(), target))
+            break;
+        moved++;
+    }
+    loads[target] += moved;
+    flush();
+    return moved;
+}
+
+// the same clock for all the nodes of a network
+uint64_t HdbNode::nowNs(clockid_t clock)
+{
+    return network ? network->now(): hdbNowNs(clock);
+}
+
+size_t HdbNode::outstanding()
+{
+    size_t n = 0;
+
+    for (auto &e: exports)
+        n += e.second.reply;
+    return n;
+}
+
+// held by the nodes the frame being encoded goes to, see grant()
+uint64_t HdbNode::exportObject(HarmonyObject *object, bool reply)
+{
+    auto id = next_reply++;
+    auto &e = exports[id];
+
+    e.object.setReference(object);
+    e.reply = reply;
+    exported.push_back(id);
+    exports_held->set(exports.size());
+    return id;
+}
+
+// the node holds the ids of the frame just encoded for it until its LEASE
+// renews or releases them
+void HdbNode::grant(const string &node, bool done)
+{
+    auto until = nowNs(CLOCK_MONOTONIC) + lease * 1000000ull;
+
+    for (auto id: exported) {
+        auto e = exports.find(id);
+
+        if (e != exports.end())
+            e->second.holders[node] = until;
+    }
+    if (done)
+        exported.clear();
+}
+
+// lag: ns since the last holder let it go, as far as it is known here
+void HdbNode::reclaim(map<uint64_t, HdbNodeExport>::iterator e, uint64_t lag)
+{
+    exports.erase(e);
+    exports_held->set(exports.size());
+    exports_reclaimed->add();
+    reclamation_lags->record(lag);
+}
+
+// The leases of the holders run out unless renewed, the objects nobody
+// holds any more are reclaimed. The ids no frame went out with are held
+// for a lease too.
+void HdbNode::reconcile()
+{
+    auto now = nowNs(CLOCK_MONOTONIC);
+
+    for (auto e = exports.begin(); e != exports.end(); ) {
+        auto next = std::next(e);
+        auto &holders = e->second.holders;
+        uint64_t last = 0;
+
+        if (holders.empty() && find(exported.begin(), exported.end(), e->first) == exported.end())
+            holders[string()] = now + lease * 1000000ull;
+        for (auto h = holders.begin(); h != holders.end(); ) {
+            if (h->second > now) {
+                h++;
+                continue;
+            }
+            last = max(last, h->second);
+            h = holders.erase(h);
+        }
+        if (holders.empty())
+            reclaim(e, now - last);
+        e = next;
+    }
+}
+
+// A LEASE to the owner of every proxy by id: the ids still referred to
+// here are renewed, the proxies nothing refers to but remotes are dropped
+// and their ids released. Without held, only to the owners of released ids
+// and with none renewed.
+void HdbNode::renew(bool held)
+{
+    map<string, pair<set<uint64_t>, set<uint64_t>>> ids;       // node -> held, released
+    size_t imports = 0;
+
+    for (auto i = remotes->items.next; i != &remotes->items; ) {
+        auto o = i->object;
+        auto reply = strtoull(o->getHint(HINT_REPLY).c_str(), NULL, 10);
+        bool used = o->reference.countReferences() > 1;
+
+        if (reply) {
+            auto &t = ids[o->getHint(HINT_NODE)];
+            (used ? t.first: t.second).insert(reply);
+            imports += used;
+        }
+        i = used || !reply ? i->next: remotes->remove(i);
+        if (!i)
+            break;
+    }
+    for (auto &t: ids) {
+        for (auto id: t.second.first)
+            t.second.second.erase(id);
+        if (!held && t.second.second.empty())
+            continue;
+        if (!held)
+            t.second.first.clear();
+        auto p = peer(t.first, false);
+        if (!p)
+            continue;
+        auto start = beginFrame(p->out, LEASE);
+        put<uint32_t>(p->out, lease);
+        put<uint64_t>(p->out, nowNs(CLOCK_REALTIME));
+        for (auto &l: {t.second.first, t.second.second}) {
+            put<uint32_t>(p->out, l.size());
+            for (auto id: l)
+                put<uint64_t>(p->out, id);
+        }
+        endFrame(p->out, start);
+        frames_sent->add();
+    }
+    imports_held->set(imports);
+    leasing = imports > 0;
+    renewed = engine->instructions;
+}
+
+// the lag of a release is measured on the clocks of both nodes
+void HdbNode::leased(HdbNodePeer *peer, HdbNodeReader &in)
+{
+    auto ms = in.get<uint32_t>();
+    auto stamp = in.get<uint64_t>();
+    auto now = nowNs(CLOCK_MONOTONIC);
+
+    for (unsigned released = 0; released < 2 && in.ok; released++) {
+        auto n = in.get<uint32_t>();
+
+        for (uint32_t i = 0; i < n && in.ok; i++) {
+            auto e = exports.find(in.get<uint64_t>());
+
+            if (!in.ok || e == exports.end())
+                continue;
+            if (!released) {
+                e->second.holders[peer->id] = now + ms * 1000000ull;
+            } else if (e->second.holders.erase(peer->id) && e->second.holders.empty()) {
+                auto lag = (int64_t)(nowNs(CLOCK_REALTIME) - stamp);
+                reclaim(e, lag > 0 ? lag: 0);
+            }
+        }
+    }
+}
+
+// The subtree of the root the object is in and the steps down to it from
+// there along the holders. NULL for the objects in none, the root and
+// what's only in cycles.
+HarmonyItem * HdbNode::locate(HarmonyObject *object, vector<string> *steps)
+{
+    auto root = db->getRoot();
+
+    if (steps)
+        steps->clear();
+    for (unsigned depth = 0; depth < 4096; depth++) {
+        auto item = holder(object);
+
+        if (!item || !item->parent)
+            return NULL;
+        if (item->parent == root) {
+            if (steps)
+                reverse(steps->begin(), steps->end());
+            return item;
+        }
+        if (steps)
+            steps->push_back(item == &item->parent->proxy ? string("$"): item->indexLabel());
+        object = item->parent;
+    }
+    return NULL;
+}
+
+HarmonyObject * HdbNode::descend(HarmonyObject *object, const vector<string> &steps)
+{
+    for (auto &step: steps) {
+        HarmonyItem *item;
+
+        if (step == "$") {
+            object = object->isProxy() ? object->proxy.object: NULL;
+        } else if (step[0] == '[') {
+            auto n = strtoul(step.c_str() + 1, NULL, 10);
+            for (item = object->first(); item && n; item = item->nextItem(object))
+                n--;
+            object = item ? item->object: NULL;
+        } else {
+            item = object->findItem(step);
+            object = item ? item->object: NULL;
+        }
+        if (!object)
+            return NULL;
+    }
+    return object;
+}
+
+// the head of the REPLICATE frames of a mutation of the target, NULL
+// unless its subtree has replicas
+HarmonyItem * HdbNode::mutation(HarmonyObject *target, char kind, string &op)
+{
+    vector<string> steps;
+    auto subtree = locate(target, NULL);
+
+    if (!subtree || !replicas.count(subtree->label))
+        return NULL;
+    locate(target, &steps);
+    putString(op, subtree->label);
+    put<uint64_t>(op, ++mutation_seqs[subtree->label]);
+    put<uint64_t>(op, nowNs(CLOCK_REALTIME));
+    put<uint8_t>(op, kind);
+    putSteps(op, steps);
+    return subtree;
+}
+
+// into the buffers of the replicas, sent with the frames of the run
+void HdbNode::replicate(HarmonyItem *subtree, const string &op)
+{
+    auto &nodes = replicas[subtree->label];
+
+    for (auto n = nodes.begin(); n != nodes.end(); ) {
+        auto p = peer(*n, false);
+
+        if (!p) {
+            PF("Node %s is gone, it doesn't replicate %s any more", n->c_str(), subtree->label.c_str());
+            n = nodes.erase(n);
+            continue;
+        }
+        auto start = beginFrame(p->out, REPLICATE);
+        p->out += op;
+        endFrame(p->out, start);
+        grant(*n, false);
+        frames_sent->add();
+        mutations_sent->add();
+        n++;
+    }
+    exported.clear();
+}
+
+void HdbNode::adding(HarmonyObject *set, HarmonyObject *object, const string &label, bool primary)
+{
+    string op;
+    auto subtree = mutation(set, 'A', op);
+
+    if (!subtree)
+        return;
+    putString(op, label);
+    put<uint8_t>(op, primary);
+    encodeValue(op, object, subtree);
+    replicate(subtree, op);
+}
+
+void HdbNode::removing(HarmonyObject *set, HarmonyItem *item)
+{
+    string op;
+    auto subtree = mutation(set, 'D', op);
+    uint32_t index = 0;
+
+    if (!subtree)
+        return;
+    for (auto i = set->items.next; i != item; i = i->next)
+        index++;
+    put<uint32_t>(op, index);
+    replicate(subtree, op);
+}
+
+void HdbNode::linking(HarmonyObject *proxy, HarmonyObject *object)
+{
+    string op;
+    auto subtree = mutation(proxy, 'L', op);
+
+    if (!subtree)
+        return;
+    encodeValue(op, object, subtree);
+    replicate(subtree, op);
+}
+
+void HdbNode::copying(HarmonyObject *object, HarmonyObject *source)
+{
+    string op;
+    auto subtree = mutation(object, 'C', op);
+
+    if (!subtree)
+        return;
+    encodeValue(op, source, subtree);
+    replicate(subtree, op);
+}
+
+void HdbNode::relating(HarmonyObject *owner, HarmonyRelation *r, const string &label)
+{
+    string op;
+    auto subtree = mutation(owner, 'R', op);
+
+    if (!subtree)
+        return;
+    putString(op, label);
+    encodeValue(op, r->relation.object, subtree);
+    encodeValue(op, r->source.object, subtree);
+    encodeValue(op, r->destination.object, subtree);
+    replicate(subtree, op);
+}
+
+void HdbNode::unrelating(HarmonyObject *owner, HarmonyItem *item)
+{
+    string op;
+    auto subtree = mutation(owner, 'U', op);
+    uint32_t index = 0;
+
+    if (!subtree)
+        return;
+    for (auto r = owner->relations.next; r != item; r = r->next)
+        index++;
+    put<uint32_t>(op, index);
+    replicate(subtree, op);
+}
+
+// Asks the node for the subtree of its root, the copy here is replaced by
+// its SYNC and then follows it
+bool HdbNode::subscribe(const string &subtree, const string &node)
+{
+    auto p = node == id ? NULL: peer(node);
+
+    if (!p) {
+        PF("Node %s can't replicate %s to node %s", node.c_str(), subtree.c_str(), id.c_str());
+        return false;
+    }
+    auto &r = replicated[subtree];
+    r = HdbNodeReplica {node, false, 0, 0, 0, 0,
+        hdb_stats.histogram("divee_replica_lag_seconds", "From a mutation on the primary to its replica applying it",
+            "subtree=\"" + subtree + "\"")};
+    auto item = db->getRoot()->findItem(subtree);
+    auto start = beginFrame(p->out, SUBSCRIBE);
+    putString(p->out, subtree);
+    if (item && !item->object->isRemote())
+        digest(p->out, item->object);
+    else
+        put<uint32_t>(p->out, 0);
+    endFrame(p->out, start);
+    frames_sent->add();
+    return true;
+}
+
+bool HdbNode::synced()
+{
+    for (auto &r: replicated)
+        if (!r.second.synced)
+            return false;
+    return true;
+}
+
+static string stepsKey(const vector<string> &steps)
+{
+    string key;
+
+    for (auto &s: steps)
+        key += "." + s;
+    return key.empty() ? string("."): key;
+}
+
+// the hashes of the copy of a subtree here for its SUBSCRIBE, breadth first
+// along the primary items
+void HdbNode::digest(string &out, HarmonyObject *object)
+{
+    HdbMerkle merkle(db->getRoot());
+    vector<pair<vector<string>, HarmonyObject *>> objects {{{}, object}};
+
+    for (size_t n = 0; n < objects.size() && objects.size() < HDB_NODE_DIGEST; n++) {
+        auto o = objects[n].second;
+
+        o->ensureLoaded();
+        for (auto i = o->items.next; i != &o->items && objects.size() < HDB_NODE_DIGEST; i = i->next) {
+            if (!i->primary)
+                continue;
+            auto steps = objects[n].first;
+            steps.push_back(i->indexLabel());
+            objects.push_back({steps, i->object});
+        }
+    }
+    put<uint32_t>(out, objects.size());
+    for (auto &o: objects) {
+        putString(out, stepsKey(o.first));
+        put<uint64_t>(out, merkle.hash(o.second));
+        put<uint64_t>(out, merkle.hash(o.second, HdbMerkle::SHAPE));
+    }
+}
+
+// The topmost objects differing from the replica's: the ones the same but
+// for their primary items are descended into, the others replaced whole.
+void HdbNode::diverged(HdbMerkle &merkle, HarmonyObject *object, vector<string> &steps,
+    const map<string, pair<uint64_t, uint64_t>> &digest, vector<pair<vector<string>, HarmonyObject *>> &patches)
+{
+    auto d = digest.find(stepsKey(steps));
+
+    if (d != digest.end() && d->second.first == merkle.hash(object))
+        return;
+    if (d == digest.end() || d->second.second != merkle.hash(object, HdbMerkle::SHAPE)) {
+        patches.push_back({steps, object});
+        return;
+    }
+    for (auto i = object->items.next; i != &object->items; i = i->next) {
+        if (!i->primary)
+            continue;
+        steps.push_back(i->indexLabel());
+        diverged(merkle, i->object, steps, digest, patches);
+        steps.pop_back();
+    }
+}
+
+// Replaced on a replica, the objects under it have to be held only from
+// under it: what else refers to them there would keep the old ones.
+bool HdbNode::contained(HarmonyObject *object)
+{
+    vector<HarmonyObject *> region {object};
+    unordered_set<HarmonyObject *> seen {object};
+    auto reach = [&](HarmonyObject *o) {
+        if (o && !seen.count(o) && within(o, object)) {
+            seen.insert(o);
+            region.push_back(o);
+        }
+    };
+
+    for (size_t n = 0; n < region.size(); n++) {
+        auto o = region[n];
+
+        for (auto i = o->items.next; i != &o->items; i = i->next)
+            reach(i->object);
+        if (o->isProxy())
+            reach(o->proxy.object);
+        if (!n)
+            continue;
+        for (auto r = o->reference.next; r != &o->reference; r = r->next) {
+            auto i = dynamic_cast<HarmonyItem *>(r);
+
+            if (!i || !i->parent || !within(i->parent, object))
+                return false;
+        }
+    }
+    return true;
+}
+
+// The subtree to a new replica, the mutations follow from now on. Only the
+// objects differing from the replica's digest go, if it has one.
+void HdbNode::sync(HdbNodePeer *peer, const string &subtree, const map<string, pair<uint64_t, uint64_t>> &digest)
+{
+    auto item = db->getRoot()->findItem(subtree);
+
+    if (!item || subtree == "context" || item->object->isRemote()) {
+        PF("Node %s has no %s to replicate to node %s", id.c_str(), subtree.c_str(), peer->id.c_str());
+        return;
+    }
+    auto &nodes = replicas[subtree];
+    if (find(nodes.begin(), nodes.end(), peer->id) == nodes.end())
+        nodes.push_back(peer->id);
+    HarmonyObject::_observer = this;
+    HarmonyObject::_observing++;        // loading the stubs of the subtree isn't a mutation
+    vector<pair<vector<string>, HarmonyObject *>> patches;
+    bool whole = digest.empty();
+    if (!whole) {
+        HdbMerkle merkle(db->getRoot());
+        vector<string> steps;
+
+        diverged(merkle, item->object, steps, digest, patches);
+        for (auto &p: patches)
+            whole = whole || !contained(p.second);
+    }
+    if (whole)
+        patches = {{{}, item->object}};
+    auto start = beginFrame(peer->out, SYNC);
+    putString(peer->out, subtree);
+    put<uint64_t>(peer->out, mutation_seqs[subtree]);
+    put<uint32_t>(peer->out, patches.size());
+    for (auto &p: patches) {
+        putSteps(peer->out, p.first);
+        encodeGraph(peer->out, p.second, item);
+    }
+    endFrame(peer->out, start);
+    HarmonyObject::_observing--;
+    grant(peer->id);
+    frames_sent->add();
+    sync_bytes->add(peer->out.size() - start);
+}
+
+// emptied for the objects of a SYNC
+static void reset(HarmonyObject *object)
+{
+    object->clear();
+    object->clearRelations();
+    object->hints.clear();
+    if (object->isElement() && object->element_type.object) {
+        object->element_type.removeReference();
+    } else if (object->isProxy()) {
+        object->link(NULL);
+    } else if (object->isPattern()) {
+        for (auto r: {&object->relation, &object->source, &object->destination, &object->pattern_owner})
+            if (r->object)
+                r->removeReference();
+    }
+    object->invalidateMerkle();
+}
+
+// The SYNC of a subtree subscribed to: the objects of each replaced one
+// fill it here, the objects the rest of the base referred to in it are
+// left out of it
+bool HdbNode::replace(HdbNodePeer *peer, HdbNodeReader &in, HarmonyObject *message)
+{
+    auto label = in.str();
+    auto seq = in.get<uint64_t>();
+    auto count = in.get<uint32_t>();
+    auto r = replicated.find(label);
+
+    if (!in.ok || r == replicated.end() || r->second.primary != peer->id) {
+        PF("Node %s doesn't replicate %s from node %s", id.c_str(), label.c_str(), peer->id.c_str());
+        return in.ok;
+    }
+    auto item = db->getRoot()->findItem(label);
+    if (!item)
+        item = db->getRoot()->add(new HarmonyObject, label, true);
+    auto root = item->object;
+    HdbMemScope scope(db->account);
+    for (uint32_t n = 0; n < count; n++) {
+        vector<string> steps;
+        vector<HarmonyObject *> objects;
+        unordered_set<HarmonyObject *> relations;
+
+        auto target = in.strings(steps) ? descend(root, steps): NULL;
+        if (target)
+            reset(target);
+        if (!target || !decodeObjects(in, message, objects, relations, target) || !decodeGraph(in, objects, relations, root)) {
+            PF("Malformed SYNC of %s from node %s", label.c_str(), peer->id.c_str());
+            return false;
+        }
+    }
+    r->second.synced = true;
+    r->second.patches = count;
+    r->second.seq = seq;
+    return true;
+}
+
+// a mutation of the primary, the lag is measured on the clocks of both
+bool HdbNode::apply(HdbNodePeer *peer, HdbNodeReader &in, HarmonyObject *message)
+{
+    auto label = in.str();
+    auto seq = in.get<uint64_t>();
+    auto stamp = in.get<uint64_t>();
+    auto kind = in.u8();
+    vector<string> steps;
+    auto r = replicated.find(label);
+    auto item = db->getRoot()->findItem(label);
+
+    if (!in.strings(steps))
+        return false;
+    if (r == replicated.end() || !r->second.synced || r->second.primary != peer->id || !item)
+        return true;
+    if (seq != r->second.seq + 1) {
+        PF("Mutation %lu of %s from node %s after %lu, subscribing again", seq, label.c_str(), peer->id.c_str(),
+            r->second.seq);
+        subscribe(label, peer->id);
+        return true;
+    }
+    r->second.seq = seq;
+    auto root = item->object;
+    auto target = descend(root, steps);
+    if (!target) {
+        PF("Mutation %lu of %s from node %s: no %s here", seq, label.c_str(), peer->id.c_str(),
+            steps.empty() ? ".": steps.back().c_str());
+        return true;
+    }
+    HdbMemScope scope(db->account);
+    switch (kind) {
+    case 'A': {
+        auto l = in.str();
+        auto primary = in.u8();
+        auto object = decodeValue(in, message, root);
+        if (object && (!primary || !object->has_primary) && (l.empty() || !target->findItem(l)))
+            target->add(object, l, primary);
+        else
+            in.ok = false;
+        break;
+    }
+    case 'D':
+    case 'U': {
+        auto n = in.get<uint32_t>();
+        auto &list = kind == 'D' ? target->items: target->relations;
+        auto i = list.next;
+        for (; i != &list && n; i = i->next)
+            n--;
+        if (i == &list)
+            in.ok = false;
+        else if (kind == 'D')
+            target->remove(i);
+        else
+            target->removeRelation(i);
+        break;
+    }
+    case 'L': {
+        auto object = decodeValue(in, message, root);
+        if (in.ok && target->isProxy())
+            target->link(object);
+        else
+            in.ok = false;
+        break;
+    }
+    case 'C': {
+        auto object = decodeValue(in, message, root);
+        if (object)
+            target->copy(object);
+        else
+            in.ok = false;
+        break;
+    }
+    case 'R': {
+        auto rel = new HarmonyRelation;
+        rel->label = in.str();
+        HarmonyObject *refs[3];
+        for (auto &ref: refs)
+            ref = decodeValue(in, message, root);
+        if (refs[0] && refs[1] && refs[2]) {
+            rel->relation.setReference(refs[0]);
+            rel->source.setReference(refs[1]);
+            rel->destination.setReference(refs[2]);
+            target->addRelation(rel, rel->label);
+        } else {
+            delete rel;
+            in.ok = false;
+        }
+        break;
+    }
+    default:
+        in.ok = false;
+    }
+    if (!in.ok) {
+        PF("Malformed mutation %lu of %s from node %s, the replica diverges", seq, label.c_str(), peer->id.c_str());
+        return true;
+    }
+    auto lag = (int64_t)(nowNs(CLOCK_REALTIME) - stamp);
+    r->second.applied++;
+    r->second.lag = lag;
+    r->second.lags->record(lag > 0 ? lag: 0);
+    mutations_applied->add();
+    return true;
+}
+
+static volatile sig_atomic_t serving;
+
+static void stopServing(int signal)
+{
+    serving = 0;
+}
+
+void hdbServe(const function<bool()> &step)
+{
+    struct sigaction sa, old_term, old_int;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stopServing;
+    sigaction(SIGTERM, &sa, &old_term);
+    sigaction(SIGINT, &sa, &old_int);
+    for (serving = 1; serving && step(); )
+        ;
+    sigaction(SIGTERM, &old_term, NULL);
+    sigaction(SIGINT, &old_int, NULL);
+}
+
+void HdbNode::serve()
+{
+    PF("Node %s serving on %s", id.c_str(), listen_address.c_str());
+    fflush(stdout);
+    hdbServe([this] {
+        poll(100);
+        return true;
+    });
+}
+
+void HdbNode::print(FILE *f)
+{
+    fprintf(f, "node %s", id.c_str());
+    if (listen_fd >= 0)
+        fprintf(f, " listening on %s", listen_address.c_str());
+    fprintf(f, ", %zu replies outstanding\n", outstanding());
+    fprintf(f, "%zu objects held by id for other nodes, %ld reclaimed, %ld of theirs held here, leases of %u ms\n", exports.size(),
+        exports_reclaimed->value(), imports_held->value(), lease);
+    for (auto &a: addresses)
+        fprintf(f, "peer %s at %s\n", a.first.c_str(), a.second.c_str());
+    for (auto p: peers)
+        fprintf(f, "connection %d: node %s, %s, %zu bytes to read, %zu to write\n", p->fd, p->id.empty() ? "?": p->id.c_str(),
+            p->address.c_str(), p->in.size(), p->out.size());
+    for (auto &l: loads)
+        fprintf(f, "peer %s reported a run queue of %u\n", l.first.c_str(), l.second);
+    fprintf(f, "%ld frames, %ld bytes sent in %ld writes, %ld frames, %ld bytes received\n", frames_sent->value(), bytes_sent->value(),
+        writes->value(), frames_received->value(), bytes_received->value());
+    fprintf(f, "%ld contexts migrated out, %ld in\n", contexts_sent->value(), contexts_received->value());
+    for (auto &r: replicas)
+        for (auto &n: r.second)
+            fprintf(f, "subtree %s replicated to node %s\n", r.first.c_str(), n.c_str());
+    for (auto &r: replicated)
+        fprintf(f, "subtree %s replicated from node %s, %s, %u objects replaced by the sync, %lu mutations applied, the last one %lu after %.6f s\n",
+            r.first.c_str(), r.second.primary.c_str(), r.second.synced ? "synced": "waiting for the sync", r.second.patches, r.second.applied,
+            r.second.seq, r.second.lag / 1e9);
+}
@@ -0,0 +1,271 @@
+#ifndef HDB_NODE_H
+#define HDB_NODE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <unordered_set>
+#include <unordered_map>
+#include <functional>
+#include "harmonydb.h"
+#include "hdb_merkle.h"
+
+using namespace std;
+
+struct ExecutionEngine;
+struct HdbNodeReader;
+
+#define HDB_NODE_DIGEST 16384     // objects of a replica's copy hashed in its SUBSCRIBE
+#define HDB_NODE_LEASE 10000      // ms an exported object is held for a node without its LEASE
+
+// Hint of the proxies of the receivers of other nodes, instead of HINT_REMOTE
+#define HINT_REPLY "reply"      // the id of a receiver waiting there for a reply
+
+struct HdbNode;
+
+// Carries the frames instead of the sockets, and keeps the time of the nodes,
+// see HdbSimulation
+struct HdbNodeNetwork
+{
+    virtual ~HdbNodeNetwork() {}
+    virtual uint64_t now() = 0;                                     // ns
+    virtual void transmit(HdbNode *from, const string &to, string &frames) = 0;
+    virtual void wait(HdbNode *node, int timeout) = 0;              // ms, until frames come for the node
+};
+
+// A connection to another node, named by the HELLO frame
+struct HdbNodePeer
+{
+    string id, address;
+    int fd;
+    string in, out;             // unparsed frames, frames not written yet
+};
+
+// An object of this node the others refer to by id, see reconcile()
+struct HdbNodeExport
+{
+    HarmonyObjectReference object;      // keeps it alive
+    bool reply;                         // a receiver, done with at its first DELIVER
+    map<string, uint64_t> holders;      // node -> end of its lease, ns
+};
+
+// A subtree of the root read here from a copy of another node's, see
+// HdbNode::subscribe()
+struct HdbNodeReplica
+{
+    string primary;
+    bool synced;                // the SYNC came
+    unsigned patches;           // objects it replaced, 0 if the copy here was the same
+    uint64_t applied, seq;      // mutations, the last one's number
+    int64_t lag;                // ns from the primary making the last one to applying it here
+    HdbHistogram *lags;
+};
+
+// One process of a cluster of divees sending messages to each other over
+// unix or TCP sockets. A SEND to a remote proxy, an object hinted with the
+// node owning it, is serialized into the peer's buffer and the buffers are
+// written once the engine runs out of work, so that the sends of a run go
+// out in as few writes as possible and nobody waits for an answer. The
+// receivers in the arguments travel as reply ids, a SEND to the proxy made
+// of one on the other side comes back as a DELIVER to the receiver.
+//
+// The objects given out by id, the receivers and what a migrated context
+// refers to in the other contexts, are held here for the nodes they went
+// to (reference listing): every holder has a lease on them, renewed by the
+// LEASE frames it sends as long as a proxy of the id is in use there and
+// released by them once none is. An object is reclaimed when its last
+// holder releases it, disconnects or lets its lease run out.
+//
+// With a network, the frames go through it instead of the sockets and the
+// time of the leases, the balancer and the lags is its clock.
+//
+// A running or waiting context can move to another node, see migrate(). The
+// context stays behind empty of work, hinted with its new place, and the
+// messages to its receivers are forwarded there. The balancer moves the
+// contexts at the back of the run queue to the peer reporting the shortest
+// one, it needs the runs sliced (ExecutionEngine::slice) to see a queue.
+//
+// A subtree of the root can be replicated to the nodes subscribing to it:
+// they get it whole in a SYNC frame and then its mutations as they are made
+// here, as the HarmonyObserver, in REPLICATE frames going out with the other
+// frames of the run, in order. A replica applies them as they come and reads
+// its copy locally, and subscribes again when one is missing. What it
+// changes in the copy itself isn't sent back and the mutations it applies
+// aren't replicated further. A replica having a copy already sends its
+// Merkle hashes (HdbMerkle) with the SUBSCRIBE and the SYNC replaces only
+// the topmost objects differing from them, unless something outside of one
+// refers into it: then the whole subtree goes.
+//
+// Frames: u32 length of the rest, u8 kind, the payload, host byte order.
+//   HELLO    node id
+//   SEND     target path, u8 1 and the return value or 0, argument value
+//   DELIVER  reply id, argument value
+//   MIGRATE  context label, u8 queue, launcher path, u32 count, the kinds
+//            of the objects, then each object, the context first:
+//            hints, u8 flags, u32 armed, u32 got, parent receiver reference,
+//            element type reference and int64 | lower, higher int64 |
+//            proxy reference | 4 pattern references | relation label and
+//            3 references, then u32 count (label, u8 primary, reference)...
+//            items, u32 count (label, reference)... relations
+//   LOAD     u32 run queue, u32 wait queue, u8 1 asking for the peer's back
+//   SUBSCRIBE  subtree label, u32 count, (steps key, u64 hash, u64 shape
+//            hash)... of the copy's objects breadth first, e.g. ".a.[2]"
+//   SYNC     subtree label, u64 number of the last mutation, u32 count,
+//            (steps, the objects of the replaced one as in MIGRATE)...,
+//            no steps for the whole subtree
+//   LEASE    u32 lease ms, u64 realtime ns, u32 count, ids
+//            held, u32 count, ids released
+//   REPLICATE  subtree label, u64 number (the previous one's plus 1), u64
+//            realtime ns, u8 mutation, steps to the mutated object, then by
+//            the mutation:
+//            'A' label, u8 primary, value    add
+//            'D' u32 index                   remove the item
+//            'L' value                       link the proxy
+//            'C' value                       copy into the object
+//            'R' label, 3 values             add a relation
+//            'U' u32 index                   remove the relation
+// Values: 'S' count (label value)...   set
+//         'E' type path, int64         element
+//         'T' type path                type, shared
+//         'P'                          empty proxy
+//         'X' node, path, reply id     remote object or receiver
+//         'N'                          nothing
+// References of MIGRATE: 'L' u32 index of a migrated object, 'N', 'E' as
+// above, 'T' path of an object every node has, 'X' as above. Those of SYNC
+// and REPLICATE also 'R' steps from the top of the subtree, the values of
+// REPLICATE are references or 'G' and the objects of a copied graph.
+// Steps: u32 count, labels, "[n]" for the n-th item, "$" for the proxied.
+struct HdbNode : HarmonyObserver
+{
+    enum Kind {
+        HELLO = 1,
+        SEND,
+        DELIVER,
+        MIGRATE,
+        LOAD,
+        SUBSCRIBE,
+        SYNC,
+        REPLICATE,
+        LEASE
+    };
+
+    string id;
+    HarmonyDB *db;
+    ExecutionEngine *engine;
+    int listen_fd;
+    string listen_address;
+    map<string, string> addresses;              // peer id -> address, connected on the first send
+    list<HdbNodePeer *> peers;
+    map<uint64_t, HdbNodeExport> exports;       // local objects by the ids given out
+    uint64_t next_reply;
+    vector<uint64_t> exported;                  // ids of the frame being encoded, see grant()
+    unsigned lease;                             // ms a holder's lease lasts
+    uint64_t next_lease;                        // ns
+    bool leasing;                               // proxies by id are held, a run may drop them
+    uint64_t renewed;                           // ExecutionEngine::instructions at the last renew()
+    HarmonyObject *node_context;                // context.node
+    HarmonyObject *remotes;                     // the proxies decoded from the messages
+    unsigned connect_timeout;                   // ms
+    map<string, unsigned> loads;                // peer id -> the run queue it reported
+    unsigned balance_interval;                  // ms between the balancing rounds of poll(), 0 for none
+    uint64_t next_balance;                      // ns
+    unsigned next_migration;
+    unordered_map<HarmonyObject *, HarmonyObject *> forwards;  // receivers of migrated contexts -> proxies
+    HdbCounter *frames_sent, *frames_received, *bytes_sent, *bytes_received, *writes;
+    HdbCounter *contexts_sent, *contexts_received;
+    map<string, vector<string>> replicas;       // subtree -> the nodes replicating it from here
+    map<string, HdbNodeReplica> replicated;     // subtree -> where it is replicated from
+    map<string, uint64_t> mutation_seqs;        // subtree -> the number of its last mutation
+    HdbCounter *mutations_sent, *mutations_applied, *sync_bytes;
+    HdbCounter *exports_held, *imports_held, *exports_reclaimed;
+    HdbHistogram *reclamation_lags;
+    HdbNodeNetwork *network;                    // NULL for the sockets
+
+    HdbNode(const string &id, HarmonyDB *db, ExecutionEngine *engine);
+    ~HdbNode();
+
+    bool listen(const string &address);
+    void addPeer(const string &id, const string &address);
+    static bool isRemote(HarmonyObject *object) {
+        return object->isRemote();
+    }
+
+    void send(HarmonyObject *remote, HarmonyObject *argument, HarmonyObject *return_object = NULL);
+    void flush();
+    bool poll(int timeout, bool running = true);    // ms, true if some frames were dispatched
+    void serve();               // until SIGTERM or SIGINT
+    void receive(const string &from, const string &frames);     // from the network, dispatched by poll()
+    void disconnected(const string &node);  // the connections to the node broke, by the network
+    uint64_t nowNs(clockid_t clock);
+    void print(FILE *f);
+
+    bool migrate(HarmonyObject *ctx, const string &node);
+    HarmonyObject * forwarding(HarmonyObject *receiver);    // NULL unless its context migrated
+    void report(bool ask);      // the run queue to every peer
+    size_t outstanding();       // replies not delivered yet
+    void renew(bool held = true);   // the leases of the proxies used here, or only the releases
+    void reconcile();           // reclaims what no node holds any more
+    unsigned balance();         // contexts migrated
+
+    bool subscribe(const string &subtree, const string &node);
+    bool synced();              // all the subscribed subtrees came
+    void adding(HarmonyObject *set, HarmonyObject *object, const string &label, bool primary);
+    void removing(HarmonyObject *set, HarmonyItem *item);
+    void linking(HarmonyObject *proxy, HarmonyObject *object);
+    void copying(HarmonyObject *object, HarmonyObject *source);
+    void relating(HarmonyObject *owner, HarmonyRelation *r, const string &label);
+    void unrelating(HarmonyObject *owner, HarmonyItem *item);
+
+private:
+    HdbNodePeer * peer(const string &id, bool waiting = true);
+    HdbNodePeer * connect(const string &id, bool waiting);
+    void close(HdbNodePeer *peer);
+    bool frames(HdbNodePeer *peer, bool &dispatched);
+    void encode(string &out, HarmonyObject *object, unordered_set<HarmonyObject *> &visited);
+    void encodeRemote(string &out, HarmonyObject *object);
+    uint64_t exportObject(HarmonyObject *object, bool reply);
+    void grant(const string &node, bool done = true);
+    void reclaim(map<uint64_t, HdbNodeExport>::iterator e, uint64_t lag);
+    void leased(HdbNodePeer *peer, HdbNodeReader &in);
+    void encodeReference(string &out, HarmonyObject *object, unordered_map<HarmonyObject *, uint32_t> &index,
+        HarmonyItem *subtree = NULL);
+    void encodeGraph(string &out, HarmonyObject *root, HarmonyItem *subtree = NULL);
+    void encodeValue(string &out, HarmonyObject *object, HarmonyItem *subtree);
+    HarmonyObject * decode(HdbNodeReader &in, HarmonyObject *parent, const string &label);
+    HarmonyObject * decodeReference(HdbNodeReader &in, vector<HarmonyObject *> &objects, HarmonyObject *subtree = NULL);
+    bool decodeObjects(HdbNodeReader &in, HarmonyObject *message, vector<HarmonyObject *> &objects,
+        unordered_set<HarmonyObject *> &relations, HarmonyObject *root = NULL);
+    bool decodeGraph(HdbNodeReader &in, vector<HarmonyObject *> &objects, unordered_set<HarmonyObject *> &relations,
+        HarmonyObject *subtree = NULL);
+    HarmonyObject * decodeValue(HdbNodeReader &in, HarmonyObject *message, HarmonyObject *subtree);
+    bool adopt(HdbNodePeer *peer, HdbNodeReader &in, HarmonyObject *message);
+    bool owned(HarmonyObject *object, HarmonyObject *ctx);
+    bool shared(HarmonyObject *object);
+    HarmonyItem * top(HarmonyObject *object);
+    HarmonyItem * locate(HarmonyObject *object, vector<string> *steps);
+    HarmonyObject * descend(HarmonyObject *object, const vector<string> &steps);
+    HarmonyItem * mutation(HarmonyObject *target, char kind, string &op);
+    void replicate(HarmonyItem *subtree, const string &op);
+    void digest(string &out, HarmonyObject *object);
+    void diverged(HdbMerkle &merkle, HarmonyObject *object, vector<string> &steps,
+        const map<string, pair<uint64_t, uint64_t>> &digest, vector<pair<vector<string>, HarmonyObject *>> &patches);
+    bool contained(HarmonyObject *object);
+    void sync(HdbNodePeer *peer, const string &subtree, const map<string, pair<uint64_t, uint64_t>> &digest);
+    bool replace(HdbNodePeer *peer, HdbNodeReader &in, HarmonyObject *message);
+    bool apply(HdbNodePeer *peer, HdbNodeReader &in, HarmonyObject *message);
+    void load(HdbNodePeer *peer, bool ask);
+    HarmonyObject * resolve(const string &node, const string &path, uint64_t reply);
+    HarmonyObject * lookup(const string &path);
+    bool dispatch(HdbNodePeer *peer, HdbNodeReader &in);
+    bool readable(HdbNodePeer *peer);
+};
+
+// Calls step until SIGTERM or SIGINT, or until it returns false, as the node,
+// the server and the reactor serve; the handlers of the signals are restored
+void hdbServe(const function<bool()> &step);
+
+#endif
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <string>
 #include <list>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "harmonydb.h"
 
@@ -94,7 +96,70 @@ struct HdbObjectRelation : HdbObject {
     virtual ~HdbObjectRelation();
 };
 
+// symbol table built while loading a file
+
+struct HdbSymbolKey {
+    HdbObject *scope;
+    string path;
+
+    bool operator==(const HdbSymbolKey &k) const {
+        return scope == k.scope && path == k.path;
+    }
+};
+
+struct HdbSymbolKeyHash {
+    size_t operator()(const HdbSymbolKey &k) const {
+        size_t h = hash<string>()(k.path);
+
+        return h ^ (hash<HdbObject *>()(k.scope) + 0x9e3779b9 + (h << 6) + (h >> 2));
+    }
+};
+
+struct HdbSymbolTable {
+    unordered_map<HdbSymbolKey, HdbObject *, HdbSymbolKeyHash> children;        // (scope, label), first one wins
+    unordered_map<HdbSymbolKey, HarmonyObject *, HdbSymbolKeyHash> resolved;    // (scope, path)
+    unordered_set<HarmonyObject *> stubs;   // references not substituted yet, never cached
+    unsigned hits, misses;
+
+    HdbSymbolTable(): hits(0), misses(0) {}
+    void add(HdbObject *scope, HdbObject *child);
+    HdbObject * findChild(HdbObject *scope, const string &label);
+};
+
+// single pass loader
+
+struct HdbDirectReference {
+    bool absolute;
+    HarmonyObjectPath path;
+
+    string toString() const {
+        return absolute ? path.toString(): path.toString().substr(1);
+    }
+};
+
+struct HdbDirectEntry {
+    HarmonyObject *object;
+    string label;
+    bool temporary;
+
+    HdbDirectEntry(): object(NULL), temporary(false) {}
+};
+
+struct HdbFixup {
+    enum Kind {
+        SUBSTITUTE,     // reference standing for an object
+        ELEMENT_TYPE,
+        LINK,           // proxy
+        RELATION,
+        SOURCE,
+        DESTINATION,
+        OWNER           // pattern
+    } kind;
+    HarmonyObject *object;
+    HdbDirectReference reference;
+};
+
 HdbObject *parseHdb(FILE *file);
-HarmonyObject * getObjectByReference(HarmonyDB *db, HdbSymbolReference *reference, HdbObject *start);
+HarmonyObject * getObjectByReference(HarmonyDB *db, HdbSymbolReference *reference, HdbObject *start, HdbSymbolTable *symbols = NULL);
 
 #endif
@@ -0,0 +1,189 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "hdb_perf.h"
+
+HdbPerf hdb_perf;
+
+static const char *event_names[HDB_PERF_EVENTS] = {
+    "cycles", "instructions", "cache-misses", "branch-misses"
+};
+
+static const uint64_t event_configs[HDB_PERF_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static const char *phase_names[HDB_PERF_PHASES] = {
+    "run", "execute_match", "cloneObject", "dumpBase"
+};
+
+void HdbPerfCounts::add(const uint64_t *start, const uint64_t *end)
+{
+    calls++;
+    for (unsigned e = 0; e < HDB_PERF_EVENTS; e++)
+        if (end[e] > start[e])
+            values[e] += end[e] - start[e];
+}
+
+HdbPerf::HdbPerf() : enabled(false), group_fd(-1)
+{
+    for (auto &fd: fds)
+        fd = -1;
+    clear();
+}
+
+HdbPerf::~HdbPerf()
+{
+    close();
+}
+
+// the events the PMU lacks are left out of the group, the first one opened leads
+bool HdbPerf::open()
+{
+    int err = 0;
+
+    for (unsigned e = 0; e < HDB_PERF_EVENTS; e++) {
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = event_configs[e];
+        attr.disabled = group_fd < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+        if (fds[e] < 0) {
+            err = errno;
+            continue;
+        }
+        if (group_fd < 0)
+            group_fd = fds[e];
+    }
+    if (group_fd < 0) {
+        error = string("perf_event_open: ") + strerror(err);
+        return false;
+    }
+    return true;
+}
+
+void HdbPerf::close()
+{
+    for (auto &fd: fds) {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+    }
+    group_fd = -1;
+}
+
+bool HdbPerf::start()
+{
+    if (enabled)
+        return true;
+    if (group_fd < 0 && !open())
+        return false;
+    ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    enabled = true;
+    last_opcode = -1;
+    return true;
+}
+
+void HdbPerf::stop()
+{
+    if (!enabled)
+        return;
+    switchOpcode(-1);
+    ioctl(group_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    enabled = false;
+}
+
+void HdbPerf::clear()
+{
+    memset(phases, 0, sizeof(phases));
+    memset(active, 0, sizeof(active));
+    memset(opcodes, 0, sizeof(opcodes));
+    last_opcode = -1;
+}
+
+// scaled up when the events were multiplexed
+void HdbPerf::read(uint64_t *values)
+{
+    uint64_t data[3 + HDB_PERF_EVENTS];
+
+    memset(values, 0, HDB_PERF_EVENTS * sizeof(uint64_t));
+    if (group_fd < 0 || ::read(group_fd, data, sizeof(data)) < (ssize_t)(3 * sizeof(uint64_t)))
+        return;
+    double scale = data[2] && data[2] < data[1] ? (double)data[1] / data[2]: 1.0;
+    for (unsigned e = 0, i = 3; e < HDB_PERF_EVENTS; e++)
+        if (fds[e] >= 0)
+            values[e] = data[i++] * scale;
+}
+
+void HdbPerf::switchOpcode(int type)
+{
+    uint64_t now[HDB_PERF_EVENTS];
+
+    if (type < 0 && last_opcode < 0)
+        return;
+    read(now);
+    if (last_opcode >= 0)
+        opcodes[last_opcode].add(last, now);
+    last_opcode = type;
+    memcpy(last, now, sizeof(last));
+}
+
+static void printCounts(FILE *f, const char *name, const HdbPerfCounts &c, const int *fds)
+{
+    fprintf(f, "%12lu", c.calls);
+    for (unsigned e = 0; e < HDB_PERF_EVENTS; e++) {
+        if (fds[e] >= 0)
+            fprintf(f, " %14lu", c.values[e]);
+        else
+            fprintf(f, " %14s", "n/a");
+    }
+    if (fds[0] >= 0 && fds[1] >= 0 && c.values[0])
+        fprintf(f, " %6.2f", (double)c.values[1] / c.values[0]);
+    else
+        fprintf(f, " %6s", "n/a");
+    // misses per thousand instructions
+    for (unsigned e = 2; e < HDB_PERF_EVENTS; e++) {
+        if (fds[1] >= 0 && fds[e] >= 0 && c.values[1])
+            fprintf(f, " %7.2f", c.values[e] * 1000.0 / c.values[1]);
+        else
+            fprintf(f, " %7s", "n/a");
+    }
+    fprintf(f, "  %s\n", name);
+}
+
+const char * HdbPerf::eventName(unsigned event)
+{
+    return event_names[event];
+}
+
+void HdbPerf::report(FILE *f)
+{
+    if (group_fd < 0) {
+        fprintf(f, "Performance counters are not available%s%s\n", error.empty() ? "": ": ", error.c_str());
+        return;
+    }
+    fprintf(f, "%12s", "calls");
+    for (auto name: event_names)
+        fprintf(f, " %14s", name);
+    fprintf(f, " %6s %7s %7s  %s\n", "IPC", "cm/ki", "bm/ki", "phase");
+    for (unsigned p = 0; p < HDB_PERF_PHASES; p++)
+        printCounts(f, phase_names[p], phases[p], fds);
+    fprintf(f, "\n");
+    fprintf(f, "%12s", "executed");
+    for (auto name: event_names)
+        fprintf(f, " %14s", name);
+    fprintf(f, " %6s %7s %7s  %s\n", "IPC", "cm/ki", "bm/ki", "opcode");
+    for (unsigned t = 0; t < HDB_TYPES; t++)
+        if (opcodes[t].calls)
+            printCounts(f, hdb_type_names[t], opcodes[t], fds);
+}
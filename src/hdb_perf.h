@@ -0,0 +1,95 @@
+#ifndef HDB_PERF_H
+#define HDB_PERF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include "hdb_types.h"
+
+using namespace std;
+
+#define HDB_PERF_EVENTS 4   // cycles, instructions, cache misses, branch misses
+
+enum HdbPerfPhase {
+    HDB_PERF_RUN,
+    HDB_PERF_MATCH,
+    HDB_PERF_CLONE,
+    HDB_PERF_DUMP,
+    HDB_PERF_PHASES
+};
+
+struct HdbPerfCounts
+{
+    uint64_t calls;
+    uint64_t values[HDB_PERF_EVENTS];
+
+    void add(const uint64_t *start, const uint64_t *end);
+};
+
+// Hardware counters of the process from perf_event_open(), read as a group
+// around the phases and between the instructions of the engine. Without
+// perf events (no PMU, perf_event_paranoid, seccomp) start() fails with the
+// reason in error and everything else stays a no-op.
+struct HdbPerf
+{
+    bool enabled;
+    string error;
+    int group_fd;
+    int fds[HDB_PERF_EVENTS];               // -1 for the events that couldn't be opened
+
+    HdbPerfCounts phases[HDB_PERF_PHASES];  // inclusive, the outermost call of each
+    bool active[HDB_PERF_PHASES];
+    HdbPerfCounts opcodes[HDB_TYPES];
+    int last_opcode;                        // -1 outside of an instruction
+    uint64_t last[HDB_PERF_EVENTS];
+
+    HdbPerf();
+    ~HdbPerf();
+
+    bool start();
+    void stop();
+    void clear();
+
+    void read(uint64_t *values);
+    // charges the counts since the previous call to the previous opcode, -1 stops
+    void opcode(int type) {
+        if (enabled)
+            switchOpcode(type);
+    }
+    void switchOpcode(int type);
+
+    void report(FILE *f);
+    static const char * eventName(unsigned event);
+
+private:
+    bool open();
+    void close();
+};
+
+extern HdbPerf hdb_perf;
+
+// counts the outermost call of a phase
+struct HdbPerfScope
+{
+    HdbPerfPhase phase;
+    bool counting;
+    uint64_t start[HDB_PERF_EVENTS];
+
+    HdbPerfScope(HdbPerfPhase phase) : phase(phase), counting(hdb_perf.enabled && !hdb_perf.active[phase]) {
+        if (counting) {
+            hdb_perf.active[phase] = true;
+            hdb_perf.read(start);
+        }
+    }
+    ~HdbPerfScope() {
+        if (counting) {
+            uint64_t end[HDB_PERF_EVENTS];
+
+            hdb_perf.read(end);
+            hdb_perf.phases[phase].add(start, end);
+            hdb_perf.active[phase] = false;
+        }
+    }
+};
+
+#endif
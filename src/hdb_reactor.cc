@@ -0,0 +1,379 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <vector>
+#include <algorithm>
+
+#include "hdb_reactor.h"
+#include "hdb_node.h"
+#include "execution_engine.h"
+
+#define HDB_REACTOR_WATCH (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB)
+
+// a receiver takes one SEND per RECEIVE, from its context arming it to the
+// context passing it; a launcher or a remote object every one
+static bool takes(HarmonyObject *target)
+{
+    return target->type != HarmonyObject::RECEIVE || (target->receiver_armed && target->receiver_got < target->receiver_armed);
+}
+
+static bool held(HdbReactorSource *s)
+{
+    return s->ticks || !s->data.empty() || s->end || !s->notes.empty();
+}
+
+HdbReactor::HdbReactor(HarmonyDB *db, ExecutionEngine *engine)
+    : db(db), engine(engine), epoll_fd(epoll_create1(EPOLL_CLOEXEC)), next_source(1)
+{
+    auto contexts = db->getRoot()->findItem("context");
+    auto reactor_item = contexts ? contexts->object->findItem("reactor"): NULL;
+
+    context = reactor_item ? reactor_item->object: db->createContext(NULL, "reactor");
+    auto value_item = context->findItem("value");
+    if (value_item) {
+        value = value_item->object;
+    } else {
+        value = new HarmonyObject(HarmonyObject::Type::TYPE);
+        value->type_lower = 0;
+        value->type_higher = UINT32_MAX;
+        context->add(value, "value", true);
+    }
+    events = hdb_stats.counter("divee_reactor_events_total", "Timer expirations, reads and inotify events taken by the reactor");
+    sends = hdb_stats.counter("divee_reactor_sends_total", "SENDs of the reactor to the targets of its sources");
+    sources_open = hdb_stats.counter("divee_reactor_sources", "Timers, descriptors and watches of the reactor", HdbCounter::GAUGE);
+    wakes = hdb_stats.histogram("divee_reactor_wake_seconds", "From a timer's expiration to its SEND", string());
+}
+
+HdbReactor::~HdbReactor()
+{
+    while (!sources.empty())
+        remove(sources.begin()->second);
+    ::close(epoll_fd);
+}
+
+HdbReactorSource * HdbReactor::add(HdbReactorSource::Kind kind, HarmonyObject *target, int fd, bool owned, const string &path)
+{
+    struct epoll_event ev;
+
+    target->ensureLoaded();
+    if (!HdbNode::isRemote(target) && target->type != HarmonyObject::LAUNCH && target->type != HarmonyObject::RECEIVE) {
+        PF("The target of a reactor source has to be a launcher or a receiver");
+        if (owned)
+            ::close(fd);
+        return NULL;
+    }
+    auto s = new HdbReactorSource;
+    s->kind = kind;
+    s->id = next_source;
+    s->fd = fd;
+    s->owned = owned;
+    s->target.setReference(target);
+    s->path = path;
+    s->period = s->due = s->ticks = s->expired = s->sent = 0;
+    s->end = false;
+    s->reading = true;
+    ev.events = EPOLLIN;
+    ev.data.u32 = s->id;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        PF("Can't poll %s: %s", path.empty() ? "the descriptor": path.c_str(), strerror(errno));
+        if (owned)
+            ::close(fd);
+        delete s;
+        return NULL;
+    }
+    sources[next_source++] = s;
+    sources_open->set(sources.size());
+    return s;
+}
+
+void HdbReactor::remove(HdbReactorSource *source)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+    if (source->owned)
+        ::close(source->fd);
+    sources.erase(source->id);
+    sources_open->set(sources.size());
+    delete source;
+}
+
+unsigned HdbReactor::timer(HarmonyObject *target, uint64_t ns, bool repeat)
+{
+    struct itimerspec its;
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd < 0 || !ns) {
+        PF("Couldn't make a timer: %s", fd < 0 ? strerror(errno): "no time");
+        if (fd >= 0)
+            ::close(fd);
+        return 0;
+    }
+    auto s = add(HdbReactorSource::TIMER, target, fd, true, string());
+    if (!s)
+        return 0;
+    s->period = repeat ? ns: 0;
+    s->due = hdbNowNs() + ns;
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = ns % 1000000000;
+    its.it_interval = repeat ? its.it_value: timespec {0, 0};
+    timerfd_settime(fd, 0, &its, NULL);
+    return s->id;
+}
+
+unsigned HdbReactor::read(HarmonyObject *target, int fd, bool owned, const string &path)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    auto s = add(HdbReactorSource::READ, target, fd, owned, path);
+    return s ? s->id: 0;
+}
+
+unsigned HdbReactor::watch(HarmonyObject *target, const string &path, uint32_t mask)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fd < 0 || inotify_add_watch(fd, path.c_str(), mask ? mask: HDB_REACTOR_WATCH) < 0) {
+        PF("Couldn't watch %s: %s", path.c_str(), strerror(errno));
+        if (fd >= 0)
+            ::close(fd);
+        return 0;
+    }
+    auto s = add(HdbReactorSource::WATCH, target, fd, true, path);
+    return s ? s->id: 0;
+}
+
+bool HdbReactor::cancel(unsigned id)
+{
+    auto s = sources.find(id);
+
+    if (s == sources.end())
+        return false;
+    remove(s->second);
+    return true;
+}
+
+int HdbReactor::fd()
+{
+    return epoll_fd;
+}
+
+// whether some held events can be sent now, the engine having run since
+bool HdbReactor::pending()
+{
+    for (auto &s: sources)
+        if (held(s.second) && takes(s.second->target.object))
+            return true;
+    return false;
+}
+
+void HdbReactor::interest(HdbReactorSource *source, bool reading)
+{
+    struct epoll_event ev;
+
+    if (source->reading == reading)
+        return;
+    ev.events = reading ? EPOLLIN: 0;
+    ev.data.u32 = source->id;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, source->fd, &ev);
+    source->reading = reading;
+}
+
+// takes what came into the source, as much as it holds
+void HdbReactor::readable(HdbReactorSource *source)
+{
+    if (source->kind != HdbReactorSource::TIMER && !held(source))
+        source->expired = hdbNowNs();
+    if (source->kind == HdbReactorSource::TIMER) {
+        uint64_t expirations;
+
+        if (::read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+            return;
+        events->add(expirations);
+        if (!source->ticks)
+            source->expired = source->due;
+        source->ticks += expirations;
+        source->due += expirations * source->period;
+    } else if (source->kind == HdbReactorSource::READ) {
+        char buffer[HDB_REACTOR_CHUNK];
+
+        while (source->data.size() < HDB_REACTOR_CHUNK) {
+            auto n = ::read(source->fd, buffer, HDB_REACTOR_CHUNK - source->data.size());
+            if (n > 0) {
+                events->add();
+                source->data.append(buffer, n);
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                break;
+            source->end = true;     // or an error, the same for the program
+            break;
+        }
+        if (source->end || source->data.size() >= HDB_REACTOR_CHUNK)
+            interest(source, false);
+    } else {
+        char buffer[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+        while (source->notes.size() < HDB_REACTOR_NOTES) {
+            auto n = ::read(source->fd, buffer, sizeof(buffer));   // whole events, at least one
+            if (n <= 0)
+                break;
+            for (char *p = buffer; p < buffer + n; ) {
+                auto e = (struct inotify_event *)p;
+
+                events->add();
+                source->notes.push_back({e->mask, e->len ? string(e->name): string()});
+                p += sizeof(struct inotify_event) + e->len;
+            }
+        }
+        if (source->notes.size() >= HDB_REACTOR_NOTES)
+            interest(source, false);
+    }
+}
+
+HarmonyObject * HdbReactor::element(int64_t v)
+{
+    auto object = new HarmonyObject(HarmonyObject::Type::ELEMENT);
+
+    object->element_type.setReference(value);
+    object->element_value = v;
+    return object;
+}
+
+HarmonyObject * HdbReactor::bytes(const string &s)
+{
+    auto set = new HarmonyObject;
+
+    for (unsigned char c: s)
+        set->add(element(c), string(), true);
+    return set;
+}
+
+// sends what the source holds if its target takes it, false if it didn't
+bool HdbReactor::dispatch(HdbReactorSource *source)
+{
+    auto target = source->target.object;
+    bool last = source->kind == HdbReactorSource::TIMER && !source->period;    // a timer once
+
+    if (!held(source) || !takes(target))
+        return false;
+    auto message = new HarmonyObject;
+    context->add(message, "message", true);
+    message->add(element(source->id), "source", true);
+    if (source->kind == HdbReactorSource::TIMER) {
+        message->add(element(source->ticks), "count", true);
+        wakes->record(hdbNowNs() - source->expired);
+        source->ticks = 0;
+    } else if (source->kind == HdbReactorSource::READ) {
+        auto n = min(source->data.size(), (size_t)HDB_REACTOR_CHUNK);
+
+        message->add(bytes(source->data.substr(0, n)), "data", true);
+        source->data.erase(0, n);
+        if (source->end && source->data.empty()) {
+            message->add(element(1), "end", true);
+            last = true;
+        } else if (!source->end) {
+            interest(source, true);
+        }
+    } else {
+        auto &note = source->notes.front();
+
+        message->add(element(note.first), "mask", true);
+        message->add(bytes(note.second), "name", true);
+        source->notes.pop_front();
+        interest(source, true);
+    }
+    // the objects of the message have to be older than the current sweep for cloneArgument()
+    START_SWEEP
+    FINISH_SWEEP
+    sends->add();
+    source->sent++;
+    engine->sendMessage(target, message);
+    context->remove(context->findItem(message));
+    if (last)
+        remove(source);
+    return true;
+}
+
+// Takes the events, then sends what the sources hold to the targets taking
+// it, until none does: the run of a SEND can arm a receiver for the next one.
+// The sources go in the order their events came, not by id, so that a
+// receiver gets the timers of one poll by their expirations.
+bool HdbReactor::poll(int timeout)
+{
+    struct epoll_event ready[HDB_REACTOR_EVENTS];
+    bool busy = !engine->run_queue.empty() || pending();
+
+    if (busy)
+        timeout = 0;
+    auto n = epoll_wait(epoll_fd, ready, HDB_REACTOR_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+        auto s = sources.find(ready[i].data.u32);
+        if (s != sources.end())
+            readable(s->second);
+    }
+    for (bool sent = true; sent; ) {
+        vector<unsigned> ids;
+
+        sent = false;
+        for (auto &s: sources)
+            ids.push_back(s.first);
+        stable_sort(ids.begin(), ids.end(), [this](unsigned a, unsigned b) {
+            return sources[a]->expired < sources[b]->expired;
+        });
+        for (auto id: ids) {
+            auto s = sources.find(id);
+            if (s != sources.end() && dispatch(s->second))
+                sent = true;
+        }
+        if (!engine->run_queue.empty())
+            engine->run();
+    }
+    return n > 0 || busy;
+}
+
+void HdbReactor::run(int timeout, HdbNode *node)
+{
+    auto end = hdbNowNs() + timeout * 1000000ull;
+
+    hdbServe([&] {
+        int left = -1;
+
+        if (sources.empty())
+            return false;
+        if (timeout >= 0) {
+            auto now = hdbNowNs();
+            if (now >= end)
+                return false;
+            left = (end - now + 999999) / 1000000;
+        }
+        if (node)
+            node->poll(left);   // the reactor with the sockets
+        else
+            poll(left);
+        return true;
+    });
+}
+
+void HdbReactor::print(FILE *f)
+{
+    static const char *kinds[] = {"timer", "read", "watch"};
+
+    fprintf(f, "reactor, %zu sources, %ld events, %ld sends\n", sources.size(), events->value(), sends->value());
+    for (auto &i: sources) {
+        auto s = i.second;
+
+        fprintf(f, "source %u: %s", s->id, kinds[s->kind]);
+        if (s->kind == HdbReactorSource::TIMER && s->period)
+            fprintf(f, " every %.3f ms", s->period / 1e6);
+        else if (s->kind == HdbReactorSource::TIMER)
+            fprintf(f, " once");
+        else
+            fprintf(f, " %s", s->path.c_str());
+        fprintf(f, " -> %s, %lu sent, %s\n", s->target.object->getPrimaryPath().c_str(), s->sent,
+            !held(s) ? "nothing held": takes(s->target.object) ? "held": "held for the receiver");
+    }
+}
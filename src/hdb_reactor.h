@@ -0,0 +1,93 @@
+#ifndef HDB_REACTOR_H
+#define HDB_REACTOR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <map>
+#include "harmonydb.h"
+
+using namespace std;
+
+struct ExecutionEngine;
+struct HdbNode;
+
+#define HDB_REACTOR_CHUNK 4096      // bytes of a read source in one SEND, and buffered at most
+#define HDB_REACTOR_NOTES 256       // inotify events held for a busy target
+#define HDB_REACTOR_EVENTS 64       // epoll events taken at once
+
+// Something the reactor turns into SENDs: a timer, a file descriptor read
+// for its data, or an inotify watch
+struct HdbReactorSource
+{
+    enum Kind {
+        TIMER,
+        READ,
+        WATCH
+    } kind;
+    unsigned id;
+    int fd;
+    bool owned;                 // closed with the source
+    HarmonyObjectReference target;     // keeps it alive
+    string path;                // of the target, and of the file for READ and WATCH
+    uint64_t period, due;       // ns, TIMER, period 0 for once; due is the next expiration
+    uint64_t ticks, expired;    // TIMER expirations not sent yet; the time of the first event held
+    string data;                // READ, not sent yet
+    bool end;                   // READ, the end of the file was read
+    list<pair<uint32_t, string>> notes;    // WATCH, inotify masks and names not sent yet
+    bool reading;               // in the epoll set, off while as much as can be held waits
+    uint64_t sent;
+};
+
+// Turns timers (timerfd) and the readiness of file descriptors (pipes,
+// sockets, files, inotify) into SENDs to launchers and receivers, so the
+// programs react to what happens outside without polling. A SEND's argument
+// has the id of the source and what came:
+//   timer     (source: value[id], count: value[expirations])
+//   read      (source: value[id], data: (value[byte], ...)) and end: value[1] at the end of the file
+//   watch     (source: value[id], mask: value[inotify mask], name: (value[byte], ...))
+// with "value" the type of the reactor's context (.context.reactor.value).
+// A launcher gets every event in a context of its own. A receiver gets one
+// SEND per RECEIVE: the events are held while it isn't armed, the expirations
+// of a timer counted, the data and the inotify events buffered up to a limit,
+// past which the descriptor isn't read until the receiver takes them.
+//
+// One epoll set holds every source: poll() sleeps in it while the run queue
+// is empty, so an idle engine takes no CPU and wakes when an event comes. A
+// node polls the reactor with its sockets, anything else can wait for fd().
+struct HdbReactor
+{
+    HarmonyDB *db;
+    ExecutionEngine *engine;
+    int epoll_fd;
+    HarmonyObject *context, *value;
+    map<unsigned, HdbReactorSource *> sources;     // by id
+    unsigned next_source;
+    HdbCounter *events, *sends, *sources_open;
+    HdbHistogram *wakes;
+
+    HdbReactor(HarmonyDB *db, ExecutionEngine *engine);
+    ~HdbReactor();
+
+    unsigned timer(HarmonyObject *target, uint64_t ns, bool repeat = true);    // 0 if it couldn't be made
+    unsigned read(HarmonyObject *target, int fd, bool owned = true, const string &path = string());
+    unsigned watch(HarmonyObject *target, const string &path, uint32_t mask = 0);   // 0 for the usual changes
+    bool cancel(unsigned id);
+    int fd();                   // readable when poll() has something to do
+    bool pending();             // held events a target takes now, poll() without waiting
+    bool poll(int timeout);     // ms, -1 to sleep until an event, true if something was sent or run
+    void run(int timeout, HdbNode *node = NULL);   // ms, -1 until SIGTERM, SIGINT or no sources left
+    void print(FILE *f);
+
+private:
+    HdbReactorSource * add(HdbReactorSource::Kind kind, HarmonyObject *target, int fd, bool owned, const string &path);
+    void remove(HdbReactorSource *source);
+    void readable(HdbReactorSource *source);
+    bool dispatch(HdbReactorSource *source);
+    void interest(HdbReactorSource *source, bool reading);
+    HarmonyObject * element(int64_t v);
+    HarmonyObject * bytes(const string &s);
+};
+
+#endif
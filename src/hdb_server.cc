@@ -0,0 +1,416 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+
+#include "hdb_server.h"
+#include "hdb_node.h"
+#include "execution_engine.h"
+
+#define HDB_SERVER_DEPTH 16         // levels of a rendered reply
+
+static vector<string> words(const string &line)
+{
+    vector<string> fields;
+    size_t e = 0;
+
+    for (;;) {
+        auto b = line.find_first_not_of(" \t\r", e);
+        if (b == string::npos)
+            break;
+        e = line.find_first_of(" \t\r", b);
+        fields.push_back(line.substr(b, e == string::npos ? string::npos: e - b));
+        if (e == string::npos)
+            break;
+    }
+    return fields;
+}
+
+static void render(string &out, HarmonyObject *object, unsigned depth, unordered_set<HarmonyObject *> &visited);
+
+static void renderItems(string &out, HarmonyObject *set, unsigned depth, unordered_set<HarmonyObject *> &visited, bool &first)
+{
+    for (auto i = set->first(); i; i = i->nextItem(set)) {
+        out += first ? "": ", ";
+        first = false;
+        if (!i->label.empty())
+            out += i->label + ": ";
+        render(out, i->object, depth + 1, visited);
+    }
+}
+
+static void render(string &out, HarmonyObject *object, unsigned depth, unordered_set<HarmonyObject *> &visited)
+{
+    bool first = true;
+
+    if (!object) {
+        out += '_';
+    } else if (object->isElement()) {
+        out += object->element_type.object ? object->element_type.object->getPrimaryPath(): string("?");
+        out += '[' + to_string(object->element_value) + ']';
+    } else if (object->isType()) {
+        out += '<' + to_string(object->type_lower) + ", " + to_string(object->type_higher) + '>';
+    } else if (object->isProxy()) {
+        if (object->proxy.object)
+            render(out, object->proxy.object, depth, visited);
+        else
+            out += '$';
+    } else if (object->isCode() || depth > HDB_SERVER_DEPTH || !visited.insert(object).second) {
+        out += '?';
+    } else if (!object->first()) {
+        out += '_';
+    } else {
+        out += '(';
+        renderItems(out, object, depth, visited, first);
+        out += ')';
+        visited.erase(object);
+    }
+}
+
+// what of a send would trip the asserts of the engine, nothing if it's fine:
+// the named arguments of the launcher or the receiver have to be in the
+// argument, where they take a proxy, and a launcher takes the return
+static string unfit(HarmonyObject *target, HarmonyObject *argument)
+{
+    auto named = target->first() ? target->first()->object: NULL;
+
+    if (!named)
+        return "takes no arguments";
+    if (target->type == HarmonyObject::LAUNCH) {
+        auto r = named->findItem("return");
+        if (!r || !r->object->isProxy())
+            return "takes no return";
+    }
+    for (auto i = argument->first(); i; i = i->nextItem(argument)) {
+        auto n = i->label.empty() ? NULL: named->findItem(i->label);
+
+        if (!i->object->getObject())
+            return "has nothing in " + i->indexLabel();
+        if (target->type == HarmonyObject::LAUNCH && i->label == "return")
+            return "has a return of its own";
+        if (n && !n->object->isProxy())
+            return "can't take " + i->label;
+    }
+    for (auto n = named->first(); n; n = n->nextItem(named))
+        if (n->label != "return" && !argument->findItem(n->label))
+            return "has no " + n->indexLabel();
+    return string();
+}
+
+HdbServer::HdbServer(HarmonyDB *db, ExecutionEngine *engine, HdbNode *node)
+    : db(db), engine(engine), node(node), listen_fd(-1), epoll_fd(epoll_create1(EPOLL_CLOEXEC)), next_client(1)
+{
+    connections = hdb_stats.counter("divee_server_clients", "Clients connected to the server", HdbCounter::GAUGE);
+    requests = hdb_stats.counter("divee_server_requests_total", "Requests read from the clients");
+    responses = hdb_stats.counter("divee_server_responses_total", "Responses queued for the clients");
+    latencies = hdb_stats.histogram("divee_server_request_seconds", "From reading a request to queuing its response", string());
+}
+
+HdbServer::~HdbServer()
+{
+    while (!clients.empty())
+        close(clients.begin()->second);
+    for (auto c: closed)
+        release(c);
+    if (listen_fd >= 0) {
+        ::close(listen_fd);
+        unlink(address.c_str() + 5);
+    }
+    ::close(epoll_fd);
+}
+
+bool HdbServer::listen(const string &address)
+{
+    struct sockaddr_un sa;
+    auto path = address.substr(5);
+    struct epoll_event ev;
+
+    if (address.compare(0, 5, "unix:") || path.size() >= sizeof(sa.sun_path)) {
+        PF("Can't serve the clients on %s, only on unix:<path>", address.c_str());
+        return false;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path.c_str());
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) || ::listen(listen_fd, 128)) {
+        PF("Couldn't listen on %s: %s", address.c_str(), strerror(errno));
+        return false;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    this->address = address;
+    return true;
+}
+
+void HdbServer::accept()
+{
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        auto c = new HdbServerClient;
+        struct epoll_event ev;
+
+        c->id = next_client++;
+        c->fd = fd;
+        c->requests = 0;
+        c->cwd = ".";
+        c->context = db->createContext(NULL, "client" + to_string(c->id));
+        c->receivers = new HarmonyObject;
+        c->context->add(c->receivers, "receivers", true);
+        c->writing = false;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        clients[fd] = c;
+        connections->add();
+    }
+}
+
+// reads and executes the whole lines, false once the client is gone
+bool HdbServer::readable(HdbServerClient *client)
+{
+    char buffer[65536];
+    bool alive = true;
+    size_t used = 0, end;
+
+    for (;;) {
+        auto n = ::read(client->fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            client->in.append(buffer, n);
+            continue;
+        }
+        alive = n < 0 && (errno == EAGAIN || errno == EINTR);
+        break;
+    }
+    while ((end = client->in.find('\n', used)) != string::npos) {
+        request(client, client->in.substr(used, end - used));
+        used = end + 1;
+    }
+    client->in.erase(0, used);
+    return alive;
+}
+
+HarmonyObject * HdbServer::lookup(HdbServerClient *client, const string &path)
+{
+    HarmonyObjectPath p;
+
+    if (path == ".")
+        return db->getRoot();
+    p.parse(path[0] == '.' || client->cwd == "." ? path: client->cwd + "." + path);
+    return db->getObjectByPath(p);
+}
+
+void HdbServer::request(HdbServerClient *client, const string &line)
+{
+    auto fields = words(line);
+
+    if (fields.empty())
+        return;
+    auto number = ++client->requests;
+    requests->add();
+    if (fields[0] == "ping") {
+        respond(client, number, "ok");
+    } else if (fields[0] == "cd") {
+        auto path = fields.size() > 1 ? fields[1]: string(".");
+        auto object = lookup(client, path);
+
+        if (!object) {
+            respond(client, number, "error no " + path);
+            return;
+        }
+        // the path it was found by, the primary path of an object in a context is relative to it
+        if (object == db->getRoot())
+            client->cwd = ".";
+        else if (path[0] == '.')
+            client->cwd = path;
+        else
+            client->cwd = (client->cwd == "." ? "": client->cwd) + "." + path;
+        respond(client, number, "ok " + client->cwd);
+    } else if (fields[0] == "send" && fields.size() > 2) {
+        auto target = lookup(client, fields[1]);
+        auto argument = lookup(client, fields[2]);
+
+        if (target)
+            target = target->getObject();
+        if (!target || !argument) {
+            respond(client, number, "error no " + (target ? fields[2]: fields[1]));
+            return;
+        }
+        if (target->type != HarmonyObject::LAUNCH && target->type != HarmonyObject::RECEIVE && !target->isRemote()) {
+            respond(client, number, "error " + fields[1] + " is no launcher or receiver");
+            return;
+        }
+        auto why = target->isRemote() ? string(): unfit(target, argument);     // a node checks its own
+        if (!why.empty()) {
+            respond(client, number, "error " + fields[2] + " " + why);
+            return;
+        }
+        if (target->type == HarmonyObject::RECEIVE) {  // takes no return, done once delivered
+            engine->sendMessage(target, argument);
+            respond(client, number, "ok");
+            return;
+        }
+        auto receiver = new HarmonyObject(HarmonyObject::Type::RECEIVE);
+        client->receivers->add(receiver, string(), true);
+        receiver->add(new HarmonyObject, "named", true);
+        receiver->add(new HarmonyObject, "unnamed", true);
+        db->clearArguments(receiver);
+        client->pending.push_back(HdbServerRequest {number, receiver, hdbNowNs()});
+        engine->sendMessage(target, argument, receiver);
+    } else {
+        respond(client, number, "error unknown request " + fields[0]);
+    }
+}
+
+void HdbServer::respond(HdbServerClient *client, uint64_t number, const string &text)
+{
+    if (client->fd < 0)
+        return;
+    client->out += to_string(number) + " " + text + "\n";
+    responses->add();
+}
+
+// the receivers that got their replies
+void HdbServer::replies(HdbServerClient *client)
+{
+    for (auto r = client->pending.begin(); r != client->pending.end(); ) {
+        if (!r->receiver->receiver_got) {
+            ++r;
+            continue;
+        }
+        auto named = r->receiver->first(), unnamed = named ? named->nextItem(r->receiver): NULL;
+        unordered_set<HarmonyObject *> visited;
+        string text = "ok (";
+        bool first = true;
+
+        if (named)
+            renderItems(text, named->object, 0, visited, first);
+        if (unnamed)
+            renderItems(text, unnamed->object, 0, visited, first);
+        text += ')';
+        respond(client, r->number, text);
+        latencies->record(hdbNowNs() - r->ns);
+        client->receivers->remove(client->receivers->findItem(r->receiver));
+        r = client->pending.erase(r);
+    }
+}
+
+// false once the client is gone, waits for EPOLLOUT if it can't take it all
+bool HdbServer::write(HdbServerClient *client)
+{
+    size_t written = 0;
+    bool blocked = false;
+
+    while (written < client->out.size()) {
+        auto n = ::send(client->fd, client->out.data() + written, client->out.size() - written, MSG_NOSIGNAL);
+        if (n > 0) {
+            written += n;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            blocked = true;
+            break;
+        }
+        return false;
+    }
+    client->out.erase(0, written);
+    if (blocked != client->writing) {
+        struct epoll_event ev;
+
+        ev.events = blocked ? EPOLLIN | EPOLLOUT: EPOLLIN;
+        ev.data.fd = client->fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+        client->writing = blocked;
+    }
+    return true;
+}
+
+// the context goes once the replies in flight came
+void HdbServer::close(HdbServerClient *client)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    ::close(client->fd);
+    clients.erase(client->fd);
+    client->fd = -1;
+    client->out.clear();
+    connections->sub();
+    if (client->pending.empty())
+        release(client);
+    else
+        closed.push_back(client);
+}
+
+void HdbServer::release(HdbServerClient *client)
+{
+    db->removeContext(client->context);
+    hdb_stats.contexts->sub();
+    delete client;
+}
+
+bool HdbServer::poll(int timeout)
+{
+    struct epoll_event events[HDB_SERVER_EVENTS];
+    bool busy = !engine->run_queue.empty();
+
+    if (busy)
+        timeout = 0;
+    else if (node && (timeout < 0 || timeout > 10))
+        timeout = 10;   // the node's sockets aren't in the epoll set
+    auto n = epoll_wait(epoll_fd, events, HDB_SERVER_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.fd == listen_fd) {
+            accept();
+            continue;
+        }
+        auto c = clients.find(events[i].data.fd);
+        if (c == clients.end())
+            continue;
+        auto client = c->second;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) && !readable(client))
+            close(client);
+        else if (events[i].events & EPOLLOUT && !write(client))
+            close(client);
+    }
+    if (node)
+        node->poll(0);
+    else if (!engine->run_queue.empty())
+        engine->run();
+    vector<HdbServerClient *> all;
+    for (auto &c: clients)
+        all.push_back(c.second);
+    for (auto c: all) {
+        replies(c);
+        if (!c->out.empty() && !write(c))
+            close(c);
+    }
+    for (auto c = closed.begin(); c != closed.end(); ) {
+        replies(*c);
+        if ((*c)->pending.empty()) {
+            release(*c);
+            c = closed.erase(c);
+        } else {
+            ++c;
+        }
+    }
+    return n > 0 || busy;
+}
+
+void HdbServer::serve()
+{
+    if (!engine->slice)
+        engine->slice = HDB_SERVER_SLICE;
+    PF("Serving the clients on %s", address.c_str());
+    fflush(stdout);
+    hdbServe([this] {
+        poll(100);
+        return true;
+    });
+}
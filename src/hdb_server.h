@@ -0,0 +1,90 @@
+#ifndef HDB_SERVER_H
+#define HDB_SERVER_H
+
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <map>
+#include "harmonydb.h"
+
+using namespace std;
+
+struct ExecutionEngine;
+struct HdbNode;
+
+#define HDB_SERVER_SLICE 1000       // instructions of a run between the polls, unless the engine has a slice
+#define HDB_SERVER_EVENTS 64        // epoll events taken at once
+
+// A request waiting for the reply to its receiver
+struct HdbServerRequest
+{
+    uint64_t number;
+    HarmonyObject *receiver;
+    uint64_t ns;                // read then
+};
+
+// A connection, with a context of its own ("client<id>" in .context) and
+// a receiver per send in flight
+struct HdbServerClient
+{
+    unsigned id;
+    int fd;                     // -1 once closed, kept until the replies in flight came
+    string in, out;             // unparsed requests, responses not written yet
+    uint64_t requests;          // numbered from 1
+    string cwd;                 // the base of the relative paths, "." for the root
+    HarmonyObject *context, *receivers;
+    list<HdbServerRequest> pending;
+    bool writing;               // EPOLLOUT is on
+};
+
+// Serves the clients of a unix socket, each one a line protocol of requests
+// answered in any order, by lines starting with the number of the request
+// (the requests of a connection count from 1):
+//   send <launcher> <argument>     "<n> ok <reply>" once the reply comes
+//   send <receiver> <argument>     "<n> ok" once delivered
+//   cd [<path>]                    "<n> ok <path>"
+//   ping                           "<n> ok"
+// or "<n> error <message>". The paths are from the root with a leading ".",
+// from the client's cd otherwise. A client pipelines its sends: every one
+// gets a receiver of its own and the reply is rendered as "(label: value,
+// ...)" with the elements as "type[value]", "_" for nothing, "$" for an
+// empty proxy and "?" for code and for what is too deep or seen already.
+// An argument missing a named argument of a local target, or with nothing
+// in one of its items, is an error rather than a run tripping the engine.
+//
+// One epoll loop polls the sockets and runs the engine in slices, so a
+// long run doesn't keep the connections waiting, and the node's frames
+// between them if the process is a node.
+struct HdbServer
+{
+    HarmonyDB *db;
+    ExecutionEngine *engine;
+    HdbNode *node;
+    int listen_fd, epoll_fd;
+    string address;
+    map<int, HdbServerClient *> clients;       // by fd
+    list<HdbServerClient *> closed;            // waiting for their replies
+    unsigned next_client;
+    HdbCounter *connections, *requests, *responses;
+    HdbHistogram *latencies;
+
+    HdbServer(HarmonyDB *db, ExecutionEngine *engine, HdbNode *node);
+    ~HdbServer();
+
+    bool listen(const string &address);        // "unix:<path>"
+    void serve();               // until SIGTERM or SIGINT
+    bool poll(int timeout);     // ms, true if something was done
+
+private:
+    void accept();
+    bool readable(HdbServerClient *client);
+    void request(HdbServerClient *client, const string &line);
+    void respond(HdbServerClient *client, uint64_t number, const string &text);
+    void replies(HdbServerClient *client);
+    bool write(HdbServerClient *client);
+    void close(HdbServerClient *client);
+    void release(HdbServerClient *client);
+    HarmonyObject * lookup(HdbServerClient *client, const string &path);
+};
+
+#endif
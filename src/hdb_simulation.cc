@@ -0,0 +1,231 @@
+#include <string.h>
+#include <algorithm>
+
+#include "hdb_simulation.h"
+#include "execution_engine.h"
+
+HdbSimulation::HdbSimulation(uint64_t seed)
+    : clock(0), seed(seed), random(seed), latency_min(100), latency_max(100), reorder(0), drop(0), tick(100), sent(0), home(NULL)
+{
+    packets = hdb_stats.counter("divee_sim_packets_total", "Packets, the frames of a flush, sent through the simulated network");
+    packets_dropped = hdb_stats.counter("divee_sim_packets_dropped_total", "Packets lost to the resets of their connections");
+    resets = hdb_stats.counter("divee_sim_resets_total", "Connections the simulated network reset, for a drop or a partition");
+    latencies = hdb_stats.histogram("divee_sim_delivery_seconds", "Virtual time from sending a packet to delivering it", string());
+}
+
+HdbSimulation::~HdbSimulation()
+{
+    for (auto &n: nodes) {
+        if (!n.second.db)
+            continue;
+        delete n.second.node;
+        delete n.second.engine;
+        delete n.second.db;
+    }
+}
+
+// the node of a base of its own, connected to all the others
+HdbNode * HdbSimulation::add(const string &id, const char *filepath, bool lazy)
+{
+    if (nodes.count(id)) {
+        PF("Node %s is in the simulation already", id.c_str());
+        return NULL;
+    }
+    auto db = buildBase(filepath, lazy, false, false, id.c_str());
+    auto engine = new ExecutionEngine(db);
+    auto node = new HdbNode(id, db, engine);
+
+    engine->node = node;
+    attach(node, engine);
+    nodes[id].db = db;
+    nodes[id].next_tick = clock + tick * 1000000ull;
+    return node;
+}
+
+void HdbSimulation::attach(HdbNode *node, ExecutionEngine *engine)
+{
+    for (auto &n: nodes) {
+        n.second.node->addPeer(node->id, "sim:" + node->id);
+        node->addPeer(n.first, "sim:" + n.first);
+    }
+    node->network = this;
+    nodes[node->id] = HdbSimNode {node, NULL, engine, UINT64_MAX};
+    home = node;
+}
+
+void HdbSimulation::partition(const string &a, const string &b)
+{
+    partitions.insert(minmax(a, b));
+    reset(a, b);
+}
+
+void HdbSimulation::heal(const string &a, const string &b)
+{
+    if (a.empty())
+        partitions.clear();
+    else
+        partitions.erase(minmax(a, b));
+}
+
+bool HdbSimulation::partitioned(const string &a, const string &b)
+{
+    return partitions.count(minmax(a, b));
+}
+
+uint64_t HdbSimulation::now()
+{
+    return clock;
+}
+
+uint64_t HdbSimulation::uniform(uint64_t n)
+{
+    return n ? random() % n: 0;
+}
+
+// in millionths, so that the draws don't depend on the floating point
+bool HdbSimulation::chance(double p)
+{
+    return p > 0 && random() % 1000000 < (uint64_t)(p * 1000000);
+}
+
+void HdbSimulation::transmit(HdbNode *from, const string &to, string &frames)
+{
+    auto &link = links[{from->id, to}];
+    uint32_t length;
+
+    link.packets++;
+    link.bytes += frames.size();
+    for (size_t p = 0; p + sizeof(length) <= frames.size(); p += sizeof(length) + length) {
+        memcpy(&length, frames.data() + p, sizeof(length));
+        link.frames++;
+    }
+    packets->add();
+    if (resetting.count(minmax(from->id, to)) || partitioned(from->id, to) || chance(drop)) {
+        link.dropped++;
+        packets_dropped->add();
+        reset(from->id, to);
+        return;
+    }
+    auto &arrival = arrivals[to];
+    uint64_t at = clock + (latency_min + uniform(latency_max > latency_min ? latency_max - latency_min + 1: 0)) * 1000ull;
+    at = max(at, link.last);
+    if (at < arrival && !chance(reorder))
+        at = arrival;
+    link.last = at;
+    arrival = max(arrival, at);
+    flight[{at, sent++}] = HdbSimPacket {from->id, to, frames, clock};
+}
+
+// the packets in flight between the nodes are lost, the nodes close the
+// connection once the running one is done (the sender may be flushing)
+void HdbSimulation::reset(const string &a, const string &b)
+{
+    auto pair = minmax(a, b);
+
+    for (auto p = flight.begin(); p != flight.end(); ) {
+        if (minmax(p->second.from, p->second.to) != pair) {
+            p++;
+            continue;
+        }
+        links[{p->second.from, p->second.to}].dropped++;
+        packets_dropped->add();
+        p = flight.erase(p);
+    }
+    if (resetting.insert(pair).second) {
+        links[{a, b}].resets++;
+        resets->add();
+    }
+}
+
+void HdbSimulation::disconnect()
+{
+    for (auto &r: resetting) {
+        auto a = nodes.find(r.first), b = nodes.find(r.second);
+
+        if (a != nodes.end()) {
+            activate(a->second.node);
+            a->second.node->disconnected(r.second);
+        }
+        if (b != nodes.end()) {
+            activate(b->second.node);
+            b->second.node->disconnected(r.first);
+        }
+    }
+    resetting.clear();
+}
+
+// the replication observer is the running node's, if it replicates
+void HdbSimulation::activate(HdbNode *node)
+{
+    HarmonyObject::_observer = node && !node->replicas.empty() ? node: NULL;
+}
+
+// Delivers the packets and polls the nodes until the time, or until a packet
+// comes for the waiting node, which polls itself then. The nodes built here
+// are polled at their packets and every tick, or right away with a run queue.
+bool HdbSimulation::run(uint64_t until, HdbNode *waiting)
+{
+    bool came = false;
+
+    while (!came) {
+        HdbSimNode *ticking = NULL;
+
+        disconnect();
+        for (auto &n: nodes)
+            if (n.second.db && (!ticking || n.second.next_tick < ticking->next_tick))
+                ticking = &n.second;
+        auto p = flight.begin();
+        if (p != flight.end() && p->first.first <= until && (!ticking || p->first.first <= ticking->next_tick)) {
+            auto packet = move(p->second);
+            auto n = nodes.find(packet.to);
+
+            clock = max(clock, p->first.first);
+            flight.erase(p);
+            if (n == nodes.end()) {
+                links[{packet.from, packet.to}].dropped++;
+                packets_dropped->add();
+                continue;
+            }
+            latencies->record(clock - packet.sent);
+            n->second.node->receive(packet.from, packet.frames);
+            if (n->second.node == waiting) {
+                came = true;
+                continue;
+            }
+            if (!n->second.db)
+                continue;       // attached, reads it when it polls
+            ticking = &n->second;
+        } else if (ticking && ticking->next_tick <= until) {
+            clock = max(clock, ticking->next_tick);
+        } else {
+            clock = max(clock, until);
+            break;
+        }
+        activate(ticking->node);
+        ticking->node->poll(0);
+        ticking->next_tick = ticking->engine->run_queue.empty() ? clock + tick * 1000000ull: clock + 1000;
+    }
+    activate(waiting ? waiting: home);
+    return came;
+}
+
+// an attached node's poll()
+void HdbSimulation::wait(HdbNode *node, int timeout)
+{
+    if (timeout > 0)
+        run(clock + timeout * 1000000ull, node);
+}
+
+void HdbSimulation::print(FILE *f)
+{
+    fprintf(f, "simulation at %.6f s, seed %lu, latency %u-%u us, reorder %g, drop %g, %zu packets in flight\n", clock / 1e9, seed,
+        latency_min, latency_max, reorder, drop, flight.size());
+    for (auto &n: nodes)
+        fprintf(f, "node %s%s, run queue %zu, %zu replies outstanding\n", n.first.c_str(), n.second.db ? "": " (attached)",
+            n.second.engine->run_queue.size(), n.second.node->outstanding());
+    for (auto &p: partitions)
+        fprintf(f, "partition %s | %s\n", p.first.c_str(), p.second.c_str());
+    for (auto &l: links)
+        fprintf(f, "link %s -> %s: %lu packets, %lu frames, %lu bytes, %lu dropped, %lu resets\n", l.first.first.c_str(),
+            l.first.second.c_str(), l.second.packets, l.second.frames, l.second.bytes, l.second.dropped, l.second.resets);
+}
@@ -0,0 +1,100 @@
+#ifndef HDB_SIMULATION_H
+#define HDB_SIMULATION_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <set>
+#include <random>
+#include "hdb_node.h"
+
+using namespace std;
+
+struct ExecutionEngine;
+
+// A node of a simulation, with its own base and engine unless attached
+struct HdbSimNode
+{
+    HdbNode *node;
+    HarmonyDB *db;              // NULL for an attached node, not deleted here
+    ExecutionEngine *engine;
+    uint64_t next_tick;         // ns, the next poll of a node left to itself
+};
+
+// The frames of a flush() in flight
+struct HdbSimPacket
+{
+    string from, to, frames;
+    uint64_t sent;              // ns
+};
+
+// One direction between two nodes
+struct HdbSimLink
+{
+    uint64_t packets, frames, bytes, dropped, resets;
+    uint64_t last;              // ns, delivery of the latest packet, the next ones come after it
+};
+
+// Several nodes in one process, on a virtual clock, exchanging their frames
+// through a simulated network: every flush() of a node is a packet delivered
+// after a latency drawn between latency_min and latency_max. The links are
+// streams, as the nodes expect: a packet comes after those sent before it on
+// its link, and after those sent before it to the same node unless it is
+// reordered. A dropped packet resets the connection instead of leaving a gap:
+// the packets in flight between the two nodes are lost and both nodes close
+// it, to connect again with their next frames. Partitioned nodes can't
+// connect, partition() resets them and so does every packet between them
+// until heal(). The random draws are seeded, the engines take no time and
+// the events of the same time come in the order they were scheduled, so a
+// simulation replays the same way for the same seed and script.
+//
+// The clock only moves in run() and wait(), an attached node waiting in
+// HdbNode::poll() runs the simulation until something comes for it. The
+// nodes built here are polled at their packets and every tick otherwise, as
+// HdbNode::serve() would. They share the statistics (hdb_stats) and the
+// replication observer, which is the polled node's while it runs. The
+// attached nodes have to be deleted before the simulation.
+struct HdbSimulation : HdbNodeNetwork
+{
+    uint64_t clock;             // ns
+    uint64_t seed;
+    mt19937_64 random;
+    unsigned latency_min, latency_max;  // us
+    double reorder, drop;       // probabilities of a packet
+    unsigned tick;              // ms
+    map<string, HdbSimNode> nodes;
+    map<pair<uint64_t, uint64_t>, HdbSimPacket> flight;    // by delivery time and order of sending
+    uint64_t sent;
+    set<pair<string, string>> partitions;                  // node ids, ordered
+    map<pair<string, string>, HdbSimLink> links;           // from, to
+    map<string, uint64_t> arrivals;                        // node id -> delivery of the latest packet to it
+    set<pair<string, string>> resetting;                   // node ids, ordered, closed at the next step of run()
+    HdbNode *home;              // the last attached node, observing between the runs
+    HdbCounter *packets, *packets_dropped, *resets;
+    HdbHistogram *latencies;
+
+    HdbSimulation(uint64_t seed);
+    ~HdbSimulation();
+
+    HdbNode * add(const string &id, const char *filepath, bool lazy = false);
+    void attach(HdbNode *node, ExecutionEngine *engine);
+    void partition(const string &a, const string &b);
+    void heal(const string &a = string(), const string &b = string());     // all without the nodes
+    bool partitioned(const string &a, const string &b);
+    bool run(uint64_t until, HdbNode *waiting = NULL);     // ns, true once something came for the waiting node
+    void print(FILE *f);
+
+    uint64_t now();
+    void transmit(HdbNode *from, const string &to, string &frames);
+    void wait(HdbNode *node, int timeout);
+
+private:
+    void activate(HdbNode *node);
+    void reset(const string &a, const string &b);
+    void disconnect();
+    uint64_t uniform(uint64_t n);
+    bool chance(double p);
+};
+
+#endif
@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <chrono>
+
+#include "hdb_stats.h"
+#include "common.h"
+
+HdbStats hdb_stats;
+
+unsigned hdbStatShard()
+{
+    static atomic<unsigned> next(0);
+    static thread_local unsigned shard = next.fetch_add(1, memory_order_relaxed) % HDB_STAT_SHARDS;
+
+    return shard;
+}
+
+uint64_t hdbNowNs(clockid_t clock)
+{
+    struct timespec t;
+
+    clock_gettime(clock, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+HdbCounter::HdbCounter(Kind kind, const string &name, const string &help, const string &labels)
+    : kind(kind), name(name), help(help), labels(labels)
+{
+    for (auto &s: shards)
+        s.value.store(0, memory_order_relaxed);
+}
+
+void HdbCounter::set(int64_t value)
+{
+    for (unsigned i = 1; i < HDB_STAT_SHARDS; i++)
+        shards[i].value.store(0, memory_order_relaxed);
+    shards[0].value.store(value, memory_order_relaxed);
+}
+
+int64_t HdbCounter::value() const
+{
+    int64_t sum = 0;
+
+    for (auto &s: shards)
+        sum += s.value.load(memory_order_relaxed);
+    return sum;
+}
+
+HdbHistogram::HdbHistogram(const string &name, const string &help, const string &labels)
+    : name(name), help(help), labels(labels)
+{
+    reset();
+}
+
+unsigned HdbHistogram::index(uint64_t value)
+{
+    const unsigned sub_buckets = 1 << HDB_HISTOGRAM_SUB_BITS;
+
+    if (value < sub_buckets)
+        return value;
+    unsigned e = 63 - __builtin_clzll(value);   // >= HDB_HISTOGRAM_SUB_BITS
+    unsigned shift = e - HDB_HISTOGRAM_SUB_BITS;
+    return (shift + 1) * sub_buckets + ((value >> shift) - sub_buckets);
+}
+
+uint64_t HdbHistogram::lowest(unsigned index)
+{
+    const unsigned sub_buckets = 1 << HDB_HISTOGRAM_SUB_BITS;
+
+    if (index < sub_buckets)
+        return index;
+    unsigned shift = index / sub_buckets - 1;
+    return (uint64_t)(sub_buckets + index % sub_buckets) << shift;
+}
+
+void HdbHistogram::record(uint64_t value)
+{
+    buckets[index(value)].fetch_add(1, memory_order_relaxed);
+    count.fetch_add(1, memory_order_relaxed);
+    sum.fetch_add(value, memory_order_relaxed);
+    auto m = max.load(memory_order_relaxed);
+    while (value > m && !max.compare_exchange_weak(m, value, memory_order_relaxed))
+        ;
+}
+
+// the middle of the bucket holding the q-th value, exact for the maximum
+uint64_t HdbHistogram::quantile(double q) const
+{
+    uint64_t total = 0, seen = 0;
+
+    for (auto &b: buckets)
+        total += b.load(memory_order_relaxed);
+    if (!total)
+        return 0;
+    uint64_t rank = q * total;
+    if (rank >= total)
+        return max.load(memory_order_relaxed);
+    for (unsigned i = 0; i < HDB_HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i].load(memory_order_relaxed);
+        if (seen > rank) {
+            auto low = lowest(i), high = lowest(i + 1);
+            auto mid = low + (high - low) / 2;
+            auto m = max.load(memory_order_relaxed);
+            return mid < m ? mid: m;
+        }
+    }
+    return max.load(memory_order_relaxed);
+}
+
+void HdbHistogram::reset()
+{
+    for (auto &b: buckets)
+        b.store(0, memory_order_relaxed);
+    count.store(0, memory_order_relaxed);
+    sum.store(0, memory_order_relaxed);
+    max.store(0, memory_order_relaxed);
+}
+
+HdbStats::HdbStats() : dumper_stop(false)
+{
+    for (unsigned t = 0; t < HDB_TYPES; t++)
+        objects[t] = add(HdbCounter::GAUGE, "divee_objects", "Live objects by type", string("type=\"") + hdb_type_names[t] + "\"");
+    items = add(HdbCounter::GAUGE, "divee_items", "Live set items");
+    relations = add(HdbCounter::GAUGE, "divee_relations", "Live relations");
+    references = add(HdbCounter::GAUGE, "divee_references", "References linked into the reference rings of the objects");
+    run_queue = add(HdbCounter::GAUGE, "divee_run_queue", "Contexts ready to run");
+    wait_queue = add(HdbCounter::GAUGE, "divee_wait_queue", "Contexts waiting for a message");
+    contexts = add(HdbCounter::GAUGE, "divee_contexts", "Contexts created and not finished yet");
+    contexts_created = add(HdbCounter::COUNTER, "divee_contexts_created_total", "Contexts created");
+    contexts_finished = add(HdbCounter::COUNTER, "divee_contexts_finished_total", "Contexts that executed their last instruction");
+    // only the code types are executed
+    for (unsigned t = 0; t < HDB_TYPES; t++)
+        instructions[t] = t >= 4 ? add(HdbCounter::COUNTER, "divee_instructions_total", "Instructions executed by opcode", string("opcode=\"") + hdb_type_names[t] + "\""): NULL;
+    sends = add(HdbCounter::COUNTER, "divee_sends_total", "Messages sent");
+    clones = add(HdbCounter::COUNTER, "divee_cloned_objects_total", "Objects cloned");
+    sweeps = add(HdbCounter::COUNTER, "divee_sweeps_total", "Sweeps started");
+    dumped_bytes = add(HdbCounter::COUNTER, "divee_dumped_bytes_total", "Bytes written by dumpBase");
+}
+
+HdbStats::~HdbStats()
+{
+    stopDumper();
+    for (auto c: counters)
+        delete c;
+    for (auto h: histograms)
+        delete h;
+}
+
+HdbCounter * HdbStats::add(HdbCounter::Kind kind, const string &name, const string &help, const string &labels)
+{
+    lock_guard<mutex> lock(registry_mutex);
+    auto c = new HdbCounter(kind, name, help, labels);
+    counters.push_back(c);
+    return c;
+}
+
+HdbCounter * HdbStats::find(const string &name, const string &labels)
+{
+    lock_guard<mutex> lock(registry_mutex);
+    for (auto c: counters)
+        if (c->name == name && c->labels == labels)
+            return c;
+    return NULL;
+}
+
+HdbCounter * HdbStats::counter(const string &name, const string &help, HdbCounter::Kind kind, const string &labels)
+{
+    lock_guard<mutex> lock(registry_mutex);
+    for (auto c: counters)
+        if (c->name == name && c->labels == labels)
+            return c;
+    auto c = new HdbCounter(kind, name, help, labels);
+    counters.push_back(c);
+    return c;
+}
+
+HdbHistogram * HdbStats::histogram(const string &name, const string &help, const string &labels)
+{
+    lock_guard<mutex> lock(registry_mutex);
+    for (auto h: histograms)
+        if (h->name == name && h->labels == labels)
+            return h;
+    auto h = new HdbHistogram(name, help, labels);
+    // kept grouped by name for print()
+    auto it = histograms.begin();
+    while (it != histograms.end() && (*it)->name != name)
+        it++;
+    while (it != histograms.end() && (*it)->name == name)
+        it++;
+    histograms.insert(it, h);
+    return h;
+}
+
+void HdbStats::resetHistograms()
+{
+    lock_guard<mutex> lock(registry_mutex);
+    for (auto h: histograms)
+        h->reset();
+}
+
+void HdbStats::print(FILE *f)
+{
+    lock_guard<mutex> lock(registry_mutex);
+    const string *last = NULL;
+
+    for (auto c: counters) {
+        if (!last || *last != c->name) { // HELP and TYPE once per family
+            fprintf(f, "# HELP %s %s\n", c->name.c_str(), c->help.c_str());
+            fprintf(f, "# TYPE %s %s\n", c->name.c_str(), c->kind == HdbCounter::COUNTER ? "counter": "gauge");
+            last = &c->name;
+        }
+        if (c->labels.empty())
+            fprintf(f, "%s %ld\n", c->name.c_str(), c->value());
+        else
+            fprintf(f, "%s{%s} %ld\n", c->name.c_str(), c->labels.c_str(), c->value());
+    }
+    // the latencies are summaries in seconds
+    last = NULL;
+    for (auto h: histograms) {
+        const double quantiles[] = {0.5, 0.99, 0.999};
+        auto labels = h->labels.empty() ? string(): h->labels + ",";
+
+        if (!last || *last != h->name) {
+            fprintf(f, "# HELP %s %s\n", h->name.c_str(), h->help.c_str());
+            fprintf(f, "# TYPE %s summary\n", h->name.c_str());
+            last = &h->name;
+        }
+        for (auto q: quantiles)
+            fprintf(f, "%s{%squantile=\"%g\"} %.9f\n", h->name.c_str(), labels.c_str(), q, h->quantile(q) / 1e9);
+        fprintf(f, "%s_sum{%s} %.9f\n", h->name.c_str(), h->labels.c_str(), h->sum.load(memory_order_relaxed) / 1e9);
+        fprintf(f, "%s_count{%s} %lu\n", h->name.c_str(), h->labels.c_str(), h->count.load(memory_order_relaxed));
+    }
+}
+
+bool HdbStats::dump(const string &filepath)
+{
+    auto tmp = filepath + ".tmp";
+    auto f = fopen(tmp.c_str(), "w");
+
+    if (!f)
+        return false;
+    print(f);
+    if (fclose(f) != 0)
+        return false;
+    return rename(tmp.c_str(), filepath.c_str()) == 0;
+}
+
+void HdbStats::startDumper(const string &filepath, unsigned interval)
+{
+    assert(!dumper.joinable());
+    assert(interval > 0);
+    dumper_stop = false;
+    dumper = thread([this, filepath, interval]() {
+        unique_lock<mutex> lock(dumper_mutex);
+        do {
+            if (!dump(filepath))
+                PF("Couldn't write the statistics to %s!", filepath.c_str());
+        } while (!dumper_wakeup.wait_for(lock, chrono::seconds(interval), [this] { return dumper_stop; }));
+        dump(filepath);
+    });
+}
+
+void HdbStats::stopDumper()
+{
+    if (!dumper.joinable())
+        return;
+    {
+        lock_guard<mutex> lock(dumper_mutex);
+        dumper_stop = true;
+    }
+    dumper_wakeup.notify_one();
+    dumper.join();
+}
@@ -0,0 +1,108 @@
+#ifndef HDB_STATS_H
+#define HDB_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "hdb_types.h"
+
+using namespace std;
+
+#define HDB_STAT_SHARDS 8
+
+unsigned hdbStatShard();
+uint64_t hdbNowNs(clockid_t clock = CLOCK_MONOTONIC);  // the time the latencies are measured with
+
+// Counter or gauge split into cache line sized shards, each thread adds to its
+// own one with relaxed atomics, the readers sum them up.
+struct HdbCounter
+{
+    enum Kind {
+        COUNTER,
+        GAUGE
+    } kind;
+    string name, help, labels;
+
+    struct alignas(64) Shard {
+        atomic<int64_t> value;
+    } shards[HDB_STAT_SHARDS];
+
+    HdbCounter(Kind kind, const string &name, const string &help, const string &labels);
+
+    void add(int64_t value = 1) {
+        shards[hdbStatShard()].value.fetch_add(value, memory_order_relaxed);
+    }
+    void sub(int64_t value = 1) {
+        add(-value);
+    }
+    // for the gauges with a single writer only
+    void set(int64_t value);
+    int64_t value() const;
+};
+
+#define HDB_HISTOGRAM_SUB_BITS 5   // 32 sub-buckets per power of two, about 3% precision
+#define HDB_HISTOGRAM_BUCKETS ((64 - HDB_HISTOGRAM_SUB_BITS + 1) << HDB_HISTOGRAM_SUB_BITS)
+
+// HDR style histogram of nanoseconds: log-linear buckets, relaxed atomics.
+struct HdbHistogram
+{
+    string name, help, labels;
+    atomic<uint64_t> buckets[HDB_HISTOGRAM_BUCKETS];
+    atomic<uint64_t> count, sum, max;
+
+    HdbHistogram(const string &name, const string &help, const string &labels);
+
+    static unsigned index(uint64_t value);
+    static uint64_t lowest(unsigned index);     // smallest value of the bucket
+
+    void record(uint64_t value);
+    uint64_t quantile(double q) const;
+    void reset();
+};
+
+struct HdbStats
+{
+    vector<HdbCounter *> counters;      // in the registration order
+    vector<HdbHistogram *> histograms;
+
+    HdbCounter *objects[HDB_TYPES];             // live objects by type
+    HdbCounter *items, *relations, *references; // live items, relations and ring members
+    HdbCounter *run_queue, *wait_queue;
+    HdbCounter *contexts, *contexts_created, *contexts_finished;
+    HdbCounter *instructions[HDB_TYPES];        // by opcode
+    HdbCounter *sends, *clones, *sweeps, *dumped_bytes;
+
+    HdbStats();
+    ~HdbStats();
+
+    HdbCounter * add(HdbCounter::Kind kind, const string &name, const string &help, const string &labels = string());
+    HdbCounter * find(const string &name, const string &labels = string());
+    HdbCounter * counter(const string &name, const string &help, HdbCounter::Kind kind = HdbCounter::COUNTER,
+        const string &labels = string());      // found or added
+    HdbHistogram * histogram(const string &name, const string &help, const string &labels);  // found or added
+    void resetHistograms();
+
+    void print(FILE *f);                        // Prometheus text format
+    bool dump(const string &filepath);          // replaces the file atomically
+
+    // periodic dump
+    void startDumper(const string &filepath, unsigned interval);
+    void stopDumper();
+
+private:
+    mutex registry_mutex;               // the vectors grow while the dumper prints
+    thread dumper;
+    mutex dumper_mutex;
+    condition_variable dumper_wakeup;
+    bool dumper_stop;
+};
+
+extern HdbStats hdb_stats;
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef HDB_TYPES_H
+#define HDB_TYPES_H
+
+// The names of the HarmonyObject::Type values, the opcodes of the code
+// ones, for the statistics, the census, the memory accounts and perf.
+// Apart from harmonydb.h so that those headers can size their arrays.
+#define HDB_TYPES 15        // HarmonyObject::Type values
+
+inline const char * const hdb_type_names[HDB_TYPES] = {
+    "nul", "element", "type", "proxy", "match", "create", "assign", "add",
+    "remove", "launch", "receive", "send", "link", "relate", "pattern"
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <charconv>
+
+#include "hdb_writer.h"
+#include "common.h"
+
+HdbWriter::HdbWriter()
+{
+    fd = -1;
+    buffer = NULL;
+    length = 0;
+    capacity = 0;
+    written = 0;
+    reserve(flush_size * 2);
+}
+
+HdbWriter::~HdbWriter()
+{
+    assert(length == 0);
+    free(buffer);
+}
+
+void HdbWriter::open(int fd)
+{
+    assert(length == 0);
+    this->fd = fd;
+}
+
+void HdbWriter::close()
+{
+    flush();
+    if (fd != STDOUT_FILENO)
+        ::close(fd);
+    fd = -1;
+}
+
+void HdbWriter::flush()
+{
+    size_t offset = 0;
+
+    while (offset < length) {
+        auto n = write(fd, buffer + offset, length - offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        assertf(n > 0, "Write failed: %s", strerror(errno));
+        offset += n;
+    }
+    written += length;
+    length = 0;
+}
+
+void HdbWriter::reserve(size_t size)
+{
+    if (size <= capacity)
+        return;
+    while (capacity < size)
+        capacity = capacity ? capacity * 2: 4096;
+    buffer = (char *)realloc(buffer, capacity);
+    assert(buffer);
+}
+
+void HdbWriter::append(int64_t value)
+{
+    char s[24];
+    auto r = to_chars(s, s + sizeof(s), value);
+
+    append(s, r.ptr - s);
+}
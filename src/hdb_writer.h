@@ -0,0 +1,43 @@
+#ifndef HDB_WRITER_H
+#define HDB_WRITER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+// Growable output buffer written to a file descriptor in big chunks. The
+// buffer is kept between files, only the descriptor changes.
+struct HdbWriter
+{
+    int fd;
+    char *buffer;
+    size_t length, capacity;
+    uint64_t written;
+
+    HdbWriter();
+    ~HdbWriter();
+
+    void open(int fd);
+    void close();
+    void flush();
+    void reserve(size_t size);
+
+    void append(const char *s, size_t n) {
+        if (length + n > capacity)
+            reserve(length + n);
+        memcpy(buffer + length, s, n);
+        length += n;
+        if (length >= flush_size)
+            flush();
+    }
+    void append(const char *s) { append(s, strlen(s)); }
+    void append(const string &s) { append(s.data(), s.size()); }
+    void append(char c) { append(&c, 1); }
+    void append(int64_t value);
+
+    static const size_t flush_size = 1 << 20;
+};
+
+#endif
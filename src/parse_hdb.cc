@@ -6,8 +6,12 @@
 #include <sys/stat.h>
 
 #include <dirent.h>
+#include <ctype.h>
+
+#include <time.h>
 
 #include "hdb_driver.h"
+#include "hdb_direct_driver.h"
 #include "hdb_objects.h"
 #include "harmonydb.h"
 #include "common.h"
@@ -55,36 +59,92 @@ HdbObjectProxy::~HdbObjectProxy()
         delete reference;
 }
 
-HarmonyObject * getObjectByReference(HarmonyDB *db, HdbSymbolReference *reference, HdbObject *start)
+void HdbSymbolTable::add(HdbObject *scope, HdbObject *child)
+{
+    if (!child->label.empty())
+        children.emplace(HdbSymbolKey{scope, child->label}, child);
+}
+
+HdbObject * HdbSymbolTable::findChild(HdbObject *scope, const string &label)
+{
+    auto it = children.find(HdbSymbolKey{scope, label});
+
+    return it != children.end() ? it->second: NULL;
+}
+
+static string symbolPath(HdbSymbolReference *reference)
+{
+    string path;
+
+    if (reference->absolute)
+        path = ".";
+    for (auto &p: *reference->path) {
+        path += p;
+        path += '.';
+    }
+    return path;
+}
+
+HarmonyObject * getObjectByReference(HarmonyDB *db, HdbSymbolReference *reference, HdbObject *start, HdbSymbolTable *symbols)
 {
     HarmonyObject *last_start_object = NULL;
     HarmonyObjectPath path;
     HarmonyObject *destination;
+    HdbSymbolKey key;
 
     // PF("%p:%p:%C %p[%s] %p", reference, reference->path, reference->absolute ? 'a': 'r', start, start->label.c_str(), start->harmony_object);
 
     if (!reference->path)
         return db->root.object;
 
+    if (symbols) {
+        // leaves without a matching label resolve like their parents
+        if (!reference->absolute) {
+            auto &first = reference->path->front();
+            while (start->children.empty() && start->label != first && start->parent)
+                start = start->parent;
+        }
+        key.scope = reference->absolute ? NULL: start;
+        key.path = symbolPath(reference);
+        auto it = symbols->resolved.find(key);
+        if (it != symbols->resolved.end()) {
+            symbols->hits++;
+            return it->second;
+        }
+        symbols->misses++;
+    }
+
     path = *reference->path;
+    destination = NULL;
     if (!reference->absolute) {
         auto pi = path.begin();
 
         do {
+            HdbObject *o = NULL;
+
             // PF("%p [%s]", start, pi->c_str());
-            for (auto o : start->children) {
-                // PF("%p %p [%s] [%s]", start, o, o->label.c_str(), pi->c_str());
-                if (o->label == *pi) {
-                    // PF("Found");
-                    pi++;
-                    if (pi == path.end()) {
-                        // PF("Found %p", o->harmony_object);
-                        return o->harmony_object;
+            if (symbols) {
+                o = symbols->findChild(start, *pi);
+            } else {
+                for (auto c : start->children) {
+                    // PF("%p %p [%s] [%s]", start, c, c->label.c_str(), pi->c_str());
+                    if (c->label == *pi) {
+                        o = c;
+                        break;
                     }
-                    start = o;
-                    goto out;
                 }
             }
+            if (o) {
+                // PF("Found");
+                pi++;
+                if (pi == path.end()) {
+                    // PF("Found %p", o->harmony_object);
+                    destination = o->harmony_object;
+                    goto found;
+                }
+                start = o;
+                continue;
+            }
             last_start_object = start->harmony_object;
             // PF("%p %p %p [%s]", start, start->harmony_object, start->parent, start->label.c_str());
             if (start->label == *pi) {
@@ -92,13 +152,12 @@ HarmonyObject * getObjectByReference(HarmonyDB *db, HdbSymbolReference *referenc
                     pi++;
                     if (pi == path.end()) {
                         // PF("Found %p", o->harmony_object);
-                        return start->harmony_object;
+                        destination = start->harmony_object;
+                        goto found;
                     }
                     continue;
             }
             start = start->parent;
-out:
-            ;
         } while (start);
     }
 
@@ -111,10 +170,13 @@ out:
     destination = db->getObjectByPath(path, last_start_object);
     // PF("Destination [%s] %p", path.toString().c_str(), destination);
     assertf(destination, "Destination object [%c%s] not found!", reference->absolute ? '.': ' ', path.toString().c_str());
+found:
+    if (symbols && !symbols->stubs.count(destination))
+        symbols->resolved[key] = destination;
     return destination;
 }
 
-void hdbIterate(HarmonyDB *db, struct HdbObject *object, bool isroot = false)
+void hdbIterate(HarmonyDB *db, HdbSymbolTable *symbols, struct HdbObject *object, bool isroot = false)
 {
     if (auto o = dynamic_cast<HdbObjectElement *>(object)) {
         auto element = new HarmonyObject(HarmonyObject::Type::ELEMENT);
@@ -142,11 +204,12 @@ void hdbIterate(HarmonyDB *db, struct HdbObject *object, bool isroot = false)
     } else if (auto o = dynamic_cast<HdbObjectReference *>(object)) {
         auto *stub = new HarmonyObject;
         object->harmony_object = stub;
+        symbols->stubs.insert(stub);
     } else if (auto o = dynamic_cast<HdbObjectProxy *>(object)) {
         auto *proxy = new HarmonyObject(HarmonyObject::Type::PROXY);
         if (auto r = dynamic_cast<HdbObjectReference *>(o->reference)) {
         } else if (o->reference != NULL) {
-            hdbIterate(db, o->reference);
+            hdbIterate(db, symbols, o->reference);
             proxy->link(o->reference->harmony_object);
         }
         object->harmony_object = proxy;
@@ -166,7 +229,8 @@ void hdbIterate(HarmonyDB *db, struct HdbObject *object, bool isroot = false)
     if (isroot)
         object->harmony_object->root_distance = 1;
     for (auto it: object->children) {
-        hdbIterate(db, it);
+        hdbIterate(db, symbols, it);
+        symbols->add(object, it);
         if (auto r = dynamic_cast<HarmonyRelation *>(it->harmony_object)) {
             // PF("ADD REL");
             object->harmony_object->addRelation(r, !it->temporary ? it->label: string());
@@ -185,19 +249,19 @@ HarmonyObjectPath createPath(const HdbPath &path)
     return new_path;
 }
 
-void hdbResolveReferences(struct HarmonyDB *db, int level, struct HarmonyObject *parent, struct HdbObject *object)
+void hdbResolveReferences(struct HarmonyDB *db, HdbSymbolTable *symbols, int level, struct HarmonyObject *parent, struct HdbObject *object)
 {
     if (auto o = dynamic_cast<HdbObjectElement *>(object)) {
-        auto type = getObjectByReference(db, o->set, object);
+        auto type = getObjectByReference(db, o->set, object, symbols);
         assert(type);
         object->harmony_object->element_type.setReference(type);
     } else if (auto o = dynamic_cast<HdbObjectProxy *>(object)) {
         if (o->reference) {
             if (auto r = dynamic_cast<HdbObjectReference *>(o->reference)) {
-                auto ref = getObjectByReference(db, r->reference, object);
+                auto ref = getObjectByReference(db, r->reference, object, symbols);
                 object->harmony_object->link(ref);
             } else {
-                hdbResolveReferences(db, level + 1, object->harmony_object, o->reference);
+                hdbResolveReferences(db, symbols, level + 1, object->harmony_object, o->reference);
             }
         }
     // } else if (auto o = dynamic_cast<HdbObjectCode *>(object)) {
@@ -212,44 +276,56 @@ void hdbResolveReferences(struct HarmonyDB *db, int level, struct HarmonyObject
     } else if (auto o = dynamic_cast<HdbObjectRelation *>(object)) {
         // PF("%p %p %p", parent, o->harmony_relation, o->harmony_relation->owner);
         if (!o->owner) {
-            o->harmony_relation->relation.setReference(getObjectByReference(db, o->relation, object));
-            o->harmony_relation->source.setReference(getObjectByReference(db, o->source, object));
-            o->harmony_relation->destination.setReference(getObjectByReference(db, o->destination, object));
+            o->harmony_relation->relation.setReference(getObjectByReference(db, o->relation, object, symbols));
+            o->harmony_relation->source.setReference(getObjectByReference(db, o->source, object, symbols));
+            o->harmony_relation->destination.setReference(getObjectByReference(db, o->destination, object, symbols));
         } else {
             auto p = o->harmony_object;
-            p->relation.setReference(getObjectByReference(db, o->relation, object));
-            p->source.setReference(getObjectByReference(db, o->source, object));
-            p->destination.setReference(getObjectByReference(db, o->destination, object));
-            p->pattern_owner.setReference(getObjectByReference(db, o->owner, object));
+            p->relation.setReference(getObjectByReference(db, o->relation, object, symbols));
+            p->source.setReference(getObjectByReference(db, o->source, object, symbols));
+            p->destination.setReference(getObjectByReference(db, o->destination, object, symbols));
+            p->pattern_owner.setReference(getObjectByReference(db, o->owner, object, symbols));
         }
     } else if (auto o = dynamic_cast<HdbObjectReference *>(object)) {
         HarmonyObject *destination;
 
-        destination = getObjectByReference(db, o->reference, object);
+        destination = getObjectByReference(db, o->reference, object, symbols);
+        symbols->stubs.erase(object->harmony_object);
         db->substituteObject(object->harmony_object, destination);
+        object->harmony_object = destination;
     }
     for (auto it: object->children) {
-        hdbResolveReferences(db, level + 1, object->harmony_object, it);
+        hdbResolveReferences(db, symbols, level + 1, object->harmony_object, it);
     }
 }
 
-void HarmonyDB::loadFile(string filepath, HarmonyObject *root, string relative_path)
+void HarmonyDB::loadFile(string filepath, HarmonyObject *root, string relative_path, HarmonyObject *stub)
 {
     list<HdbObject *> *hdb_objects;
     hdb_driver drv;
+    HdbSymbolTable symbols;
     int i;
     FILE *file;
 
+    if (direct_loader) {
+        loadFileDirect(filepath, root, relative_path, stub);
+        return;
+    }
     file = fopen((filepath + relative_path).c_str(), "r");
     assert(file);
 
     PF("Loading %s%s...", filepath.c_str(), relative_path.c_str());
+    drv.use_mmap = mmap_scanner;
     i = drv.parse(file);
     assert(i == 0);
     hdb_objects = drv.root;
     for (auto o: *hdb_objects) {
-        hdbIterate(this, o, root == NULL);
-        if (root)
+        hdbIterate(this, &symbols, o, root == NULL);
+        if (stub) { // lazily registered file, fill in the stub
+            adoptObject(stub, o->harmony_object);
+            o->harmony_object = stub;
+            stub = NULL;
+        } else if (root)
             root->add(o->harmony_object, o->label, true);
         else
             setRoot(o->harmony_object);
@@ -257,17 +333,210 @@ void HarmonyDB::loadFile(string filepath, HarmonyObject *root, string relative_p
         o->harmony_object->hints[HINT_FILEPATH] = relative_path;
         local_root = root;
         PF("Resolve references [%s]", root ? o->label.c_str(): ".");
-        hdbResolveReferences(this, 0, NULL, o);
+        hdbResolveReferences(this, &symbols, 0, NULL, o);
         delete o;
     }
     delete hdb_objects;
+    symbol_hits += symbols.hits;
+    symbol_misses += symbols.misses;
+    // PF("Symbols: %u hits, %u misses", symbols.hits, symbols.misses);
+}
+
+void HarmonyDB::loadFileDirect(string filepath, HarmonyObject *root, string relative_path, HarmonyObject *stub)
+{
+    hdb_direct_driver drv(this);
+    int i;
+    FILE *file;
+
+    file = fopen((filepath + relative_path).c_str(), "r");
+    assert(file);
+
+    PF("Loading %s%s (single pass)...", filepath.c_str(), relative_path.c_str());
+    drv.scanner.use_mmap = mmap_scanner;
+    i = drv.parse(file);
+    assert(i == 0);
+    for (auto &e: *drv.root) {
+        auto o = e.object;
+
+        if (stub) { // lazily registered file, fill in the stub
+            adoptObject(stub, o);
+            drv.replaceObject(o, stub);
+            o = stub;
+            stub = NULL;
+        } else if (root)
+            root->add(o, e.label, true);
+        else {
+            setRoot(o);
+            for (auto i = o->first(); i; i = i->nextItem(o))
+                i->object->updateDistance(i->object);
+        }
+        o->hints[HINT_BACKEND] = HINT_BACKEND_FILE;
+        o->hints[HINT_FILEPATH] = relative_path;
+        drv.tops.push_back(o);
+    }
+    delete drv.root;
+    local_root = root;
+    drv.resolve();
+}
+
+// reads the label of the first expression in the file without parsing it
+static string peekLabel(const string &filepath)
+{
+    string label;
+    FILE *file;
+    int c;
+
+    file = fopen(filepath.c_str(), "r");
+    assertf(file, "Couldn't open %s!", filepath.c_str());
+    while ((c = fgetc(file)) != EOF) {
+        if (isspace(c))
+            continue;
+        if (c == '/') { // comment
+            while ((c = fgetc(file)) != EOF && c != '\n')
+                ;
+            continue;
+        }
+        if (c == '.')
+            c = fgetc(file);
+        while (c != EOF && (isalnum(c) || c == '_')) {
+            label += c;
+            c = fgetc(file);
+        }
+        while (c != EOF && isspace(c))
+            c = fgetc(file);
+        if (c != ':') // not labeled
+            label.clear();
+        break;
+    }
+    fclose(file);
+    return label;
+}
+
+void HarmonyDB::registerStub(HarmonyObject *stub)
+{
+    stub->lazy_loader = this;
+    lazy_stubs.insert(stub);
+}
+
+void HarmonyDB::unregisterStub(HarmonyObject *stub)
+{
+    assert(stub->lazy_loader == this);
+    stub->lazy_loader = NULL;
+    lazy_stubs.erase(stub);
+}
+
+void HarmonyDB::loadStub(HarmonyObject *stub)
+{
+    HarmonyObject *parent = NULL;
+
+    for (auto r = stub->reference.next; r != &stub->reference; r = r->next) {
+        if (r->primary) {
+            parent = static_cast<HarmonyItem *>(r)->parent;
+            break;
+        }
+    }
+    assert(parent);
+    unregisterStub(stub);
+    stubs_loaded++;
+    loadFile(base_path, parent, stub->getHint(HINT_FILEPATH), stub);
+}
+
+void HarmonyDB::loadStubs()
+{
+    while (!lazy_stubs.empty())
+        loadStub(*lazy_stubs.begin());
+}
+
+// moves the contents of a freshly loaded object into the stub registered for its file
+void HarmonyDB::adoptObject(HarmonyObject *stub, HarmonyObject *object)
+{
+    assert(object->reference.isEmpty());
+    assertf(!object->isElement() && !object->isProxy() && !object->isPattern() && !dynamic_cast<HarmonyRelation *>(object),
+        "Lazily loaded file must start with a set or code!");
+    assert(stub->isEmpty() && stub->relations.next == &stub->relations);
+
+    stub->setType(object->type);
+    stub->type_lower = object->type_lower;
+    stub->type_higher = object->type_higher;
+    for (auto h: object->hints)
+        stub->hints[h.first] = h.second;
+
+    if (!object->isEmpty()) {
+        for (auto i = object->items.next; i != &object->items; i = i->next)
+            i->parent = stub;
+        stub->items.next = object->items.next;
+        stub->items.prev = object->items.prev;
+        stub->items.next->prev = &stub->items;
+        stub->items.prev->next = &stub->items;
+        object->items.next = &object->items;
+        object->items.prev = &object->items;
+    }
+    if (object->relations.next != &object->relations) {
+        for (auto i = object->relations.next; i != &object->relations; i = i->next) {
+            i->parent = stub;
+            static_cast<HarmonyRelation *>(i->object)->owner = stub;
+        }
+        stub->relations.next = object->relations.next;
+        stub->relations.prev = object->relations.prev;
+        stub->relations.next->prev = &stub->relations;
+        stub->relations.prev->next = &stub->relations;
+        object->relations.next = &object->relations;
+        object->relations.prev = &object->relations;
+    }
+    delete object;
+
+    for (auto i = stub->first(); i; i = i->nextItem(stub))
+        i->object->updateDistance(i->object);
+}
+
+// Loads placement.hdb of a partitioned base first, its hints map the
+// subtrees of the root to the nodes owning them:
+//     placement: _ #"users":"n1" #"orders":"n2"
+// The files of the subtrees of the other nodes aren't loaded, remote
+// proxies take their places before any reference to them is resolved.
+// The subtrees missing from the map are loaded by every node.
+void HarmonyDB::placeShards(const string &filepath, HarmonyObject *root, unordered_set<string> &placed)
+{
+    struct stat sb;
+    DIR *dir;
+
+    if (stat((filepath + "/placement.hdb").c_str(), &sb) != 0)
+        return;
+    loadFile(filepath, root, "/placement.hdb");
+    placed.insert("placement.hdb");
+    auto p = root->findItem("placement");
+    assertf(p, "%s/placement.hdb doesn't define placement!", filepath.c_str());
+    for (auto &h: p->object->hints)
+        if (h.first != HINT_BACKEND && h.first != HINT_FILEPATH)
+            placement[h.first] = h.second;
+
+    dir = opendir(filepath.c_str());
+    if (!dir)
+        return;
+    while (auto entry = readdir(dir)) {
+        string fname = entry->d_name;
+
+        if (fname[0] == '.' || entry->d_type == DT_DIR || placed.count(fname) ||
+                fname.length() <= 4 || fname.substr(fname.length() - 4) != ".hdb")
+            continue;
+        auto label = peekLabel(filepath + "/" + fname);
+        auto owner = placement.find(label);
+        if (owner != placement.end() && owner->second != node) {
+            root->add(remoteObject(owner->second, "." + label), label, true);
+            placed.insert(fname);
+        }
+    }
+    closedir(dir);
 }
 
 void HarmonyDB::loadDir(string filepath, HarmonyObject *root, string relative_path)
 {
+    unordered_set<string> placed;   // files loaded or left to the other nodes already
     DIR *dir;
 
     // PF(" [%s] %p", filepath.c_str(), root);
+    if (relative_path.empty() && !node.empty())
+        placeShards(filepath, root, placed);
     dir = opendir((filepath + relative_path).c_str());
     if (dir) {
         struct dirent *entry;
@@ -279,11 +548,18 @@ void HarmonyDB::loadDir(string filepath, HarmonyObject *root, string relative_pa
                 HarmonyObject *o;
                 string fname = string(entry->d_name);
 
-                if (fname.length() > 4 && fname.substr(fname.length() - 4) == ".hdb") {
+                if (fname.length() > 4 && fname.substr(fname.length() - 4) == ".hdb" && !placed.count(fname)) {
                     object_path.push_back(entry->d_name);
                     o = getObjectByPath(object_path, root);
                     assert(!o);
-                    loadFile(filepath, root, relative_path + "/" + entry->d_name);
+                    if (lazy) { // parsed on first access
+                        auto stub = new HarmonyObject;
+                        stub->hints[HINT_BACKEND] = HINT_BACKEND_FILE;
+                        stub->hints[HINT_FILEPATH] = relative_path + "/" + entry->d_name;
+                        root->add(stub, peekLabel(filepath + relative_path + "/" + entry->d_name), true);
+                        registerStub(stub);
+                    } else
+                        loadFile(filepath, root, relative_path + "/" + entry->d_name);
                 }
             }
         }
@@ -308,21 +584,39 @@ void HarmonyDB::loadDir(string filepath, HarmonyObject *root, string relative_pa
     }
 }
 
-HarmonyDB * buildBase(const char *filepath)
+HarmonyDB * buildBase(const char *filepath, bool lazy, bool direct_loader, bool mmap_scanner, const char *node)
 {
     HarmonyDB *db;
     struct stat sb;
+    struct timespec start, end;
 
     assertf(stat(filepath, &sb) == 0, "Couldn't stat %s!", filepath);
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     db = new HarmonyDB;
+    HdbMemScope scope(db->account);
+    db->base_path = filepath;
+    db->lazy = lazy;
+    db->direct_loader = direct_loader;
+    db->mmap_scanner = mmap_scanner;
+    if (node)
+        db->node = node;
+    if (db->account != &hdb_memory.base)
+        db->account->name += string(" ") + (node ? node: filepath);
     if ((sb.st_mode & S_IFMT) == S_IFDIR) {
         auto root = new HarmonyObject;
         db->setRoot(root);
         db->loadDir(filepath, root);
+        if (lazy)
+            PF("Lazy stubs: %lu", db->lazy_stubs.size());
     } else if ((sb.st_mode & S_IFMT) == S_IFREG) {
         db->loadFile(filepath, NULL);
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    PF("Loaded %u objects in %.3f ms", HarmonyObject::_object_count,
+        (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    if (!direct_loader)
+        PF("Symbol cache: %u hits, %u misses", db->symbol_hits, db->symbol_misses);
 
     return db;
 }
@@ -0,0 +1,510 @@
+// Runs the regression tests, every one a directory holding:
+//   base.hdb       the base, or
+//   base/          a directory base, or
+//   gen.args       the divee_gen arguments of a generated one
+//   input.txt      the shell script
+//   expected.txt   the golden dump after the script, or
+//   expected.fnv   its FNV-1a hash for the large bases
+//   budget.txt     "time_ms", "allocated" and "rss_kb" limits, one per line
+//   flags.txt      more divee arguments, e.g. --lazy
+//   nodes.txt      "<node id> <base>" of the other nodes, one per line,
+//                  served on unix sockets while the script runs as node "main"
+//   replicas.txt   "<node id> <file>" of the files of main's dump that have
+//                  to equal the node's dump at its exit, e.g. of a replica
+//   output.lines   lines divee's output has to have, in this order
+//   clients.txt    requests to a --clients server instead of the script, sent
+//                  pipelined on one connection; their responses, by request
+//                  number, come before the dump (taken at the server's exit)
+// With --simulate <seed> in flags.txt the nodes run in the process of main,
+// on the simulated network (--sim-node), and dump their bases after the script.
+// The dump has the object keys (their addresses) renumbered in the order of
+// their appearance.
+// divee_test --divee <divee> [--gen <divee_gen>] [--update] <test dir>...
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <ftw.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <unordered_map>
+
+using namespace std;
+
+static const char *divee_path, *gen_path;
+static bool update;
+
+static bool readFile(const string &filepath, string &content)
+{
+    auto f = fopen(filepath.c_str(), "r");
+    char buffer[65536];
+    size_t n;
+
+    if (!f)
+        return false;
+    content.clear();
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        content.append(buffer, n);
+    fclose(f);
+    return true;
+}
+
+static bool writeFile(const string &filepath, const string &content)
+{
+    auto f = fopen(filepath.c_str(), "w");
+
+    if (!f)
+        return false;
+    fwrite(content.data(), 1, content.size(), f);
+    return fclose(f) == 0;
+}
+
+static bool exists(const string &filepath)
+{
+    struct stat sb;
+
+    return stat(filepath.c_str(), &sb) == 0;
+}
+
+static vector<string> split(const string &s)
+{
+    vector<string> fields;
+    size_t i = 0;
+
+    for (;;) {
+        i = s.find_first_not_of(" \t\n", i);
+        if (i == string::npos)
+            return fields;
+        auto end = s.find_first_of(" \t\n", i);
+        fields.push_back(s.substr(i, end - i));
+        i = end;
+    }
+}
+
+// starts argv with stdout and stderr to output
+static pid_t spawn(const vector<string> &args, const string &output)
+{
+    vector<char *> argv;
+
+    for (auto &a: args)
+        argv.push_back(const_cast<char *>(a.c_str()));
+    argv.push_back(NULL);
+    fflush(stdout);
+    auto pid = fork();
+    if (pid == 0) {
+        int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+        execv(argv[0], argv.data());
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int wait(pid_t pid, struct rusage *usage)
+{
+    int status;
+
+    if (pid < 0 || wait4(pid, &status, 0, usage) != pid)
+        return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status): 128 + WTERMSIG(status);
+}
+
+// runs argv with stdout and stderr to output, returns the exit status
+static int run(const vector<string> &args, const string &output, struct rusage *usage)
+{
+    return wait(spawn(args, output), usage);
+}
+
+struct Node {
+    string id, socket;
+    pid_t pid;
+};
+
+// the nodes of nodes.txt serving their bases, false unless all of them listen
+static bool startNodes(const string &test, const string &tmp, const string &text, const vector<string> &flags, vector<Node> &nodes,
+    bool dumping)
+{
+    auto fields = split(text);
+
+    for (size_t i = 0; i + 1 < fields.size(); i += 2) {
+        auto socket = tmp + "/" + fields[i] + ".sock";
+        vector<string> args {divee_path};
+        args.insert(args.end(), flags.begin(), flags.end());
+        if (dumping)
+            args.insert(args.end(), {"--dump-at-exit", tmp + "/" + fields[i] + ".dump"});
+        args.insert(args.end(), {"--node", fields[i], "--listen", "unix:" + socket, "--serve", test + "/" + fields[i + 1]});
+        auto pid = spawn(args, tmp + "/" + fields[i] + ".txt");
+        nodes.push_back(Node {fields[i], socket, pid});
+    }
+    for (auto &n: nodes) {
+        for (unsigned ms = 0; !exists(n.socket); ms += 10) {
+            if (ms >= 5000 || waitpid(n.pid, NULL, WNOHANG) == n.pid)
+                return false;
+            usleep(10000);
+        }
+    }
+    return true;
+}
+
+// the exit status of the first node that didn't exit cleanly
+static int stopNodes(vector<Node> &nodes, string &id)
+{
+    struct rusage usage;
+    int failed = 0;
+
+    for (auto &n: nodes)
+        kill(n.pid, SIGTERM);
+    for (auto &n: nodes) {
+        auto status = wait(n.pid, &usage);
+        if (status && !failed) {
+            failed = status;
+            id = n.id;
+        }
+    }
+    nodes.clear();
+    return failed;
+}
+
+// sends the requests to the server at socket and collects a response per
+// request, sorted by their numbers, false if they didn't all come in 5 s
+static bool talk(const string &socket, const string &requests, string &responses)
+{
+    struct sockaddr_un sa;
+    map<unsigned long, string> lines;
+    size_t expected = 0, used = 0, end;
+    string in;
+    char buffer[65536];
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, socket.c_str(), sizeof(sa.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    for (size_t b = 0; (end = requests.find('\n', b)) != string::npos; b = end + 1)
+        if (requests.find_first_not_of(" \t\r", b) < end)
+            expected++;
+    if (write(fd, requests.data(), requests.size()) != (ssize_t)requests.size()) {
+        close(fd);
+        return false;
+    }
+    for (unsigned ms = 0; lines.size() < expected && ms < 5000; ms += 10) {
+        struct pollfd pfd {fd, POLLIN, 0};
+
+        if (poll(&pfd, 1, 10) <= 0)
+            continue;
+        auto n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0)
+            break;
+        in.append(buffer, n);
+        while ((end = in.find('\n', used)) != string::npos) {
+            lines[strtoul(in.c_str() + used, NULL, 10)] = in.substr(used, end + 1 - used);
+            used = end + 1;
+        }
+    }
+    close(fd);
+    for (auto &l: lines)
+        responses += l.second;
+    return lines.size() == expected;
+}
+
+// runs the server of a clients.txt test until the responses came, returns
+// its exit status at SIGTERM
+static int serveClients(const vector<string> &args, const string &tmp, const string &requests, string &responses, struct rusage *usage)
+{
+    auto socket = tmp + "/clients.sock";
+    auto pid = spawn(args, tmp + "/output.txt");
+
+    for (unsigned ms = 0; !exists(socket); ms += 10) {
+        if (ms >= 5000 || waitpid(pid, NULL, WNOHANG) == pid) {
+            kill(pid, SIGKILL);
+            wait(pid, usage);
+            return -1;
+        }
+        usleep(10000);
+    }
+    if (!talk(socket, requests, responses))
+        writeFile(tmp + "/responses.txt", responses);
+    kill(pid, SIGTERM);
+    return wait(pid, usage);
+}
+
+static vector<string> dump_files;
+
+static int collectFile(const char *filepath, const struct stat *sb, int type, struct FTW *ftw)
+{
+    if (type == FTW_F)
+        dump_files.push_back(filepath);
+    return 0;
+}
+
+static int removeFile(const char *filepath, const struct stat *sb, int type, struct FTW *ftw)
+{
+    return remove(filepath);
+}
+
+static void normalizeKeys(const string &content, unordered_map<string, unsigned> &keys, string &all)
+{
+    for (size_t i = 0; i < content.size(); ) {
+        if (content.compare(i, 3, "K0x") == 0) {
+            auto end = content.find('K', i + 3);
+            if (end != string::npos && end - i < 24) {
+                auto k = keys.emplace(content.substr(i, end - i + 1), keys.size() + 1).first;
+                all += "K" + to_string(k->second) + "K";
+                i = end + 1;
+                continue;
+            }
+        }
+        all += content[i++];
+    }
+}
+
+// the files of the dump directory by name, keys renumbered
+static string normalizedDump(const string &directory)
+{
+    unordered_map<string, unsigned> keys;
+    string all, content;
+
+    dump_files.clear();
+    nftw(directory.c_str(), collectFile, 16, FTW_PHYS);
+    sort(dump_files.begin(), dump_files.end());
+    for (auto &filepath: dump_files) {
+        all += "=== " + filepath.substr(directory.size() + 1) + "\n";
+        readFile(filepath, content);
+        normalizeKeys(content, keys, all);
+    }
+    return all;
+}
+
+// one file of a dump, keys renumbered, empty if there's none
+static string normalizedFile(const string &filepath)
+{
+    unordered_map<string, unsigned> keys;
+    string all, content;
+
+    if (readFile(filepath, content))
+        normalizeKeys(content, keys, all);
+    return all;
+}
+
+static string fnv(const string &s)
+{
+    uint64_t h = 14695981039346656037ull;
+    char hex[17];
+
+    for (unsigned char c: s) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    snprintf(hex, sizeof(hex), "%016lx", h);
+    return hex;
+}
+
+// the script's totals are the last line of the report
+static uint64_t reportValue(const string &report, const char *key)
+{
+    auto line = report.rfind("{\"commands\"");
+    if (line == string::npos)
+        return 0;
+    auto i = report.find(string("\"") + key + "\": ", line);
+    if (i == string::npos)
+        return 0;
+    return strtoull(report.c_str() + i + strlen(key) + 4, NULL, 10);
+}
+
+static bool runTest(const string &test)
+{
+    char tmp_template[] = "/tmp/divee_test.XXXXXX";
+    auto name = test.substr(test.find_last_of('/') + 1);
+    string input, gen, budget_text, report, expected, nodes_text, failed_node, flags_text, replicas_text, clients_text, responses;
+    string lines, output;
+    vector<Node> nodes;
+    vector<string> args;
+    map<string, double> budget, measured;
+    struct timespec start, end;
+    struct rusage usage;
+    bool ok = true;
+
+    if (!mkdtemp(tmp_template)) {
+        printf("FAIL %s: no temporary directory\n", name.c_str());
+        return false;
+    }
+    string tmp = tmp_template, base = test + (exists(test + "/base.hdb") ? "/base.hdb": "/base");
+    if (readFile(test + "/gen.args", gen)) {
+        if (!gen_path) {
+            printf("FAIL %s: generated base without --gen\n", name.c_str());
+            return false;
+        }
+        vector<string> args {gen_path};
+        for (auto &a: split(gen))
+            args.push_back(a);
+        base = tmp + "/base.hdb";
+        args.push_back(base);
+        if (run(args, tmp + "/gen.txt", &usage) != 0) {
+            printf("FAIL %s: divee_gen %s", name.c_str(), gen.c_str());
+            return false;
+        }
+    }
+    readFile(test + "/input.txt", input);
+    readFile(test + "/flags.txt", flags_text);
+    auto flags = split(flags_text);
+    bool clients = readFile(test + "/clients.txt", clients_text);
+    if (clients)
+        args = {divee_path, "--clients", "unix:" + tmp + "/clients.sock", "--dump-at-exit", tmp + "/dump"};
+    else
+        args = {divee_path, "--script", tmp + "/script.txt", "--report", tmp + "/report.json"};
+    args.insert(args.end(), flags.begin(), flags.end());
+    bool replicas = readFile(test + "/replicas.txt", replicas_text);
+    bool simulated = find(flags.begin(), flags.end(), "--simulate") != flags.end();
+    string dumps = "\ndump " + tmp + "/dump\n";
+    if (simulated && readFile(test + "/nodes.txt", nodes_text)) {
+        auto fields = split(nodes_text);
+
+        for (size_t i = 0; i + 1 < fields.size(); i += 2) {
+            args.insert(args.end(), {"--sim-node", fields[i] + "=" + test + "/" + fields[i + 1]});
+            if (replicas)
+                dumps += "sim dump " + fields[i] + " " + tmp + "/" + fields[i] + ".dump\n";
+        }
+    } else if (readFile(test + "/nodes.txt", nodes_text)) {
+        if (!startNodes(test, tmp, nodes_text, flags, nodes, replicas)) {
+            stopNodes(nodes, failed_node);
+            printf("FAIL %s: the nodes didn't start, see %s\n", name.c_str(), tmp.c_str());
+            return false;
+        }
+        args.insert(args.end(), {"--node", "main"});
+        for (auto &n: nodes)
+            args.insert(args.end(), {"--peer", n.id + "=unix:" + n.socket});
+    }
+    writeFile(tmp + "/script.txt", input + dumps);
+    args.push_back(base);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    auto status = clients ? serveClients(args, tmp, clients_text, responses, &usage): run(args, tmp + "/output.txt", &usage);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    auto node_status = stopNodes(nodes, failed_node);
+    readFile(tmp + "/report.json", report);
+    measured["time_ms"] = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    measured["allocated"] = reportValue(report, "allocated");
+    measured["rss_kb"] = usage.ru_maxrss;
+    if (status != 0) {
+        printf("FAIL %s: divee exited with %d, see %s/output.txt\n", name.c_str(), status, tmp.c_str());
+        return false;
+    }
+    if (node_status != 0) {
+        printf("FAIL %s: node %s exited with %d, see %s/%s.txt\n", name.c_str(), failed_node.c_str(), node_status, tmp.c_str(), failed_node.c_str());
+        return false;
+    }
+
+    auto dump = (clients ? "=== responses\n" + responses: string()) + normalizedDump(tmp + "/dump");
+    bool hashed = exists(test + "/expected.fnv") || (!gen.empty() && !exists(test + "/expected.txt"));
+    auto golden = test + (hashed ? "/expected.fnv": "/expected.txt");
+    auto actual = hashed ? fnv(dump) + "\n": dump;
+    if (update) {
+        writeFile(golden, actual);
+    } else if (!readFile(golden, expected)) {
+        printf("FAIL %s: no %s\n", name.c_str(), golden.c_str());
+        ok = false;
+    } else if (expected != actual) {
+        writeFile(tmp + "/actual.txt", dump);
+        printf("FAIL %s: the dump differs from %s, see %s/actual.txt\n", name.c_str(), golden.c_str(), tmp.c_str());
+        ok = false;
+    }
+    auto pairs = split(replicas_text);
+    for (size_t i = 0; i + 1 < pairs.size(); i += 2) {
+        auto mine = normalizedFile(tmp + "/dump/" + pairs[i + 1]);
+        auto theirs = normalizedFile(tmp + "/" + pairs[i] + ".dump/" + pairs[i + 1]);
+
+        if (mine.empty() || mine != theirs) {
+            printf("FAIL %s: %s differs from node %s's, see %s\n", name.c_str(), pairs[i + 1].c_str(), pairs[i].c_str(), tmp.c_str());
+            ok = false;
+        }
+    }
+    readFile(tmp + "/output.txt", output);
+    readFile(test + "/output.lines", lines);
+    size_t at = 0;
+    for (size_t b = 0, end; (end = lines.find('\n', b)) != string::npos; b = end + 1) {
+        auto line = lines.substr(b, end - b);
+        auto found = line.empty() ? at: output.find(line, at);
+
+        if (found == string::npos) {
+            printf("FAIL %s: no \"%s\" in the output after the lines before it, see %s/output.txt\n", name.c_str(), line.c_str(), tmp.c_str());
+            ok = false;
+            break;
+        }
+        at = found + line.size();
+    }
+
+    readFile(test + "/budget.txt", budget_text);
+    auto fields = split(budget_text);
+    for (size_t i = 0; i + 1 < fields.size(); i += 2)
+        budget[fields[i]] = atof(fields[i + 1].c_str());
+    for (auto &m: measured) {
+        auto b = budget.find(m.first);
+        bool over = b != budget.end() && m.second > b->second;
+
+        printf("%s %s %.0f", over ? "OVER": "    ", m.first.c_str(), m.second);
+        if (b != budget.end())
+            printf(" (budget %.0f)", b->second);
+        printf("\n");
+        if (over && !update)
+            ok = false;
+    }
+    printf("%s %s\n", ok ? "PASS": "FAIL", name.c_str());
+    if (ok)
+        nftw(tmp.c_str(), removeFile, 16, FTW_DEPTH | FTW_PHYS);
+    return ok;
+}
+
+static void usage()
+{
+    printf("usage: divee_test --divee <divee> [--gen <divee_gen>] [--update] <test dir>...\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    vector<string> tests;
+    unsigned failed = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--divee") && i + 1 < argc)
+            divee_path = argv[++i];
+        else if (!strcmp(argv[i], "--gen") && i + 1 < argc)
+            gen_path = argv[++i];
+        else if (!strcmp(argv[i], "--update"))
+            update = true;
+        else if (argv[i][0] == '-')
+            usage();
+        else
+            tests.push_back(argv[i]);
+    }
+    if (!divee_path || tests.empty())
+        usage();
+    for (auto &t: tests) {
+        auto test = t;
+        while (test.size() > 1 && test.back() == '/')
+            test.pop_back();
+        if (!runTest(test))
+            failed++;
+    }
+    if (tests.size() > 1)
+        printf("%zu tests, %u failed\n", tests.size(), failed);
+    return failed ? 1: 0;
+}